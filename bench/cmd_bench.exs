@@ -0,0 +1,154 @@
+# Compare how long it takes to run a short program with MuonTrap.cmd/3 and
+# System.cmd/3 as the number of concurrent callers grows.
+#
+# Run with `mix bench [options]`:
+#
+#   --count <n>            runs per method and concurrency (default 500)
+#   --max-concurrency <n>  run with 1, 2, 4, ... up to this many callers
+#                          (default System.schedulers_online())
+#   --program <path>       program to run (default "true")
+#   --controller <name>    also run in cgroups with this controller
+#   --cgroup-base <path>   cgroup to create groups under (default "muontrap_bench")
+#   --uid <user>           also run as this user (needs root)
+#   --output <path>        write results here rather than stdout
+#
+# Output is one CSV line per method and concurrency. Latencies are in
+# microseconds. The columns are the same as bench/cmd_latency.c so that
+# results from inside and outside of the VM can be compared.
+
+defmodule CmdBench do
+  @switches [
+    count: :integer,
+    max_concurrency: :integer,
+    program: :string,
+    controller: :string,
+    cgroup_base: :string,
+    uid: :string,
+    output: :string
+  ]
+
+  def main(argv) do
+    {opts, _args} = OptionParser.parse!(argv, strict: @switches)
+
+    count = Keyword.get(opts, :count, 500)
+    max_concurrency = Keyword.get(opts, :max_concurrency, System.schedulers_online())
+    program = Keyword.get(opts, :program, "true")
+
+    device =
+      case Keyword.fetch(opts, :output) do
+        {:ok, path} -> File.open!(path, [:write])
+        :error -> :stdio
+      end
+
+    {:ok, server} = MuonTrap.Server.start_link()
+    pool = start_pool(opts)
+
+    IO.puts(device, "method,concurrency,count,p50_us,p99_us,max_us,rate_per_s")
+
+    for {name, fun} <- methods(opts, server, pool),
+        concurrency <- concurrency_levels(max_concurrency) do
+      IO.puts(device, run(name, fun, program, concurrency, count))
+    end
+
+    # Stop the pool so that it removes its groups
+    if pool, do: GenServer.stop(pool)
+    GenServer.stop(server)
+
+    if device != :stdio, do: File.close(device)
+  end
+
+  defp start_pool(opts) do
+    case Keyword.fetch(opts, :controller) do
+      {:ok, controller} ->
+        base = Keyword.get(opts, :cgroup_base, "muontrap_bench")
+
+        {:ok, pool} =
+          MuonTrap.CgroupPool.start_link(
+            cgroup_base: Path.join(base, "pool"),
+            cgroup_controllers: [controller],
+            size: 16
+          )
+
+        pool
+
+      :error ->
+        nil
+    end
+  end
+
+  defp methods(opts, server, pool) do
+    [
+      {"system_cmd", &System.cmd(&1, [])},
+      {"muontrap_cmd", &MuonTrap.cmd(&1, [])},
+      {"muontrap_server", &MuonTrap.cmd(&1, [], server: server)}
+    ] ++ cgroup_methods(opts, pool) ++ uid_methods(opts)
+  end
+
+  defp cgroup_methods(opts, pool) do
+    case Keyword.fetch(opts, :controller) do
+      {:ok, controller} ->
+        base = Keyword.get(opts, :cgroup_base, "muontrap_bench")
+        cgroup_opts = [cgroup_controllers: [controller], cgroup_base: base]
+
+        [
+          {"muontrap_cgroup", &MuonTrap.cmd(&1, [], cgroup_opts)},
+          {"muontrap_cgroup_pool", &MuonTrap.cmd(&1, [], cgroup_pool: pool)}
+        ]
+
+      :error ->
+        []
+    end
+  end
+
+  defp uid_methods(opts) do
+    case Keyword.fetch(opts, :uid) do
+      {:ok, uid} -> [{"muontrap_uid", &MuonTrap.cmd(&1, [], uid: uid)}]
+      :error -> []
+    end
+  end
+
+  defp concurrency_levels(max) do
+    Stream.iterate(1, &(&1 * 2)) |> Enum.take_while(&(&1 <= max))
+  end
+
+  defp run(name, fun, program, concurrency, count) do
+    # Warm up so that the first run's costs don't skew the results
+    {_output, 0} = fun.(program)
+
+    start = System.monotonic_time()
+
+    samples =
+      1..concurrency
+      |> Enum.map(fn caller ->
+        runs = div(count, concurrency) + if caller <= rem(count, concurrency), do: 1, else: 0
+        Task.async(fn -> Enum.map(List.duplicate(program, runs), &time_run(fun, &1)) end)
+      end)
+      |> Enum.flat_map(&Task.await(&1, :infinity))
+      |> Enum.sort()
+
+    elapsed_us = System.convert_time_unit(System.monotonic_time() - start, :native, :microsecond)
+    rate = Float.round(length(samples) * 1_000_000 / max(elapsed_us, 1), 1)
+
+    Enum.join(
+      [
+        name,
+        concurrency,
+        length(samples),
+        percentile(samples, 50),
+        percentile(samples, 99),
+        List.last(samples),
+        rate
+      ],
+      ","
+    )
+  end
+
+  defp time_run(fun, program) do
+    {us, {_output, 0}} = :timer.tc(fun, [program])
+    us
+  end
+
+  defp percentile(sorted, p), do: Enum.at(sorted, div(length(sorted) * p, 100))
+end
+
+CmdBench.main(System.argv())
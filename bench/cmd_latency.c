@@ -0,0 +1,199 @@
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Measure how long it takes to run a program through muontrap without the
+// Erlang VM in the way. Each method runs the program a fixed number of times
+// with 1, 2, 4, ... up to the maximum number of runs in flight at once. A new
+// run starts as soon as one finishes, so the rate is the maximum sustained
+// rate for that concurrency.
+//
+// Usage: cmd_latency.bench -m <path to muontrap> [options]
+//
+//   -n <count>       runs per method and concurrency (default 500)
+//   -j <max>         maximum concurrency (default 8)
+//   -p <program>     program to run (default /bin/true)
+//   -c <controller>  also run in a new cgroup per run with this controller
+//   -g <base>        cgroup to create the groups under (default muontrap_bench)
+//   -u <user>        also run as this user (needs root)
+//
+// Output is one CSV line per method and concurrency. Latencies are in
+// microseconds and the same columns as bench/cmd_bench.exs so that results
+// can be compared.
+
+#define MAX_ARGS 16
+
+struct method {
+    const char *name;
+    char *argv[MAX_ARGS];
+    int group_arg; // Index of the --group argument or -1
+};
+
+struct run {
+    pid_t pid;
+    int64_t start;
+};
+
+static char *program = "/bin/true";
+static char *muontrap = NULL;
+static char *controller = NULL;
+static char *cgroup_base = "muontrap_bench";
+static char *user = NULL;
+
+extern char **environ;
+
+static int64_t microsecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static pid_t start_run(struct method *method, int index)
+{
+    char group[256];
+    if (method->group_arg >= 0) {
+        // Every run gets its own group like :cgroup_base does
+        snprintf(group, sizeof(group), "%s/%d", cgroup_base, index);
+        method->argv[method->group_arg] = group;
+    }
+
+    pid_t pid;
+    int rc = posix_spawn(&pid, method->argv[0], NULL, NULL, method->argv, environ);
+    if (rc != 0) {
+        errno = rc;
+        err(EXIT_FAILURE, "posix_spawn(%s)", method->argv[0]);
+    }
+    return pid;
+}
+
+static void run(struct method *method, int concurrency, int count)
+{
+    int64_t *samples = malloc(count * sizeof(int64_t));
+    struct run *runs = calloc(concurrency, sizeof(struct run));
+    int started = 0;
+    int finished = 0;
+
+    int64_t begin = microsecs();
+    for (int i = 0; i < concurrency && started < count; i++, started++) {
+        runs[i].start = microsecs();
+        runs[i].pid = start_run(method, started);
+    }
+
+    while (finished < count) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+            err(EXIT_FAILURE, "waitpid");
+
+        int64_t now = microsecs();
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            errx(EXIT_FAILURE, "%s failed to run %s", method->name, program);
+
+        for (int i = 0; i < concurrency; i++) {
+            if (runs[i].pid != pid)
+                continue;
+
+            samples[finished++] = now - runs[i].start;
+            if (started < count) {
+                runs[i].start = microsecs();
+                runs[i].pid = start_run(method, started++);
+            } else {
+                runs[i].pid = 0;
+            }
+            break;
+        }
+    }
+    int64_t elapsed = microsecs() - begin;
+
+    qsort(samples, count, sizeof(int64_t), compare_int64);
+    printf("%s,%d,%d,%lld,%lld,%lld,%.1f\n",
+           method->name,
+           concurrency,
+           count,
+           (long long) samples[count / 2],
+           (long long) samples[(count * 99) / 100],
+           (long long) samples[count - 1],
+           elapsed > 0 ? count * 1000000.0 / elapsed : 0.0);
+    fflush(stdout);
+    free(runs);
+    free(samples);
+}
+
+static void set_argv(struct method *method, const char *name, char *const *args)
+{
+    int i = 0;
+    method->name = name;
+    method->group_arg = -1;
+    for (; args[i] != NULL; i++) {
+        if (strcmp(args[i], "--group") == 0)
+            method->group_arg = i + 1;
+        method->argv[i] = args[i];
+    }
+    method->argv[i] = NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = 500;
+    int max_concurrency = 8;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:g:j:m:n:p:u:")) != -1) {
+        switch (opt) {
+        case 'c': controller = optarg; break;
+        case 'g': cgroup_base = optarg; break;
+        case 'j': max_concurrency = atoi(optarg); break;
+        case 'm': muontrap = optarg; break;
+        case 'n': count = atoi(optarg); break;
+        case 'p': program = optarg; break;
+        case 'u': user = optarg; break;
+        default:
+            errx(EXIT_FAILURE, "See the comment at the top of cmd_latency.c for usage");
+        }
+    }
+
+    if (!muontrap)
+        errx(EXIT_FAILURE, "Specify the path to muontrap with -m");
+    if (count <= 0 || max_concurrency <= 0)
+        errx(EXIT_FAILURE, "Specify a positive count and concurrency");
+
+    struct method methods[4];
+    int method_count = 0;
+
+    set_argv(&methods[method_count++], "direct", (char *[]) { program, NULL });
+    set_argv(&methods[method_count++], "muontrap",
+             (char *[]) { muontrap, "--", program, NULL });
+    if (controller) {
+        // The group is filled in for each run
+        set_argv(&methods[method_count++], "muontrap_cgroup",
+                 (char *[]) { muontrap, "--controller", controller, "--group", cgroup_base,
+                              "--", program, NULL });
+    }
+    if (user) {
+        set_argv(&methods[method_count++], "muontrap_uid",
+                 (char *[]) { muontrap, "--uid", user, "--", program, NULL });
+    }
+
+    printf("method,concurrency,count,p50_us,p99_us,max_us,rate_per_s\n");
+    for (int i = 0; i < method_count; i++) {
+        for (int concurrency = 1; concurrency <= max_concurrency; concurrency *= 2)
+            run(&methods[i], concurrency, count);
+    }
+    return 0;
+}
@@ -0,0 +1,233 @@
+# Start lots of MuonTrap.Daemons under one supervisor and measure what they
+# cost. Linux only since it reads /proc.
+#
+# Run with `mix run bench/daemon_scale_bench.exs [options]`:
+#
+#   --count <n>            number of daemons, may be repeated (default 100 and 1000)
+#   --controller <name>    run each daemon in its own cgroup with this controller
+#   --cgroup-base <path>   cgroup to create groups under (default "muontrap_bench")
+#   --output <path>        write results here rather than stdout
+#
+# Each daemon runs `sleep`. Thousands of daemons need more file descriptors
+# and ports than the defaults, so raise `ulimit -n` and pass `+Q` to the VM
+# with `ELIXIR_ERL_OPTIONS`.
+#
+# Output is one CSV line per count:
+#
+# * `startup_ms` - from starting the supervisor until every `sleep` is running
+# * `shutdown_ms` - how long stopping the supervisor takes
+# * `cleanup_ms` - from stopping the supervisor until every `muontrap` is gone
+# * `launcher_rss_kb_avg`, `launcher_rss_kb_max` - each `muontrap`'s RSS
+# * `launcher_fds_avg` - open files in each `muontrap`
+# * `beam_fds_per_daemon`, `beam_memory_kb_per_daemon` - what the VM used
+# * `zombies`, `leftover_processes`, `leftover_cgroups` - leaks found after
+#   cleanup. These should all be 0.
+
+defmodule DaemonScaleBench do
+  @switches [count: :keep, controller: :string, cgroup_base: :string, output: :string]
+
+  @wait_timeout_ms 60_000
+
+  def main(argv) do
+    {opts, _args} = OptionParser.parse!(argv, strict: @switches)
+
+    counts =
+      case Keyword.get_values(opts, :count) do
+        [] -> [100, 1000]
+        counts -> Enum.map(counts, &String.to_integer/1)
+      end
+
+    device =
+      case Keyword.fetch(opts, :output) do
+        {:ok, path} -> File.open!(path, [:write])
+        :error -> :stdio
+      end
+
+    # The Daemons log when their commands exit
+    Logger.configure(level: :warn)
+
+    IO.puts(
+      device,
+      "daemons,startup_ms,shutdown_ms,cleanup_ms,launcher_rss_kb_avg,launcher_rss_kb_max," <>
+        "launcher_fds_avg,beam_fds_per_daemon,beam_memory_kb_per_daemon," <>
+        "zombies,leftover_processes,leftover_cgroups"
+    )
+
+    for count <- counts do
+      IO.puts(device, run(count, opts))
+    end
+
+    if device != :stdio, do: File.close(device)
+  end
+
+  defp run(count, opts) do
+    sleep = System.find_executable("sleep")
+    daemon_opts = cgroup_opts(opts)
+
+    children =
+      for i <- 1..count do
+        Supervisor.child_spec({MuonTrap.Daemon, [sleep, ["3600"], daemon_opts]}, id: i)
+      end
+
+    beam_pid = String.to_integer(to_string(:os.getpid()))
+    beam_fds = count_fds(beam_pid)
+    beam_memory = :erlang.memory(:total)
+
+    start = System.monotonic_time()
+    {:ok, sup} = Supervisor.start_link(children, strategy: :one_for_one, max_restarts: 0)
+
+    os_pids =
+      sup
+      |> Supervisor.which_children()
+      |> Enum.map(fn {_id, pid, _type, _modules} -> MuonTrap.Daemon.os_pid(pid) end)
+
+    launchers = MapSet.new(os_pids)
+    :ok = wait_until(fn -> all_running?(launchers) end)
+    startup_ms = elapsed_ms(start)
+
+    table = process_table()
+    commands = for {pid, {_state, ppid}} <- table, ppid in launchers, do: pid
+    parents = for pid <- os_pids, {_state, ppid} <- [table[pid]], into: MapSet.new(), do: ppid
+
+    rss = Enum.map(os_pids, &rss_kb/1)
+    launcher_fds = Enum.map(os_pids, &count_fds/1)
+    beam_fds_per_daemon = (count_fds(beam_pid) - beam_fds) / count
+    beam_memory_kb = (:erlang.memory(:total) - beam_memory) / count / 1024
+
+    start = System.monotonic_time()
+    :ok = Supervisor.stop(sup)
+    shutdown_ms = elapsed_ms(start)
+
+    watched = MapSet.union(launchers, MapSet.new(commands))
+    _ =
+      wait_until(fn ->
+        table = process_table()
+        not Enum.any?(watched, &running?(table, &1))
+      end)
+
+    cleanup_ms = elapsed_ms(start)
+
+    table = process_table()
+
+    zombies =
+      Enum.count(table, fn {pid, {state, ppid}} ->
+        state == "Z" and (pid in watched or ppid in watched or ppid in parents)
+      end)
+
+    leftovers = Enum.count(watched, &running?(table, &1))
+
+    Enum.join(
+      [
+        count,
+        startup_ms,
+        shutdown_ms,
+        cleanup_ms,
+        round(Enum.sum(rss) / count),
+        Enum.max(rss),
+        Float.round(Enum.sum(launcher_fds) / count, 1),
+        Float.round(beam_fds_per_daemon, 1),
+        Float.round(beam_memory_kb, 1),
+        zombies,
+        leftovers,
+        leftover_cgroups(opts)
+      ],
+      ","
+    )
+  end
+
+  defp cgroup_opts(opts) do
+    case Keyword.fetch(opts, :controller) do
+      {:ok, controller} ->
+        [cgroup_controllers: [controller], cgroup_base: cgroup_base(opts)]
+
+      :error ->
+        []
+    end
+  end
+
+  defp cgroup_base(opts), do: Keyword.get(opts, :cgroup_base, "muontrap_bench")
+
+  defp leftover_cgroups(opts) do
+    case Keyword.fetch(opts, :controller) do
+      {:ok, controller} ->
+        path = Path.join(["/sys/fs/cgroup", controller, cgroup_base(opts)])
+
+        path
+        |> File.ls!()
+        |> Enum.count(&File.dir?(Path.join(path, &1)))
+
+      :error ->
+        0
+    end
+  end
+
+  # Every muontrap has started its command
+  defp all_running?(launchers) do
+    parents = for {_pid, {_state, ppid}} <- process_table(), into: MapSet.new(), do: ppid
+    MapSet.subset?(launchers, parents)
+  end
+
+  defp running?(table, pid) do
+    case Map.fetch(table, pid) do
+      {:ok, {state, _ppid}} -> state != "Z"
+      :error -> false
+    end
+  end
+
+  # Return %{pid => {state, ppid}} for every process
+  defp process_table() do
+    "/proc"
+    |> File.ls!()
+    |> Enum.reduce(%{}, fn name, acc ->
+      with {pid, ""} <- Integer.parse(name),
+           {:ok, stat} <- File.read("/proc/#{name}/stat"),
+           [state, ppid | _] <- stat |> after_command_name() |> String.split() do
+        Map.put(acc, pid, {state, String.to_integer(ppid)})
+      else
+        _ -> acc
+      end
+    end)
+  end
+
+  # The command name is in parentheses and can contain spaces and parentheses
+  defp after_command_name(stat) do
+    {pos, 1} = :binary.matches(stat, ")") |> List.last()
+    binary_part(stat, pos + 1, byte_size(stat) - pos - 1)
+  end
+
+  defp rss_kb(pid) do
+    with {:ok, status} <- File.read("/proc/#{pid}/status"),
+         [_, kb] <- Regex.run(~r/VmRSS:\s+(\d+) kB/, status) do
+      String.to_integer(kb)
+    else
+      _ -> 0
+    end
+  end
+
+  defp count_fds(pid) do
+    case File.ls("/proc/#{pid}/fd") do
+      {:ok, fds} -> length(fds)
+      _ -> 0
+    end
+  end
+
+  defp wait_until(fun, waited \\ 0) do
+    cond do
+      fun.() ->
+        :ok
+
+      waited >= @wait_timeout_ms ->
+        :timeout
+
+      true ->
+        Process.sleep(10)
+        wait_until(fun, waited + 10)
+    end
+  end
+
+  defp elapsed_ms(start) do
+    System.convert_time_unit(System.monotonic_time() - start, :native, :millisecond)
+  end
+end
+
+DaemonScaleBench.main(System.argv())
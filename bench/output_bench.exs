@@ -0,0 +1,148 @@
+# Measure how fast output from a command gets to Elixir with and without
+# `:output_chunk_size`, for both MuonTrap.cmd/3 and MuonTrap.Daemon.
+#
+# Build the output source with `make -C bench` and run with
+# `mix run bench/output_bench.exs [options]`:
+#
+#   --bytes <n>         bytes of output per run (default 100_000_000)
+#   --write-size <n>    bytes per write by the command (default 4096)
+#   --line-length <n>   bytes per line of output (default 80)
+#   --chunk-size <n>    output chunk size to try, may be repeated
+#                       (default 65536 and 1048576)
+#   --runs <n>          runs per method, the best is reported (default 3)
+#   --output <path>     write results here rather than stdout
+#
+# The Daemons don't log, so this measures getting the output to the Daemon
+# process and `{:line, 256}` splitting for the default mode. Output is one
+# CSV line per method. `messages` is how many pieces the collectable got
+# (cmd only) and `scheduler_utilization` is the fraction of the VM's
+# scheduler time that was busy during the run.
+
+defmodule OutputBench do
+  defmodule Counter do
+    @moduledoc false
+    defstruct bytes: 0, messages: 0
+
+    defimpl Collectable do
+      def into(counter) do
+        {counter,
+         fn
+           acc, {:cont, data} ->
+             %{acc | bytes: acc.bytes + byte_size(data), messages: acc.messages + 1}
+
+           acc, :done ->
+             acc
+
+           _acc, :halt ->
+             :ok
+         end}
+      end
+    end
+  end
+
+  @switches [
+    bytes: :integer,
+    write_size: :integer,
+    line_length: :integer,
+    chunk_size: :keep,
+    runs: :integer,
+    output: :string
+  ]
+
+  def main(argv) do
+    {opts, _args} = OptionParser.parse!(argv, strict: @switches)
+
+    source = Path.expand("output_source.bench", __DIR__)
+
+    unless File.exists?(source) do
+      raise "Build #{source} with `make -C bench` first"
+    end
+
+    bytes = Keyword.get(opts, :bytes, 100_000_000)
+
+    args = [
+      "-b",
+      to_string(bytes),
+      "-w",
+      to_string(Keyword.get(opts, :write_size, 4096)),
+      "-l",
+      to_string(Keyword.get(opts, :line_length, 80))
+    ]
+
+    chunk_sizes =
+      case Keyword.get_values(opts, :chunk_size) do
+        [] -> [65536, 1_048_576]
+        sizes -> Enum.map(sizes, &String.to_integer/1)
+      end
+
+    runs = Keyword.get(opts, :runs, 3)
+
+    device =
+      case Keyword.fetch(opts, :output) do
+        {:ok, path} -> File.open!(path, [:write])
+        :error -> :stdio
+      end
+
+    _ = :erlang.system_flag(:scheduler_wall_time, true)
+
+    IO.puts(device, "method,chunk_size,bytes,messages,mb_per_s,scheduler_utilization")
+
+    for {name, chunk_size, fun} <- methods(chunk_sizes) do
+      {us, messages, utilization} =
+        1..runs
+        |> Enum.map(fn _ -> measure(fun, source, args) end)
+        |> Enum.min_by(&elem(&1, 0))
+
+      mb_per_s = Float.round(bytes / max(us, 1), 1)
+      line = [name, chunk_size, bytes, messages, mb_per_s, utilization]
+      IO.puts(device, Enum.join(line, ","))
+    end
+
+    if device != :stdio, do: File.close(device)
+  end
+
+  defp methods(chunk_sizes) do
+    [{"cmd_stream", "", &cmd(&1, &2, [])}] ++
+      Enum.map(chunk_sizes, &{"cmd_chunked", &1, chunked(:cmd, &1)}) ++
+      [{"daemon_line", "", &daemon(&1, &2, [])}] ++
+      Enum.map(chunk_sizes, &{"daemon_chunked", &1, chunked(:daemon, &1)})
+  end
+
+  defp chunked(:cmd, size), do: &cmd(&1, &2, output_chunk_size: size)
+  defp chunked(:daemon, size), do: &daemon(&1, &2, output_chunk_size: size)
+
+  defp measure(fun, source, args) do
+    before = :erlang.statistics(:scheduler_wall_time)
+    {us, messages} = :timer.tc(fun, [source, args])
+    later = :erlang.statistics(:scheduler_wall_time)
+
+    {us, messages, utilization(before, later)}
+  end
+
+  defp cmd(source, args, opts) do
+    {%Counter{messages: messages}, 0} = MuonTrap.cmd(source, args, [into: %Counter{}] ++ opts)
+    messages
+  end
+
+  # Daemons don't say how many messages they got
+  defp daemon(source, args, opts) do
+    {:ok, pid} = GenServer.start(MuonTrap.Daemon, [source, args, opts])
+    ref = Process.monitor(pid)
+
+    receive do
+      {:DOWN, ^ref, :process, ^pid, :normal} -> ""
+    end
+  end
+
+  defp utilization(before, later) do
+    {active, total} =
+      Enum.zip(Enum.sort(before), Enum.sort(later))
+      |> Enum.reduce({0, 0}, fn {{id, active0, total0}, {id, active1, total1}}, {a, t} ->
+        {a + active1 - active0, t + total1 - total0}
+      end)
+
+    Float.round(active / max(total, 1), 3)
+  end
+end
+
+OutputBench.main(System.argv())
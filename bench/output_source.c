@@ -0,0 +1,54 @@
+#include <err.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Write lots of output as fast as possible for bench/output_bench.exs
+//
+// Usage: output_source.bench [-b bytes] [-w write size] [-l line length]
+//
+//   -b <bytes>        total bytes to write (default 100000000)
+//   -w <write size>   bytes per write(2) (default 4096)
+//   -l <line length>  bytes per line including the newline (default 80)
+//
+// Lines are filled with letters so that they look like log output.
+
+int main(int argc, char *argv[])
+{
+    long long total = 100000000;
+    size_t write_size = 4096;
+    size_t line_length = 80;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:l:w:")) != -1) {
+        switch (opt) {
+        case 'b': total = atoll(optarg); break;
+        case 'l': line_length = strtoul(optarg, NULL, 0); break;
+        case 'w': write_size = strtoul(optarg, NULL, 0); break;
+        default:
+            errx(EXIT_FAILURE, "See the comment at the top of output_source.c for usage");
+        }
+    }
+
+    if (write_size == 0 || line_length == 0)
+        errx(EXIT_FAILURE, "Specify a positive write size and line length");
+
+    char *buffer = malloc(write_size);
+    if (!buffer)
+        err(EXIT_FAILURE, "malloc");
+    for (size_t i = 0; i < write_size; i++)
+        buffer[i] = (i % line_length == line_length - 1) ? '\n' : 'a' + (i % 26);
+
+    while (total > 0) {
+        size_t len = total < (long long) write_size ? (size_t) total : write_size;
+        ssize_t amt = write(STDOUT_FILENO, buffer, len);
+        if (amt < 0)
+            err(EXIT_FAILURE, "write");
+        total -= amt;
+    }
+
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include <err.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Measure how long it takes to start a program as the parent's memory use
+// grows. This compares fork() to the CLONE_VM | CLONE_VFORK approach that
+// muontrap uses (see spawn_child in src/muontrap.c).
+//
+// Usage: spawn_latency.bench [iterations] [program] [cgroup v2 group]
+//
+// With a cgroup v2 group, this also compares two ways of starting the child
+// in the group: clone3(CLONE_INTO_CGROUP), which can't share memory, and
+// having a CLONE_VM | CLONE_VFORK child write to the group's cgroup.procs.
+//
+// Output is one CSV line per RSS size and method with latencies in
+// microseconds.
+
+#define CHILD_STACK_SIZE (256 * 1024)
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+#ifndef __NR_clone3
+#define __NR_clone3 435
+#endif
+
+struct clone3_args {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t child_tid;
+    uint64_t parent_tid;
+    uint64_t exit_signal;
+    uint64_t stack;
+    uint64_t stack_size;
+    uint64_t tls;
+    uint64_t set_tid;
+    uint64_t set_tid_size;
+    uint64_t cgroup;
+};
+
+static char *program = "/bin/true";
+static char *child_argv[] = { NULL, NULL };
+static int cgroup_fd = -1;
+static int procs_fd = -1;
+
+static int64_t microsecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static int exec_child(void *arg)
+{
+    execv(program, child_argv);
+    _exit(EXIT_FAILURE);
+}
+
+static pid_t spawn_fork()
+{
+    pid_t pid = fork();
+    if (pid == 0)
+        exec_child(NULL);
+    return pid;
+}
+
+static pid_t spawn_clone_vfork()
+{
+    static void *child_stack = NULL;
+    if (!child_stack) {
+        child_stack = mmap(NULL, CHILD_STACK_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (child_stack == MAP_FAILED)
+            err(EXIT_FAILURE, "mmap");
+    }
+    return clone(exec_child, (char *) child_stack + CHILD_STACK_SIZE,
+                 CLONE_VM | CLONE_VFORK | SIGCHLD, NULL);
+}
+
+static int exec_child_in_cgroup(void *arg)
+{
+    if (write(procs_fd, "0", 1) < 0)
+        _exit(EXIT_FAILURE);
+    return exec_child(arg);
+}
+
+static pid_t spawn_clone_vfork_procs()
+{
+    static void *child_stack = NULL;
+    if (!child_stack) {
+        child_stack = mmap(NULL, CHILD_STACK_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (child_stack == MAP_FAILED)
+            err(EXIT_FAILURE, "mmap");
+    }
+    return clone(exec_child_in_cgroup, (char *) child_stack + CHILD_STACK_SIZE,
+                 CLONE_VM | CLONE_VFORK | SIGCHLD, NULL);
+}
+
+static pid_t spawn_clone3_cgroup()
+{
+    struct clone3_args args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_VFORK | CLONE_INTO_CGROUP;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = cgroup_fd;
+
+    pid_t pid = syscall(__NR_clone3, &args, sizeof(args));
+    if (pid == 0)
+        exec_child(NULL);
+    return pid;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void run(const char *name, pid_t (*spawn)(), int rss_mb, int iterations)
+{
+    int64_t *samples = malloc(iterations * sizeof(int64_t));
+
+    for (int i = 0; i < iterations; i++) {
+        int64_t start = microsecs();
+        pid_t pid = spawn();
+        if (pid < 0)
+            err(EXIT_FAILURE, "%s", name);
+
+        // Only measure the time to get the child going, not how long it runs.
+        // With CLONE_VFORK, that includes the exec since we wait for it.
+        samples[i] = microsecs() - start;
+
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            errx(EXIT_FAILURE, "%s failed to run %s", name, program);
+    }
+
+    qsort(samples, iterations, sizeof(int64_t), compare_int64);
+    printf("%d,%s,%lld,%lld,%lld\n",
+           rss_mb,
+           name,
+           (long long) samples[iterations / 2],
+           (long long) samples[(iterations * 99) / 100],
+           (long long) samples[iterations - 1]);
+    fflush(stdout);
+    free(samples);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    if (argc > 2)
+        program = argv[2];
+    child_argv[0] = program;
+
+    if (iterations <= 0)
+        errx(EXIT_FAILURE, "Specify a positive number of iterations");
+
+    if (argc > 3) {
+        cgroup_fd = open(argv[3], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cgroup_fd < 0)
+            err(EXIT_FAILURE, "open(%s)", argv[3]);
+        procs_fd = openat(cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        if (procs_fd < 0)
+            err(EXIT_FAILURE, "open(%s/cgroup.procs)", argv[3]);
+    }
+
+    static const int rss_sizes_mb[] = { 0, 64, 256, 1024 };
+    char *memory = NULL;
+    size_t allocated = 0;
+
+    printf("rss_mb,method,p50_us,p99_us,max_us\n");
+    for (size_t i = 0; i < sizeof(rss_sizes_mb) / sizeof(rss_sizes_mb[0]); i++) {
+        size_t wanted = (size_t) rss_sizes_mb[i] * 1024 * 1024;
+        if (wanted > allocated) {
+            memory = realloc(memory, wanted);
+            if (!memory)
+                err(EXIT_FAILURE, "realloc(%zu)", wanted);
+
+            // Touch every page so that it's really part of the RSS
+            memset(memory + allocated, 1, wanted - allocated);
+            allocated = wanted;
+        }
+
+        run("fork", spawn_fork, rss_sizes_mb[i], iterations);
+        run("clone_vfork", spawn_clone_vfork, rss_sizes_mb[i], iterations);
+        if (cgroup_fd >= 0) {
+            run("clone3_into_cgroup", spawn_clone3_cgroup, rss_sizes_mb[i], iterations);
+            run("clone_vfork_procs", spawn_clone_vfork_procs, rss_sizes_mb[i], iterations);
+        }
+    }
+
+    free(memory);
+    return 0;
+}
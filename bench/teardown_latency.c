@@ -0,0 +1,227 @@
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Measure how long muontrap takes to clean up process trees of different
+// sizes. This times from closing muontrap's stdin, which is what happens when
+// the Erlang port closes, to muontrap exiting. muontrap exits after it has
+// killed everything and removed the cgroup. The trees come from
+// test/process_tree.test.
+//
+// Usage: teardown_latency.bench -m <path to muontrap> [options]
+//
+//   -t <path>        path to process_tree.test (default ../test/process_tree.test)
+//   -c <controller>  run in a cgroup with this controller
+//   -g <base>        cgroup to create groups under (default muontrap_bench)
+//   -f <fanout>      children per process (default 4)
+//   -d <depth>       run trees with depth 1 up to this (default 5)
+//   -n <iterations>  runs per tree (default 5)
+//   -k <ms>          muontrap's delay to SIGKILL in milliseconds (default 100)
+//   -r <path>        pass --cgroup-root to muontrap, e.g., to use a root made by
+//                    test/fake_cgroupfs.test
+//
+// Without -c, muontrap runs with --subreaper so that it can find the tree.
+// With -r and a fake cgroupfs, the times include the fake's polling, so
+// compare them to other runs on the fake rather than to real cgroups.
+//
+// Output is one CSV line per tree. Times are in microseconds.
+
+static char *muontrap = NULL;
+static char *tree_program = "../test/process_tree.test";
+static char *controller = NULL;
+static char *cgroup_base = "muontrap_bench";
+static char *cgroup_root = NULL;
+
+static int64_t microsecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Groups are under the controller's directory unless it's cgroup v2
+static char *group_dir(const char *group)
+{
+    const char *root = cgroup_root ? cgroup_root : "/sys/fs/cgroup";
+    char *controllers;
+    char *path;
+    if (asprintf(&controllers, "%s/cgroup.controllers", root) < 0)
+        err(EXIT_FAILURE, "asprintf");
+
+    int rc;
+    if (access(controllers, F_OK) == 0)
+        rc = asprintf(&path, "%s/%s", root, group);
+    else
+        rc = asprintf(&path, "%s/%s/%s", root, controller, group);
+    if (rc < 0)
+        err(EXIT_FAILURE, "asprintf");
+    free(controllers);
+    return path;
+}
+
+// Start the tree, wait for it to be ready and return the teardown time
+static int64_t run_once(int depth, int fanout, const char *variant, const char *delay_us,
+                        int iteration, long *processes)
+{
+    char group[256];
+    char depth_arg[16];
+    char fanout_arg[16];
+    snprintf(group, sizeof(group), "%s/teardown%d", cgroup_base, iteration);
+    snprintf(depth_arg, sizeof(depth_arg), "%d", depth);
+    snprintf(fanout_arg, sizeof(fanout_arg), "%d", fanout);
+
+    char *argv[20];
+    int argc = 0;
+    argv[argc++] = muontrap;
+    argv[argc++] = "--delay-to-sigkill";
+    argv[argc++] = (char *) delay_us;
+    if (controller) {
+        argv[argc++] = "--controller";
+        argv[argc++] = controller;
+        argv[argc++] = "--group";
+        argv[argc++] = group;
+        if (cgroup_root) {
+            argv[argc++] = "--cgroup-root";
+            argv[argc++] = cgroup_root;
+        }
+    } else {
+        argv[argc++] = "--subreaper";
+    }
+    argv[argc++] = "--";
+    argv[argc++] = tree_program;
+    argv[argc++] = "-d";
+    argv[argc++] = depth_arg;
+    argv[argc++] = "-f";
+    argv[argc++] = fanout_arg;
+    if (strcmp(variant, "ignore_sigterm") == 0)
+        argv[argc++] = "-i";
+    else if (strcmp(variant, "fork_during_kill") == 0)
+        argv[argc++] = "-k";
+    argv[argc] = NULL;
+
+    int stdin_pipe[2];
+    int stdout_pipe[2];
+    if (pipe(stdin_pipe) < 0 || pipe(stdout_pipe) < 0)
+        err(EXIT_FAILURE, "pipe");
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, stdin_pipe[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, stdout_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, stdin_pipe[1]);
+    posix_spawn_file_actions_addclose(&actions, stdout_pipe[0]);
+
+    pid_t pid;
+    extern char **environ;
+    int rc = posix_spawn(&pid, muontrap, &actions, NULL, argv, environ);
+    if (rc != 0) {
+        errno = rc;
+        err(EXIT_FAILURE, "posix_spawn(%s)", muontrap);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    close(stdin_pipe[0]);
+    close(stdout_pipe[1]);
+
+    // The tree prints its size once everything is running
+    FILE *fp = fdopen(stdout_pipe[0], "r");
+    if (!fp || fscanf(fp, "%ld", processes) != 1)
+        errx(EXIT_FAILURE, "%s didn't start", tree_program);
+
+    int64_t start = microsecs();
+    close(stdin_pipe[1]);
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        err(EXIT_FAILURE, "waitpid");
+    int64_t elapsed = microsecs() - start;
+    fclose(fp);
+
+    if (controller) {
+        char *path = group_dir(group);
+        struct stat st;
+        if (stat(path, &st) == 0)
+            warnx("%s wasn't removed", path);
+        free(path);
+    }
+    return elapsed;
+}
+
+static void run(int depth, int fanout, const char *variant, const char *delay_us, int iterations)
+{
+    int64_t *samples = malloc(iterations * sizeof(int64_t));
+    long processes = 0;
+
+    for (int i = 0; i < iterations; i++)
+        samples[i] = run_once(depth, fanout, variant, delay_us, i, &processes);
+
+    qsort(samples, iterations, sizeof(int64_t), compare_int64);
+    printf("%s,%s,%d,%d,%ld,%lld,%lld\n",
+           controller ? "cgroup" : "subreaper",
+           variant,
+           depth,
+           fanout,
+           processes,
+           (long long) samples[iterations / 2],
+           (long long) samples[iterations - 1]);
+    fflush(stdout);
+    free(samples);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_depth = 5;
+    int fanout = 4;
+    int iterations = 5;
+    int delay_ms = 100;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:f:g:k:m:n:r:t:")) != -1) {
+        switch (opt) {
+        case 'c': controller = optarg; break;
+        case 'd': max_depth = atoi(optarg); break;
+        case 'f': fanout = atoi(optarg); break;
+        case 'g': cgroup_base = optarg; break;
+        case 'k': delay_ms = atoi(optarg); break;
+        case 'm': muontrap = optarg; break;
+        case 'n': iterations = atoi(optarg); break;
+        case 'r': cgroup_root = optarg; break;
+        case 't': tree_program = optarg; break;
+        default:
+            errx(EXIT_FAILURE, "See the comment at the top of teardown_latency.c for usage");
+        }
+    }
+
+    if (!muontrap)
+        errx(EXIT_FAILURE, "Specify the path to muontrap with -m");
+    if (iterations <= 0 || max_depth <= 0 || fanout <= 0)
+        errx(EXIT_FAILURE, "Specify a positive depth, fanout and number of iterations");
+
+    // muontrap takes the delay in microseconds
+    char delay_us[32];
+    snprintf(delay_us, sizeof(delay_us), "%d", delay_ms * 1000);
+
+    static const char *variants[] = { "plain", "ignore_sigterm", "fork_during_kill" };
+
+    printf("containment,variant,depth,fanout,processes,p50_us,max_us\n");
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+        for (int depth = 1; depth <= max_depth; depth++)
+            run(depth, fanout, variants[v], delay_us, iterations);
+    }
+    return 0;
+}
@@ -52,10 +52,35 @@ defmodule MuonTrap do
     * `:cgroup_controllers` - run the command under the specified cgroup controllers. Defaults to `[]`.
     * `:cgroup_base` - create a temporary path under the specified cgroup path
     * `:cgroup_path` - explicitly specify a path to use. Use `:cgroup_base`, unless you must control the path.
+    * `:cgroup_pool` - run the command in a group leased from a `MuonTrap.CgroupPool` rather
+      than creating one. Don't specify `:cgroup_controllers`, `:cgroup_base` or `:cgroup_path`
+      with this.
     * `:cgroup_sets` - set a cgroup controller parameter before running the command
     * `:delay_to_sigkill` - milliseconds before sending a SIGKILL to a child process if it doesn't exit with a SIGTERM
     * `:uid` - run the command using the specified uid or username
     * `:gid` - run the command using the specified gid or group
+    * `:server` - run the command via a `MuonTrap.Server` rather than starting a new port
+    * `:timeout` - kill the command if it's still running after this many milliseconds. It's
+      killed the same way as when the caller exits, and the exit status is 124.
+    * `:stats` - when `true`, return `{output, exit_status, stats}` where `stats` is a map of
+      resource usage. See "Resource usage" below.
+    * `:subreaper` - when `true`, orphaned descendants of the command are adopted and killed
+      when it exits. This contains processes that double fork on Linux systems without
+      cgroups. It can't be used with `:server`.
+    * `:pid_namespace` - when `true`, run the command in a new PID namespace on Linux. Everything
+      left in the namespace is killed when the command exits. An unprivileged user namespace is
+      created too when not running as root. The command fails on other systems.
+    * `:output_chunk_size` - batch the command's output into chunks of up to this many bytes.
+      This is for commands that write a lot of output. See "High-volume output" below.
+    * `:async_cleanup` - when `true`, return as soon as the command exits rather than after
+      its descendants have been killed and its cgroups removed. See "Asynchronous cleanup"
+      below. It can't be used with `:stats`, `:server` or `:cgroup_pool`.
+    * `:stderr_into` - collect stderr separately into this collectable. The first element of
+      the result is `{output, stderr_output}` then. It can't be used with `:stderr_to_stdout`
+      or `:server`. See the examples.
+    * `:output_window` - only let `muontrap` send this many output messages ahead of what's
+      been collected. When it's used up, the command blocks writing its output until the
+      collectable catches up. It can't be used with `:server`. See `stream/3`.
 
   The following `System.cmd/3` options are also available:
 
@@ -70,6 +95,53 @@ defmodule MuonTrap do
       The default can be set on system startup by passing the "+spp" argument
       to `--erl`.
 
+  ## Resource usage
+
+  With `stats: true`, the stats map has the command's own resource usage from
+  `wait4(2)`. This includes descendants that it waited for:
+
+    * `:utime_us` and `:stime_us` - user and system CPU time in microseconds
+    * `:maxrss_kb` - peak resident set size in kilobytes
+    * `:minflt` and `:majflt` - minor and major page faults
+    * `:nvcsw` and `:nivcsw` - voluntary and involuntary context switches
+    * `:inblock` and `:oublock` - block input and output operations
+
+  When the command runs in cgroups, totals for everything in them are added
+  when the controllers provide them:
+
+    * `:cgroup_cpu_us`, `:cgroup_user_us` and `:cgroup_system_us` - CPU time
+      in microseconds (`cpuacct` or cgroup v2)
+    * `:cgroup_memory_peak_bytes` - peak memory use (`memory`)
+    * `:cgroup_io_read_bytes` and `:cgroup_io_write_bytes` - block I/O (`blkio` or `io`)
+
+  ## High-volume output
+
+  Normally the command writes straight to the port and the VM reads its
+  output in pieces of 64 KB or less. For commands that write hundreds of MB/s,
+  that's a lot of messages. With `:output_chunk_size`, `muontrap` reads the
+  output from a pipe that's enlarged to the chunk size and forwards all that's
+  ready at once. The collectable gets fewer and larger pieces, so there's less
+  work per MB. The pipe size is limited by `/proc/sys/fs/pipe-max-size` unless
+  running as root. Chunks can be as large as 16 MB. See `bench/output_bench.exs`
+  to pick a size.
+
+  ## Asynchronous cleanup
+
+  After the command exits, `muontrap` kills anything that it left behind and
+  removes its cgroups. When descendants ignore `SIGTERM`, that takes as long
+  as `:delay_to_sigkill` and cmd doesn't return until it's done. With
+  `async_cleanup: true`, `muontrap` reports the exit status first and the
+  cleanup finishes in the background. The output ends when the command exits.
+  Anything that its descendants write after that is discarded. If processes
+  are left over or cgroups can't be removed, it's logged as an error and
+  reported by a `[:muontrap, :cmd, :cleanup]` telemetry event. See
+  `MuonTrap.Telemetry`.
+
+  ## Telemetry
+
+  `MuonTrap.cmd/3` sends `[:muontrap, :cmd, ...]` telemetry events for the
+  whole command and each phase of running it. See `MuonTrap.Telemetry`.
+
   ## Examples
 
   Run a command:
@@ -79,6 +151,13 @@ defmodule MuonTrap do
   {"hello\n", 0}
   ```
 
+  Capture stderr separately from stdout:
+
+  ```elixir
+  iex> MuonTrap.cmd("sh", ["-c", "echo out; echo err >&2"], stderr_into: "")
+  {{"out\n", "err\n"}, 0}
+  ```
+
   The next examples only run on Linux. To try this out, create new cgroups:
 
   ```sh
@@ -92,13 +171,162 @@ defmodule MuonTrap do
   iex-donttest> MuonTrap.cmd("echo", ["hello"], cgroup_controllers: ["memory"], cgroup_path: "muontrap/test", cgroup_sets: [{"memory", "memory.limit_in_bytes", "8192"}])
   {"", 1}
   ```
+
+  Find out how much CPU time a command used:
+
+  ```elixir
+  iex-donttest> {_output, 0, stats} = MuonTrap.cmd("ls", [], stats: true)
+  iex-donttest> stats.utime_us + stats.stime_us
+  1203
+  ```
   """
   @spec cmd(binary(), [binary()], keyword()) ::
           {Collectable.t(), exit_status :: non_neg_integer()}
+          | {Collectable.t(), exit_status :: non_neg_integer(), stats :: map()}
   def cmd(command, args, opts \\ []) when is_binary(command) and is_list(args) do
-    options = MuonTrap.Options.validate(:cmd, command, args, opts)
+    metadata = %{command: command, args: args}
+
+    :telemetry.span([:muontrap, :cmd], metadata, fn ->
+      result =
+        validate(command, args, opts, metadata)
+        |> MuonTrap.Port.cmd()
+
+      {result, Map.put(metadata, :exit_status, elem(result, 1))}
+    end)
+  end
+
+  defp validate(command, args, opts, metadata) do
+    if MuonTrap.Telemetry.enabled?(:cmd) do
+      started_at = System.monotonic_time()
+      options = MuonTrap.Options.validate(:cmd, command, args, opts)
+      MuonTrap.Telemetry.phase(:cmd, :validate, started_at, System.monotonic_time(), metadata)
+
+      Map.put(options, :telemetry, metadata)
+    else
+      MuonTrap.Options.validate(:cmd, command, args, opts)
+    end
+  end
+
+  @doc ~S"""
+  Runs a command via the `muontrap` wrapper and returns its output as a stream
+
+  The command starts when the stream is enumerated and the output is read as
+  it's consumed. `muontrap` only sends `:output_window` messages ahead of the
+  consumer. Once they're used up, it stops reading the command's output and
+  the command blocks when its pipe fills up. A slow consumer can't be flooded,
+  and the VM only ever holds a few messages of output. Each message is up to
+  64 KB or `:output_chunk_size` bytes.
+
+  When the stream is halted early, like by `Enum.take/2`, the command is
+  killed the same way as when the caller exits. The exit status isn't part of
+  the stream. Use `cmd/3` with `:output_window` and an `:into` collectable if
+  it's needed.
+
+  ## Options
+
+    * `:output_window` - messages to let `muontrap` send ahead. Defaults to 4.
+    * `:timeout` - kill the command if it's still running after this many milliseconds
+
+  The other options are the same as for `cmd/3` except for `:into`, `:stats`,
+  `:server`, `:async_cleanup` and `:cgroup_pool`.
+
+  ## Examples
+
+  ```elixir
+  iex> MuonTrap.stream("seq", ["3"]) |> Enum.join()
+  "1\n2\n3\n"
+  ```
+  """
+  @spec stream(binary(), [binary()], keyword()) :: Enumerable.t()
+  def stream(command, args, opts \\ []) when is_binary(command) and is_list(args) do
+    opts = Keyword.put_new(opts, :output_window, 4)
+
+    MuonTrap.Options.validate(:stream, command, args, opts)
+    |> MuonTrap.Port.stream()
+  end
+
+  @doc """
+  Stop every `MuonTrap.Daemon` under a supervisor at once
+
+  Supervisors stop their children one at a time and don't wait for `muontrap`
+  to clean up after them. This stops all of the Daemons under `supervisor`
+  and any supervisors under it first, so every `muontrap` starts its `SIGTERM`,
+  wait and `SIGKILL` sequence at the same time. Then it waits for all of them
+  to exit. Stopping takes as long as the slowest Daemon rather than the sum of
+  them, and when this returns, the processes and cgroups are gone. Other
+  children are left alone.
+
+  The stopped Daemons aren't restarted. Call this from
+  `c:Application.prep_stop/1` to speed up shutting down or before rolling out
+  new Daemons, and use `Supervisor.restart_child/2` to start them again.
+
+  Options:
+
+    * `:timeout` - milliseconds to wait for every `muontrap` to exit. Defaults to 5000.
+
+  Returns `{:error, {:timeout, os_pids}}` with the `muontrap` OS pids that
+  were still running if it times out.
+  """
+  @spec shutdown_all(Supervisor.supervisor(), keyword()) ::
+          :ok | {:error, {:timeout, [non_neg_integer()]}}
+  def shutdown_all(supervisor, opts \\ []) do
+    deadline = System.monotonic_time(:millisecond) + Keyword.get(opts, :timeout, 5000)
+
+    supervisor
+    |> stop_daemons()
+    |> wait_for_exits(deadline)
+  end
+
+  defp stop_daemons(supervisor) do
+    supervisor
+    |> Supervisor.which_children()
+    |> Enum.flat_map(fn
+      {_id, pid, :supervisor, _modules} when is_pid(pid) -> stop_daemons(pid)
+      {id, pid, :worker, [MuonTrap.Daemon]} when is_pid(pid) -> stop_daemon(supervisor, id, pid)
+      _other -> []
+    end)
+  end
+
+  # Daemons don't trap exits, so their ports close as soon as they're told to
+  # stop and each muontrap cleans up on its own
+  defp stop_daemon(supervisor, id, pid) do
+    os_pid = MuonTrap.Daemon.os_pid(pid)
+    _ = terminate_child(supervisor, id, pid)
+    [os_pid]
+  catch
+    # Already gone
+    :exit, _reason -> []
+  end
+
+  # DynamicSupervisor children don't have ids
+  defp terminate_child(supervisor, :undefined, pid),
+    do: DynamicSupervisor.terminate_child(supervisor, pid)
+
+  defp terminate_child(supervisor, id, _pid), do: Supervisor.terminate_child(supervisor, id)
+
+  defp wait_for_exits(os_pids, deadline) do
+    case Enum.filter(os_pids, &os_pid_running?/1) do
+      [] ->
+        :ok
+
+      running ->
+        if System.monotonic_time(:millisecond) >= deadline do
+          {:error, {:timeout, running}}
+        else
+          Process.sleep(10)
+          wait_for_exits(running, deadline)
+        end
+    end
+  end
 
-    MuonTrap.Port.cmd(options)
+  # Checking /proc is a lot cheaper than running kill(1)
+  defp os_pid_running?(os_pid) do
+    if File.dir?("/proc/self") do
+      File.dir?("/proc/#{os_pid}")
+    else
+      {_output, status} = System.cmd("kill", ["-0", to_string(os_pid)], stderr_to_stdout: true)
+      status == 0
+    end
   end
 
   @doc """
@@ -0,0 +1,16 @@
+defmodule MuonTrap.Application do
+  @moduledoc false
+
+  use Application
+
+  @impl true
+  def start(_type, _args) do
+    children = [
+      MuonTrap.SampleCache,
+      {Task.Supervisor, name: MuonTrap.CleanupSupervisor}
+    ]
+
+    opts = [strategy: :one_for_one, name: MuonTrap.Application.Supervisor]
+    Supervisor.start_link(children, opts)
+  end
+end
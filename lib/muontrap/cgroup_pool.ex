@@ -0,0 +1,312 @@
+defmodule MuonTrap.CgroupPool do
+  use GenServer
+
+  require Logger
+
+  @moduledoc """
+  Create cgroups ahead of time and reuse them for commands.
+
+  With `:cgroup_base`, every command gets a new cgroup that's created before
+  the command starts and removed after it exits. Creating and removing cgroups
+  is slow and serialized in the kernel, so for short commands this can take
+  longer than the command. A `MuonTrap.CgroupPool` creates groups under a base
+  path ahead of time and leases them to commands instead.
+
+  Add a pool to one of your supervision trees:
+
+  ```elixir
+  children = [
+    {MuonTrap.CgroupPool,
+     name: MyApp.CgroupPool, cgroup_base: "mycgroup", cgroup_controllers: ["memory"], size: 8}
+  ]
+  ```
+
+  And then pass it to `MuonTrap.cmd/3` or `MuonTrap.Daemon` in place of the
+  `:cgroup_base` and `:cgroup_controllers` options:
+
+  ```elixir
+  iex> MuonTrap.cmd("echo", ["hello"], cgroup_pool: MyApp.CgroupPool)
+  {"hello\\n", 0}
+  ```
+
+  A group only goes back to the pool after it's been verified to be empty. If
+  the command changed cgroup settings with `:cgroup_sets` or the group was
+  leased to a `MuonTrap.Daemon` (which can change settings with
+  `MuonTrap.Daemon.cgset/4`), the group is removed instead and the pool
+  creates a fresh one in the background. A group that doesn't empty has its
+  processes killed and is replaced too.
+
+  `stats: true` only reports the command that has the lease. `muontrap`
+  subtracts what earlier commands used and resets the memory peak when the
+  group is leased. cgroup v2 before Linux 6.12 can't reset the peak, so
+  `:cgroup_memory_peak_bytes` is left out there.
+  """
+
+  # How often and how many times to check that a returned group is empty
+  @recheck_interval 100
+  @max_rechecks 100
+
+  # How many more times to check after killing what's left in a group
+  @kill_rechecks 10
+
+  # How many random names to try when creating a group
+  @max_create_attempts 10
+
+  defmodule State do
+    @moduledoc false
+
+    defstruct [
+      :cgroup_base,
+      :controllers,
+      :size,
+      idle: [],
+      leases: %{},
+      created: 0,
+      recycled: 0,
+      removed: 0,
+      misses: 0
+    ]
+  end
+
+  @typedoc """
+  A leased group
+
+  * `:ref` - identifies the lease when checking it back in
+  * `:cgroup_path` - the group's path relative to the controllers' mount points
+  * `:cgroup_controllers` - the controllers that the group was created for
+  """
+  @type lease() :: %{
+          ref: reference(),
+          cgroup_path: String.t(),
+          cgroup_controllers: [String.t()]
+        }
+
+  @doc """
+  Start a pool.
+
+  Options:
+
+  * `:cgroup_base` - the group to create pooled groups under (required)
+  * `:cgroup_controllers` - the controllers to create groups for (required)
+  * `:size` - the number of groups to keep ready. Leased groups that will be
+    reused count toward it. Defaults to 4.
+  * `:name` - Name the pool GenServer
+  """
+  @spec start_link(keyword()) :: GenServer.on_start()
+  def start_link(opts) do
+    genserver_opts = Keyword.take(opts, [:name])
+
+    GenServer.start_link(__MODULE__, opts, genserver_opts)
+  end
+
+  @doc """
+  Lease a group
+
+  This is normally called via `MuonTrap.cmd/3` and `MuonTrap.Daemon`. The group
+  is returned to the pool when `checkin/2` is called or when the calling
+  process exits. Pass `false` for `recycle?` if the group's settings will be
+  changed so that it's removed rather than reused.
+  """
+  @spec checkout(GenServer.server(), boolean()) :: {:ok, lease()} | {:error, File.posix()}
+  def checkout(pool, recycle? \\ true) do
+    GenServer.call(pool, {:checkout, recycle?})
+  end
+
+  @doc """
+  Return a leased group to the pool
+  """
+  @spec checkin(GenServer.server(), lease()) :: :ok
+  def checkin(pool, lease) do
+    GenServer.cast(pool, {:checkin, lease.ref})
+  end
+
+  @doc """
+  Return counts for monitoring the pool
+
+  * `:size` - the number of groups that the pool tries to keep ready
+  * `:idle` - the number of groups ready to be leased
+  * `:leased` - the number of groups leased or waiting to be verified empty
+  * `:created` - the number of groups created
+  * `:recycled` - the number of groups that were returned and reused
+  * `:removed` - the number of groups removed
+  * `:misses` - the number of leases that had to wait for a group to be created
+  """
+  @spec stats(GenServer.server()) :: %{atom() => non_neg_integer()}
+  def stats(pool) do
+    GenServer.call(pool, :stats)
+  end
+
+  @impl true
+  def init(opts) do
+    Process.flag(:trap_exit, true)
+
+    state = %State{
+      cgroup_base: Keyword.fetch!(opts, :cgroup_base),
+      controllers: Keyword.fetch!(opts, :cgroup_controllers),
+      size: Keyword.get(opts, :size, 4)
+    }
+
+    {:ok, refill(state)}
+  end
+
+  @impl true
+  def handle_call({:checkout, recycle?}, {pid, _tag}, state) do
+    case take_group(state) do
+      {:ok, path, state} ->
+        ref = Process.monitor(pid)
+        lease = %{ref: ref, cgroup_path: path, cgroup_controllers: state.controllers}
+        leases = Map.put(state.leases, ref, {path, recycle?})
+
+        # Replace the group after replying so that the caller doesn't wait
+        send(self(), :refill)
+        {:reply, {:ok, lease}, %{state | leases: leases}}
+
+      {:error, reason, state} ->
+        {:reply, {:error, reason}, state}
+    end
+  end
+
+  def handle_call(:stats, _from, state) do
+    stats = %{
+      size: state.size,
+      idle: length(state.idle),
+      leased: map_size(state.leases),
+      created: state.created,
+      recycled: state.recycled,
+      removed: state.removed,
+      misses: state.misses
+    }
+
+    {:reply, stats, state}
+  end
+
+  @impl true
+  def handle_cast({:checkin, ref}, state) do
+    Process.demonitor(ref, [:flush])
+    {:noreply, release(ref, 0, state)}
+  end
+
+  @impl true
+  def handle_info({:DOWN, ref, :process, _pid, _reason}, state) do
+    {:noreply, release(ref, 0, state)}
+  end
+
+  def handle_info({:recheck, ref, rechecks}, state) do
+    {:noreply, release(ref, rechecks, state)}
+  end
+
+  def handle_info(:refill, state) do
+    {:noreply, refill(state)}
+  end
+
+  def handle_info(_other, state) do
+    {:noreply, state}
+  end
+
+  @impl true
+  def terminate(_reason, state) do
+    # Leased groups can only be removed once their commands are gone
+    leased = Enum.map(state.leases, fn {_ref, {path, _recycle?}} -> path end)
+    Enum.each(state.idle ++ leased, &MuonTrap.Cgroups.remove_group(state.controllers, &1))
+  end
+
+  defp take_group(%State{idle: [path | rest]} = state), do: {:ok, path, %{state | idle: rest}}
+
+  defp take_group(state) do
+    case create_group(state) do
+      {:ok, path, state} -> {:ok, path, %{state | misses: state.misses + 1}}
+      {:error, reason} -> {:error, reason, state}
+    end
+  end
+
+  defp refill(state) do
+    # Leased groups that will be reused count as ready. Otherwise, the pool
+    # would be full whenever one came back.
+    returning = Enum.count(state.leases, fn {_ref, {_path, recycle?}} -> recycle? end)
+
+    if length(state.idle) + returning >= state.size do
+      state
+    else
+      case create_group(state) do
+        {:ok, path, state} ->
+          refill(%{state | idle: [path | state.idle]})
+
+        {:error, reason} ->
+          _ = Logger.warn("MuonTrap.CgroupPool: couldn't create a group: #{inspect(reason)}")
+          state
+      end
+    end
+  end
+
+  defp create_group(state, attempts \\ 1) do
+    path = Path.join(state.cgroup_base, random_string())
+
+    case MuonTrap.Cgroups.create_group(state.controllers, path) do
+      :ok ->
+        {:ok, path, %{state | created: state.created + 1}}
+
+      {:error, :eexist} when attempts < @max_create_attempts ->
+        # Leftover group from somewhere else. Pick another name.
+        create_group(state, attempts + 1)
+
+      error ->
+        # Don't leave groups for some controllers and not others
+        _ = MuonTrap.Cgroups.remove_group(state.controllers, path)
+        error
+    end
+  end
+
+  defp release(ref, rechecks, state) do
+    case Map.fetch(state.leases, ref) do
+      {:ok, {path, recycle?}} -> return_group(ref, path, recycle?, rechecks, state)
+      :error -> state
+    end
+  end
+
+  defp return_group(ref, path, recycle?, rechecks, state) do
+    empty? = MuonTrap.Cgroups.group_empty?(state.controllers, path)
+
+    cond do
+      not empty? and rechecks < @max_rechecks ->
+        # muontrap may still be killing processes
+        recheck(ref, rechecks, state)
+
+      not empty? and rechecks == @max_rechecks ->
+        _ = Logger.warn("MuonTrap.CgroupPool: killing what's left in #{path}")
+        MuonTrap.Cgroups.kill_group(state.controllers, path)
+
+        # Don't reuse a group that something escaped into
+        leases = Map.put(state.leases, ref, {path, false})
+        recheck(ref, rechecks, %{state | leases: leases})
+
+      not empty? and rechecks < @max_rechecks + @kill_rechecks ->
+        recheck(ref, rechecks, state)
+
+      not empty? ->
+        _ = Logger.warn("MuonTrap.CgroupPool: giving up on #{path} since it isn't empty")
+        discard_group(ref, path, state)
+
+      recycle? and length(state.idle) < state.size ->
+        leases = Map.delete(state.leases, ref)
+        %{state | idle: [path | state.idle], leases: leases, recycled: state.recycled + 1}
+
+      true ->
+        discard_group(ref, path, state)
+    end
+  end
+
+  defp recheck(ref, rechecks, state) do
+    Process.send_after(self(), {:recheck, ref, rechecks + 1}, @recheck_interval)
+    state
+  end
+
+  defp discard_group(ref, path, state) do
+    _ = MuonTrap.Cgroups.remove_group(state.controllers, path)
+    leases = Map.delete(state.leases, ref)
+    refill(%{state | leases: leases, removed: state.removed + 1})
+  end
+
+  defp random_string() do
+    Integer.to_string(:rand.uniform(0x100000000), 36) |> String.downcase()
+  end
+end
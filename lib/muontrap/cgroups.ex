@@ -3,6 +3,18 @@ defmodule MuonTrap.Cgroups do
 
   @cgroup_fs "/sys/fs/cgroup"
 
+  @doc """
+  Return the directory with the cgroup hierarchies
+
+  This is `/sys/fs/cgroup` unless the `:cgroup_root` application environment
+  variable is set. That's for running against a fake cgroup filesystem like
+  `test/fake_cgroupfs.c`, and `muontrap` gets it with `--cgroup-root`.
+  """
+  @spec cgroup_root() :: Path.t()
+  def cgroup_root() do
+    Application.get_env(:muontrap, :cgroup_root, @cgroup_fs)
+  end
+
   @doc """
   Return true if it looks like the system has cgroups support enabled
   """
@@ -18,18 +30,29 @@ defmodule MuonTrap.Cgroups do
   @doc """
   Return a list available cgroup controllers
   """
-  @spec get_controllers() :: {:ok, [String.t()]} | {:error, :enoent}
+  @spec get_controllers() :: {:ok, [String.t()]} | {:error, File.posix()}
   def get_controllers() do
-    File.ls("/sys/fs/cgroup")
+    root = cgroup_root()
+
+    case cgroup_mounts() do
+      %{v2: ^root} -> cgroup2_controllers(root)
+      _ -> File.ls(root)
+    end
   end
 
   @doc """
   Get a cgroup variable (like cgget)
+
+  On cgroup v2, controllers share one group and cgroup v1 variable names
+  are translated to their cgroup v2 equivalents the same way that the
+  `muontrap` port process does it.
   """
   @spec cgget(String.t(), String.t(), String.t()) :: {:ok, String.t()} | {:error, File.posix()}
   def cgget(controller, cgroup_path, variable_name) do
-    path = Path.join([@cgroup_fs, controller, cgroup_path, variable_name])
-    File.read(path)
+    case group_dir(controller, cgroup_path) do
+      {:v1, dir} -> File.read(Path.join(dir, variable_name))
+      {:v2, dir} -> cgroup2_get(dir, variable_name)
+    end
   end
 
   @doc """
@@ -37,7 +60,240 @@ defmodule MuonTrap.Cgroups do
   """
   @spec cgset(String.t(), String.t(), String.t(), String.t()) :: :ok | {:error, File.posix()}
   def cgset(controller, cgroup_path, variable_name, value) do
-    path = Path.join([@cgroup_fs, controller, cgroup_path, variable_name])
-    File.write(path, value)
+    case group_dir(controller, cgroup_path) do
+      {:v1, dir} -> File.write(Path.join(dir, variable_name), value)
+      {:v2, dir} -> cgroup2_set(dir, variable_name, to_string(value))
+    end
+  end
+
+  @doc """
+  Return the directory for a controller's group and whether it's cgroup v1 or v2
+
+  Controllers that aren't mounted as cgroup v1 hierarchies use the cgroup v2
+  hierarchy if there is one.
+  """
+  @spec group_dir(String.t(), String.t()) :: {:v1 | :v2, Path.t()}
+  def group_dir(controller, cgroup_path) do
+    case cgroup_mounts() do
+      %{v2: v2_mount, v1: v1_controllers} when is_binary(v2_mount) ->
+        if controller in v1_controllers do
+          {:v1, Path.join([cgroup_root(), controller, cgroup_path])}
+        else
+          {:v2, Path.join(v2_mount, cgroup_path)}
+        end
+
+      _ ->
+        {:v1, Path.join([cgroup_root(), controller, cgroup_path])}
+    end
+  end
+
+  @doc """
+  Create a group for each of the controllers
+
+  The group's parent directories are created if needed, but the group itself
+  must not exist so that a group that's in use is never picked up by mistake.
+  """
+  @spec create_group([String.t()], String.t()) :: :ok | {:error, File.posix()}
+  def create_group(controllers, cgroup_path) do
+    Enum.reduce_while(group_dirs(controllers, cgroup_path), :ok, fn dir, :ok ->
+      with :ok <- File.mkdir_p(Path.dirname(dir)),
+           :ok <- File.mkdir(dir) do
+        {:cont, :ok}
+      else
+        error -> {:halt, error}
+      end
+    end)
+  end
+
+  @doc """
+  Remove a group for each of the controllers
+
+  This fails if any processes are still in the group.
+  """
+  @spec remove_group([String.t()], String.t()) :: :ok | {:error, File.posix()}
+  def remove_group(controllers, cgroup_path) do
+    group_dirs(controllers, cgroup_path)
+    |> Enum.map(&File.rmdir/1)
+    |> Enum.find(:ok, &(&1 != :ok and &1 != {:error, :enoent}))
+  end
+
+  @doc """
+  Send a SIGKILL to every process in the group for each of the controllers
+
+  cgroup v2 groups are killed all at once with `cgroup.kill` (Linux 5.14+).
+  Otherwise, the processes in `cgroup.procs` are killed one by one.
+  """
+  @spec kill_group([String.t()], String.t()) :: :ok
+  def kill_group(controllers, cgroup_path) do
+    Enum.each(group_dirs(controllers, cgroup_path), fn dir ->
+      kill_file = Path.join(dir, "cgroup.kill")
+
+      unless File.exists?(kill_file) and File.write(kill_file, "1") == :ok do
+        kill_procs(dir)
+      end
+    end)
+  end
+
+  defp kill_procs(dir) do
+    with {:ok, contents} <- File.read(Path.join(dir, "cgroup.procs")),
+         [_ | _] = os_pids <- String.split(contents) do
+      _ = System.cmd("kill", ["-KILL" | os_pids], stderr_to_stdout: true)
+    end
+
+    :ok
+  end
+
+  @doc """
+  Return true if there are no processes in the group for any of the controllers
+  """
+  @spec group_empty?([String.t()], String.t()) :: boolean()
+  def group_empty?(controllers, cgroup_path) do
+    Enum.all?(group_dirs(controllers, cgroup_path), fn dir ->
+      case File.read(Path.join(dir, "cgroup.procs")) do
+        {:ok, ""} -> true
+        {:error, :enoent} -> true
+        _ -> false
+      end
+    end)
+  end
+
+  @doc """
+  Scan /proc/self/mountinfo for cgroup v1 controllers and the cgroup v2 mount
+
+  A configured `:cgroup_root` isn't mounted, so like `muontrap`, it's a cgroup
+  v2 hierarchy if it has a `cgroup.controllers` file and cgroup v1 otherwise.
+  """
+  @spec cgroup_mounts() :: %{v1: [String.t()], v2: Path.t() | nil}
+  def cgroup_mounts() do
+    case Application.fetch_env(:muontrap, :cgroup_root) do
+      {:ok, root} -> root_mounts(root)
+      :error -> read_mountinfo()
+    end
   end
+
+  defp root_mounts(root) do
+    if File.exists?(Path.join(root, "cgroup.controllers")) do
+      %{v1: [], v2: root}
+    else
+      %{v1: [], v2: nil}
+    end
+  end
+
+  defp read_mountinfo() do
+    case File.read("/proc/self/mountinfo") do
+      {:ok, mountinfo} -> parse_mountinfo(mountinfo)
+      {:error, _} -> %{v1: [], v2: nil}
+    end
+  end
+
+  @doc false
+  @spec parse_mountinfo(String.t()) :: %{v1: [String.t()], v2: Path.t() | nil}
+  def parse_mountinfo(mountinfo) do
+    mountinfo
+    |> String.split("\n", trim: true)
+    |> Enum.reduce(%{v1: [], v2: nil}, fn line, acc ->
+      with [mount_info, fs_info] <- String.split(line, " - ", parts: 2),
+           [_id, _parent, _dev, _root, mount_point | _] <- String.split(mount_info, " "),
+           [fstype, _source, super_options | _] <- String.split(fs_info, " ") do
+        case fstype do
+          "cgroup2" when acc.v2 == nil -> %{acc | v2: mount_point}
+          "cgroup" -> %{acc | v1: acc.v1 ++ String.split(super_options, ",")}
+          _ -> acc
+        end
+      else
+        _ -> acc
+      end
+    end)
+  end
+
+  # cgroup v2 controllers share a directory, so only visit it once
+  defp group_dirs(controllers, cgroup_path) do
+    controllers
+    |> Enum.map(fn controller -> group_dir(controller, cgroup_path) |> elem(1) end)
+    |> Enum.uniq()
+  end
+
+  defp cgroup2_controllers(mount) do
+    with {:ok, contents} <- File.read(Path.join(mount, "cgroup.controllers")) do
+      {:ok, String.split(contents)}
+    end
+  end
+
+  @max_memory "9223372036854771712"
+
+  defp cgroup2_get(dir, "memory.limit_in_bytes"), do: read_max(dir, "memory.max", @max_memory)
+
+  defp cgroup2_get(dir, "memory.soft_limit_in_bytes"),
+    do: read_max(dir, "memory.low", @max_memory)
+
+  defp cgroup2_get(dir, "cpu.cfs_quota_us") do
+    with {:ok, [quota, _period]} <- read_cpu_max(dir) do
+      {:ok, if(quota == "max", do: "-1\n", else: quota <> "\n")}
+    end
+  end
+
+  defp cgroup2_get(dir, "cpu.cfs_period_us") do
+    with {:ok, [_quota, period]} <- read_cpu_max(dir) do
+      {:ok, period <> "\n"}
+    end
+  end
+
+  defp cgroup2_get(dir, "cpu.shares") do
+    with {:ok, weight} <- read_integer(dir, "cpu.weight") do
+      {:ok, "#{2 + div((weight - 1) * 262_142, 9999)}\n"}
+    end
+  end
+
+  defp cgroup2_get(dir, variable_name), do: File.read(Path.join(dir, variable_name))
+
+  defp cgroup2_set(dir, "memory.limit_in_bytes", value),
+    do: File.write(Path.join(dir, "memory.max"), unlimited_to_max(value))
+
+  defp cgroup2_set(dir, "memory.soft_limit_in_bytes", value),
+    do: File.write(Path.join(dir, "memory.low"), unlimited_to_max(value))
+
+  defp cgroup2_set(dir, "cpu.cfs_quota_us", value),
+    do: File.write(Path.join(dir, "cpu.max"), unlimited_to_max(value))
+
+  defp cgroup2_set(dir, "cpu.cfs_period_us", value) do
+    with {:ok, [quota, _period]} <- read_cpu_max(dir) do
+      File.write(Path.join(dir, "cpu.max"), "#{quota} #{value}")
+    end
+  end
+
+  defp cgroup2_set(dir, "cpu.shares", value) do
+    weight = 1 + div((String.to_integer(value) - 2) * 9999, 262_142)
+    File.write(Path.join(dir, "cpu.weight"), to_string(clamp_weight(weight)))
+  end
+
+  defp cgroup2_set(dir, "blkio.weight", value) do
+    weight = 1 + div((String.to_integer(value) - 10) * 9999, 990)
+    File.write(Path.join(dir, "io.weight"), to_string(clamp_weight(weight)))
+  end
+
+  defp cgroup2_set(dir, variable_name, value),
+    do: File.write(Path.join(dir, variable_name), value)
+
+  defp read_max(dir, file, max_value) do
+    with {:ok, contents} <- File.read(Path.join(dir, file)) do
+      {:ok, if(String.trim(contents) == "max", do: max_value <> "\n", else: contents)}
+    end
+  end
+
+  defp read_cpu_max(dir) do
+    with {:ok, contents} <- File.read(Path.join(dir, "cpu.max")) do
+      {:ok, String.split(contents)}
+    end
+  end
+
+  defp read_integer(dir, file) do
+    with {:ok, contents} <- File.read(Path.join(dir, file)) do
+      {:ok, contents |> String.trim() |> String.to_integer()}
+    end
+  end
+
+  defp unlimited_to_max("-1"), do: "max"
+  defp unlimited_to_max(value), do: value
+
+  defp clamp_weight(weight), do: weight |> max(1) |> min(10000)
 end
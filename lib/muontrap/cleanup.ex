@@ -0,0 +1,130 @@
+defmodule MuonTrap.Cleanup do
+  @moduledoc false
+
+  # With :async_cleanup, MuonTrap.cmd/3 returns as soon as muontrap reports
+  # the command's exit status. muontrap then kills anything that's left and
+  # removes the cgroups. The port is handed to a process under
+  # MuonTrap.CleanupSupervisor that waits for that to finish and reports
+  # anything that couldn't be cleaned up. Output stops with the exit status,
+  # so muontrap only counts what descendants write after that.
+
+  require Logger
+
+  @supervisor MuonTrap.CleanupSupervisor
+
+  @msg_exit ?x
+
+  @doc """
+  Give the port to a new process that waits for muontrap to finish
+
+  This must be called by the port's owner.
+  """
+  @spec hand_off(port(), MuonTrap.Options.t()) :: :ok
+  def hand_off(port, options) do
+    options = Map.take(options, [:cmd, :telemetry])
+    {:ok, pid} = Task.Supervisor.start_child(@supervisor, fn -> await_hand_off(options) end)
+
+    # The port may have closed already. Its messages are in our mailbox then.
+    _ =
+      try do
+        Port.connect(port, pid)
+        Process.unlink(port)
+      rescue
+        ArgumentError -> false
+      end
+
+    # Anything that arrived before the connect is passed along
+    send(pid, {:handed_off, port, flush(port, [])})
+    :ok
+  end
+
+  defp flush(port, messages) do
+    receive do
+      {^port, message} -> flush(port, [message | messages])
+    after
+      0 -> Enum.reverse(messages)
+    end
+  end
+
+  defp await_hand_off(options) do
+    receive do
+      {:handed_off, port, messages} -> await_exit(port, messages, "", options)
+    end
+  end
+
+  defp await_exit(port, [], report, options) do
+    receive do
+      {^port, message} -> await_exit(port, [message], report, options)
+    end
+  end
+
+  defp await_exit(port, [message | rest], report, options) do
+    case message do
+      {:data, <<@msg_exit, 0::32, _status::32, teardown_us::32, text::binary>>} ->
+        await_exit(port, rest, {teardown_us, text}, options)
+
+      {:exit_status, _status} ->
+        cleaned_up(report, System.monotonic_time(), options)
+
+      _other ->
+        await_exit(port, rest, report, options)
+    end
+  end
+
+  # muontrap died without reporting
+  defp cleaned_up("", _received_at, options) do
+    _ = Logger.error("MuonTrap: #{options.cmd} exited, but muontrap didn't report its cleanup")
+    :ok
+  end
+
+  defp cleaned_up({teardown_us, text}, received_at, options) do
+    counts = parse_counts(text)
+    leftover_pids = Map.get(counts, "cleanup_leftover_pids", 0)
+    cgroup_errors = Map.get(counts, "cleanup_cgroup_errors", 0)
+    discarded_bytes = Map.get(counts, "cleanup_discarded_bytes", 0)
+
+    if leftover_pids > 0 or cgroup_errors > 0 do
+      _ =
+        Logger.error(
+          "MuonTrap: cleaning up after #{options.cmd} left #{leftover_pids} processes " <>
+            "running and #{cgroup_errors} cgroups that couldn't be removed"
+        )
+    end
+
+    if discarded_bytes > 0 do
+      _ =
+        Logger.debug(
+          "MuonTrap: discarded #{discarded_bytes} bytes that #{options.cmd}'s " <>
+            "descendants wrote after it exited"
+        )
+    end
+
+    with %{telemetry: metadata} <- options do
+      MuonTrap.Telemetry.launcher_phases(:cmd, text, received_at, metadata)
+
+      measurements = %{
+        teardown_us: teardown_us,
+        leftover_pids: leftover_pids,
+        cgroup_errors: cgroup_errors,
+        discarded_bytes: discarded_bytes
+      }
+
+      :telemetry.execute([:muontrap, :cmd, :cleanup], measurements, metadata)
+    end
+
+    :ok
+  end
+
+  defp parse_counts(text) do
+    text
+    |> String.split("\n", trim: true)
+    |> Enum.reduce(%{}, fn line, acc ->
+      with [name, value] <- String.split(line, " "),
+           {number, ""} <- Integer.parse(value) do
+        Map.put(acc, name, number)
+      else
+        _ -> acc
+      end
+    end)
+  end
+end
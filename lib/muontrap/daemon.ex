@@ -26,7 +26,16 @@ defmodule MuonTrap.Daemon do
   * `:name` - Name the Daemon GenServer
   * `:log_output` - When set, send output from the command to the Logger. Specify the log level (e.g., `:debug`)
   * `:log_prefix` - Prefix each log message with this string (defaults to the program's path)
+  * `:log_stderr` - When set, log the command's stderr separately at this level (e.g., `:warn`)
   * `:stderr_to_stdout` - When set to `true`, redirect stderr to stdout. Defaults to `false`.
+  * `:sample_interval` - When set, report the cgroup's resource usage every this many milliseconds. See below.
+  * `:output_chunk_size` - When set, batch output into fewer, larger messages. Lines are still logged one at a time.
+  * `:output_file` - Write output to this file. See "Output" below.
+  * `:output_file_max_bytes` - Rotate the output file when it gets this big
+  * `:output_file_count` - How many rotated output files to keep. Defaults to 1.
+  * `:log_sample` - Only log one out of every this many lines of output
+  * `:output_window` - Only let `muontrap` send this many output messages ahead of the Daemon.
+    The command blocks writing output when the Daemon falls behind.
 
   If you want to run multiple `MuonTrap.Daemon`s under one supervisor, they'll
   all need unique IDs. Use `Supervisor.child_spec/2` like this:
@@ -34,14 +43,86 @@ defmodule MuonTrap.Daemon do
   ```elixir
   Supervisor.child_spec({MuonTrap.Daemon, ["my_server"), []]}, id: :server1)
   ```
+
+  ## Output
+
+  Output goes where it's needed without going through the Daemon when it's not
+  logged:
+
+  * Without `:log_output` or `:output_file`, `muontrap` points the command's
+    stdout at `/dev/null`, so the output costs nothing.
+  * With `:output_file`, `muontrap` writes the output to the file. On Linux,
+    it's moved there with `splice(2)` when it's not logged. When the file
+    reaches `:output_file_max_bytes`, it's renamed to `<file>.1`, older files
+    move up one, and a new file is started. Files are cut at exactly that
+    size, so a line may be split between two of them.
+  * With `:log_output`, output is logged like normal. Add `:log_sample` to
+    only log every nth line. This is handy with `:output_file` to see some of
+    the output in the log while the file has all of it. `muontrap` picks out
+    the lines, so the others never reach the Daemon.
+
+  Stderr goes to the VM's stderr unless `stderr_to_stdout: true` mixes it
+  into the output or `:log_stderr` logs it at its own level. `muontrap` sends
+  stderr in separate messages over the same port for `:log_stderr`, so it
+  isn't affected by `:output_file` or `:log_sample`.
+
+  ```elixir
+  {MuonTrap.Daemon,
+   ["my_server", [],
+    [output_file: "/data/my_server.log", output_file_max_bytes: 1_000_000,
+     log_output: :info, log_sample: 100]]}
+  ```
+
+  ## Resource usage samples
+
+  With `:sample_interval`, `muontrap` reads the command's cgroup statistics
+  at that interval and sends them to the Daemon. This is cheaper than calling
+  `cgget/3` periodically since the Daemon process doesn't read any files. Each
+  sample is a map with the following keys when the cgroup controllers provide
+  them:
+
+  * `:cgroup_cpu_us`, `:cgroup_user_us`, `:cgroup_system_us` - CPU time used
+  * `:cgroup_memory_bytes` - current memory use
+  * `:cgroup_io_read_bytes`, `:cgroup_io_write_bytes` - block I/O
+  * `:cgroup_pids` - number of processes
+
+  Samples are sent as `[:muontrap, :daemon, :sample]` telemetry events with
+  the sample as the measurements and the `:command` and `:cgroup_path` as
+  metadata. The latest sample is also available from `last_sample/1`.
+
+  ```elixir
+  {MuonTrap.Daemon,
+   ["my_server", [],
+    [cgroup_controllers: ["cpu", "memory"], cgroup_base: "my_app", sample_interval: 1000]]}
+  ```
   """
 
   defmodule State do
     @moduledoc false
 
-    defstruct [:command, :port, :cgroup_path, :log_output, :log_prefix]
+    defstruct [
+      :command,
+      :port,
+      :cgroup_path,
+      :log_output,
+      :log_stderr,
+      :log_prefix,
+      :framed,
+      :telemetry,
+      :started_at,
+      :first_output,
+      flow_control: false,
+      buffer: "",
+      stderr_buffer: ""
+    ]
   end
 
+  # Framed messages. The command's id is always 0. See src/muontrap.c.
+  @msg_data ?d
+  @msg_exit ?x
+  @msg_sample ?m
+  @msg_stderr ?r
+
   def child_spec([command, args]) do
     child_spec([command, args, []])
   end
@@ -87,6 +168,21 @@ defmodule MuonTrap.Daemon do
     GenServer.call(server, {:cgset, controller, variable_name, value})
   end
 
+  @doc """
+  Return the latest resource usage sample
+
+  This is only available when the `:sample_interval` option is set. It
+  returns `nil` until the first sample arrives. The sample is read without
+  calling the Daemon, so it's fine to call this frequently.
+  """
+  @spec last_sample(GenServer.server()) :: %{atom() => non_neg_integer()} | nil
+  def last_sample(server) do
+    case GenServer.whereis(server) do
+      pid when is_pid(pid) -> MuonTrap.SampleCache.get(pid)
+      _ -> nil
+    end
+  end
+
   @doc """
   Return the OS pid to the muontrap executable.
   """
@@ -97,10 +193,23 @@ defmodule MuonTrap.Daemon do
 
   @impl true
   def init([command, args, opts]) do
-    options = MuonTrap.Options.validate(:daemon, command, args, opts)
-    port_options = MuonTrap.Port.port_options(options) ++ [{:line, 256}]
+    metadata = if MuonTrap.Telemetry.enabled?(:daemon), do: %{command: command, args: args}
+    options = validate(command, args, opts, metadata) |> lease_cgroup()
+    framed = MuonTrap.Port.framed?(options)
+
+    started_at = System.monotonic_time()
+
+    port =
+      Port.open(
+        {:spawn_executable, to_charlist(MuonTrap.muontrap_path())},
+        port_options(options, framed)
+      )
+
+    if metadata do
+      MuonTrap.Telemetry.phase(:daemon, :port_open, started_at, System.monotonic_time(), metadata)
+    end
 
-    port = Port.open({:spawn_executable, to_charlist(MuonTrap.muontrap_path())}, port_options)
+    if Map.has_key?(options, :sample_interval), do: MuonTrap.SampleCache.register()
 
     {:ok,
      %State{
@@ -108,10 +217,36 @@ defmodule MuonTrap.Daemon do
        port: port,
        cgroup_path: Map.get(options, :cgroup_path),
        log_output: Map.get(options, :log_output),
-       log_prefix: Map.get(options, :log_prefix, command <> ": ")
+       log_stderr: Map.get(options, :log_stderr),
+       log_prefix: Map.get(options, :log_prefix, command <> ": "),
+       framed: framed,
+       telemetry: metadata,
+       started_at: started_at,
+       first_output: if(metadata, do: :waiting),
+       flow_control: Map.has_key?(options, :output_window)
      }}
   end
 
+  defp validate(command, args, opts, nil),
+    do: MuonTrap.Options.validate(:daemon, command, args, opts)
+
+  defp validate(command, args, opts, metadata) do
+    started_at = System.monotonic_time()
+    options = MuonTrap.Options.validate(:daemon, command, args, opts)
+    MuonTrap.Telemetry.phase(:daemon, :validate, started_at, System.monotonic_time(), metadata)
+
+    # muontrap can only report its timings when framed
+    if MuonTrap.Port.framed?(options) do
+      Map.put(options, :telemetry, metadata)
+    else
+      options
+    end
+  end
+
+  # Framed output is split into lines by log_lines/2
+  defp port_options(options, true), do: MuonTrap.Port.port_options(options)
+  defp port_options(options, false), do: MuonTrap.Port.port_options(options) ++ [{:line, 256}]
+
   alias MuonTrap.Cgroups
 
   @impl true
@@ -138,6 +273,30 @@ defmodule MuonTrap.Daemon do
     {:reply, os_pid, state}
   end
 
+  @impl true
+  def handle_info(
+        {port, {:data, <<@msg_data, _rest::binary>>}} = message,
+        %State{port: port, framed: true, first_output: :waiting} = state
+      ) do
+    first_output_seen(message, state)
+  end
+
+  @impl true
+  def handle_info(
+        {port, {:data, _}} = message,
+        %State{port: port, framed: false, first_output: :waiting} = state
+      ) do
+    first_output_seen(message, state)
+  end
+
+  @impl true
+  def handle_info(
+        {port, {:data, <<type, 0::32, payload::binary>>}},
+        %State{port: port, framed: true} = state
+      ) do
+    handle_message(type, payload, state)
+  end
+
   @impl true
   def handle_info({_port, {:data, _}}, %State{log_output: nil} = state) do
     # Ignore output
@@ -155,17 +314,104 @@ defmodule MuonTrap.Daemon do
 
   @impl true
   def handle_info({port, {:exit_status, status}}, %State{port: port} = state) do
-    reason =
-      case status do
-        0 ->
-          _ = Logger.info("#{state.command}: Process exited successfully")
-          :normal
-
-        _failure ->
-          _ = Logger.error("#{state.command}: Process exited with status #{status}")
-          :error_exit_status
-      end
+    if state.telemetry do
+      stopped_at = System.monotonic_time()
+      MuonTrap.Telemetry.phase(:daemon, :run, state.started_at, stopped_at, state.telemetry)
+    end
+
+    {:stop, exit_reason(status, state), state}
+  end
+
+  defp first_output_seen(message, state) do
+    now = System.monotonic_time()
+    MuonTrap.Telemetry.phase(:daemon, :first_output, state.started_at, now, state.telemetry)
+    handle_info(message, %{state | first_output: nil})
+  end
+
+  defp exit_reason(0, state) do
+    _ = Logger.info("#{state.command}: Process exited successfully")
+    :normal
+  end
+
+  defp exit_reason(status, state) do
+    _ = Logger.error("#{state.command}: Process exited with status #{status}")
+    :error_exit_status
+  end
+
+  defp handle_message(@msg_data, data, state) do
+    if state.flow_control, do: MuonTrap.Port.output_handled(state.port)
+    {:noreply, log_output(data, state)}
+  end
+
+  defp handle_message(@msg_stderr, data, state) do
+    if state.flow_control, do: MuonTrap.Port.output_handled(state.port)
+    stderr_buffer = log_lines(state.stderr_buffer <> data, state.log_stderr, state)
+    {:noreply, %{state | stderr_buffer: stderr_buffer}}
+  end
 
-    {:stop, reason, state}
+  defp handle_message(@msg_sample, text, state) do
+    sample = MuonTrap.Port.parse_stats(text)
+    MuonTrap.SampleCache.put(sample)
+
+    :telemetry.execute([:muontrap, :daemon, :sample], sample, %{
+      command: state.command,
+      cgroup_path: state.cgroup_path
+    })
+
+    {:noreply, state}
+  end
+
+  defp handle_message(@msg_exit, <<status::32, _teardown_us::32, report::binary>>, state) do
+    if state.telemetry do
+      received_at = System.monotonic_time()
+      MuonTrap.Telemetry.launcher_phases(:daemon, report, received_at, state.telemetry)
+    end
+
+    if state.buffer != "", do: log_line(state.buffer, state.log_output, state)
+    if state.stderr_buffer != "", do: log_line(state.stderr_buffer, state.log_stderr, state)
+    {:stop, exit_reason(status, state), %{state | buffer: "", stderr_buffer: ""}}
   end
+
+  defp handle_message(_type, _payload, state), do: {:noreply, state}
+
+  defp log_output(_data, %State{log_output: nil} = state), do: state
+  defp log_output(data, state),
+    do: %{state | buffer: log_lines(state.buffer <> data, state.log_output, state)}
+
+  # Log output a line at a time like the `{:line, 256}` port option does and
+  # return what's left of the last line
+  @max_line 256
+
+  defp log_lines(data, level, state) do
+    case :binary.split(data, "\n") do
+      [line, rest] ->
+        log_line(line, level, state)
+        log_lines(rest, level, state)
+
+      [partial] when byte_size(partial) >= @max_line ->
+        <<line::binary-size(@max_line), rest::binary>> = partial
+        log_line(line, level, state)
+        log_lines(rest, level, state)
+
+      [partial] ->
+        partial
+    end
+  end
+
+  defp log_line(line, level, state) do
+    _ = Logger.log(level, [state.log_prefix, line])
+    :ok
+  end
+
+  # The pool takes the group back when the Daemon exits. It's not reused since
+  # cgset/4 may have changed it.
+  defp lease_cgroup(%{cgroup_pool: pool} = options) do
+    lease = MuonTrap.Port.checkout_cgroup!(pool, false)
+
+    options
+    |> Map.delete(:cgroup_pool)
+    |> MuonTrap.Port.with_cgroup_lease(lease)
+  end
+
+  defp lease_cgroup(options), do: options
 end
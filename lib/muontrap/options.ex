@@ -1,6 +1,7 @@
 defmodule MuonTrap.Options do
   @moduledoc """
-  Validate and normalize the options passed to MuonTrap.cmd/3 and MuonTrap.Daemon.start_link/3
+  Validate and normalize the options passed to MuonTrap.cmd/3, MuonTrap.stream/3 and
+  MuonTrap.Daemon.start_link/3
 
   This module is generally not called directly, but it's likely
   the source of exceptions if any options aren't quite right. Call `validate/4` directly to
@@ -16,6 +17,13 @@ defmodule MuonTrap.Options do
   The next fields are optional:
 
   * `:into` - `MuonTrap.cmd/3` only
+  * `:stderr_into` - `MuonTrap.cmd/3` only
+  * `:server` - `MuonTrap.cmd/3` only
+  * `:timeout` - `MuonTrap.cmd/3` and `MuonTrap.stream/3` only
+  * `:stats` - `MuonTrap.cmd/3` only
+  * `:async_cleanup` - `MuonTrap.cmd/3` only
+  * `:output_chunk_size`
+  * `:output_window`
   * `:cd`
   * `:arg0`
   * `:stderr_to_stdout`
@@ -24,13 +32,22 @@ defmodule MuonTrap.Options do
   * `:name` - `MuonTrap.Daemon`-only
   * `:log_output` - `MuonTrap.Daemon`-only
   * `:log_prefix` - `MuonTrap.Daemon`-only
+  * `:log_stderr` - `MuonTrap.Daemon`-only
+  * `:sample_interval` - `MuonTrap.Daemon`-only
+  * `:log_sample` - `MuonTrap.Daemon`-only
+  * `:output_file` - `MuonTrap.Daemon`-only
+  * `:output_file_max_bytes` - `MuonTrap.Daemon`-only
+  * `:output_file_count` - `MuonTrap.Daemon`-only
   * `:cgroup_controllers`
   * `:cgroup_path`
   * `:cgroup_base`
+  * `:cgroup_pool` - `MuonTrap.cmd/3` and `MuonTrap.Daemon` only
   * `:delay_to_sigkill`
   * `:cgroup_sets`
   * `:uid`
   * `:gid`
+  * `:subreaper`
+  * `:pid_namespace`
 
   """
   @type t() :: map()
@@ -38,11 +55,11 @@ defmodule MuonTrap.Options do
   @doc """
   Validate options and normalize them for invoking commands
 
-  Pass in `:cmd` or `:daemon` for the first parameter to allow function-specific
-  options.
+  Pass in `:cmd`, `:stream` or `:daemon` for the first parameter to allow
+  function-specific options.
   """
-  @spec validate(:cmd | :daemon, binary(), [binary()], keyword()) :: t()
-  def validate(context, cmd, args, opts) when context in [:cmd, :daemon] do
+  @spec validate(:cmd | :stream | :daemon, binary(), [binary()], keyword()) :: t()
+  def validate(context, cmd, args, opts) when context in [:cmd, :stream, :daemon] do
     assert_no_null_byte!(cmd, context)
 
     unless Enum.all?(args, &is_binary/1) do
@@ -53,6 +70,21 @@ defmodule MuonTrap.Options do
 
     validate_options(context, abs_command, args, opts)
     |> resolve_cgroup_path()
+    |> check_subreaper()
+    |> check_async_cleanup()
+    |> check_output_window()
+    |> check_capture_stderr()
+    |> route_output(context)
+  end
+
+  defp resolve_cgroup_path(%{cgroup_pool: _pool} = options) do
+    # The pool picks the group and its controllers
+    if Enum.any?([:cgroup_path, :cgroup_base, :cgroup_controllers], &Map.has_key?(options, &1)) do
+      raise ArgumentError,
+            "cannot specify a cgroup_path, cgroup_base or cgroup_controllers with a cgroup_pool"
+    end
+
+    options
   end
 
   defp resolve_cgroup_path(%{cgroup_path: _path, cgroup_base: _base}) do
@@ -66,6 +98,72 @@ defmodule MuonTrap.Options do
 
   defp resolve_cgroup_path(other), do: other
 
+  defp check_subreaper(%{subreaper: true, server: _server}) do
+    raise ArgumentError, "cannot use subreaper with a MuonTrap.Server"
+  end
+
+  defp check_subreaper(other), do: other
+
+  # Stats are collected during the cleanup and pooled groups go back to the
+  # pool when cmd returns, so neither can wait for an asynchronous cleanup.
+  defp check_async_cleanup(%{async_cleanup: true} = options) do
+    if options[:stats] == true or Map.has_key?(options, :server) or
+         Map.has_key?(options, :cgroup_pool) do
+      raise ArgumentError, "cannot use async_cleanup with stats, server or cgroup_pool"
+    end
+
+    options
+  end
+
+  defp check_async_cleanup(other), do: other
+
+  # MuonTrap.Server doesn't grant output credits
+  defp check_output_window(%{output_window: _count, server: _server}) do
+    raise ArgumentError, "cannot use output_window with a MuonTrap.Server"
+  end
+
+  defp check_output_window(other), do: other
+
+  # muontrap captures stderr separately for :stderr_into and :log_stderr
+  defp check_capture_stderr(options) do
+    if Map.has_key?(options, :stderr_into) or Map.has_key?(options, :log_stderr) do
+      if options[:stderr_to_stdout] == true or Map.has_key?(options, :server) do
+        raise ArgumentError,
+              "cannot capture stderr separately with stderr_to_stdout or a MuonTrap.Server"
+      end
+    end
+
+    options
+  end
+
+  # Daemon output that isn't logged is discarded or written to a file by
+  # muontrap so that the Daemon doesn't have to receive it
+  defp route_output(options, context) when context in [:cmd, :stream], do: options
+
+  defp route_output(options, :daemon) do
+    if Enum.any?([:output_file_max_bytes, :output_file_count], &Map.has_key?(options, &1)) and
+         not Map.has_key?(options, :output_file) do
+      raise ArgumentError, "output_file_max_bytes and output_file_count need an output_file"
+    end
+
+    cond do
+      not Map.has_key?(options, :log_output) and Map.has_key?(options, :output_file) ->
+        Map.delete(options, :log_sample)
+
+      not Map.has_key?(options, :log_output) ->
+        options |> Map.delete(:log_sample) |> Map.put(:output_discard, true)
+
+      Map.has_key?(options, :output_file) ->
+        Map.put_new(options, :log_sample, 1)
+
+      options[:log_sample] == 1 ->
+        Map.delete(options, :log_sample)
+
+      true ->
+        options
+    end
+  end
+
   # Thanks https://github.com/danhper/elixir-temp/blob/master/lib/temp.ex
   defp random_string() do
     Integer.to_string(:rand.uniform(0x100000000), 36) |> String.downcase()
@@ -81,6 +179,22 @@ defmodule MuonTrap.Options do
 
   # System.cmd/3 options
   defp validate_option(:cmd, {:into, what}, opts), do: Map.put(opts, :into, what)
+
+  defp validate_option(:cmd, {:stderr_into, what}, opts), do: Map.put(opts, :stderr_into, what)
+
+  defp validate_option(:cmd, {:server, server}, opts) when server != nil,
+    do: Map.put(opts, :server, server)
+
+  defp validate_option(context, {:timeout, ms}, opts)
+       when context in [:cmd, :stream] and is_integer(ms) and ms > 0,
+       do: Map.put(opts, :timeout, ms)
+
+  defp validate_option(:cmd, {:stats, bool}, opts) when is_boolean(bool),
+    do: Map.put(opts, :stats, bool)
+
+  defp validate_option(:cmd, {:async_cleanup, bool}, opts) when is_boolean(bool),
+    do: Map.put(opts, :async_cleanup, bool)
+
   defp validate_option(_any, {:cd, bin}, opts) when is_binary(bin), do: Map.put(opts, :cd, bin)
 
   defp validate_option(_any, {:arg0, bin}, opts) when is_binary(bin),
@@ -103,10 +217,38 @@ defmodule MuonTrap.Options do
        when level in [:error, :warn, :info, :debug],
        do: Map.put(opts, :log_output, level)
 
+  defp validate_option(:daemon, {:log_stderr, level}, opts)
+       when level in [:error, :warn, :info, :debug],
+       do: Map.put(opts, :log_stderr, level)
+
   defp validate_option(:daemon, {:log_prefix, prefix}, opts) when is_binary(prefix),
     do: Map.put(opts, :log_prefix, prefix)
 
+  defp validate_option(:daemon, {:sample_interval, ms}, opts) when is_integer(ms) and ms > 0,
+    do: Map.put(opts, :sample_interval, ms)
+
+  defp validate_option(:daemon, {:log_sample, n}, opts) when is_integer(n) and n > 0,
+    do: Map.put(opts, :log_sample, n)
+
+  defp validate_option(:daemon, {:output_file, path}, opts) when is_binary(path),
+    do: Map.put(opts, :output_file, path)
+
+  defp validate_option(:daemon, {:output_file_max_bytes, bytes}, opts)
+       when is_integer(bytes) and bytes > 0,
+       do: Map.put(opts, :output_file_max_bytes, bytes)
+
+  defp validate_option(:daemon, {:output_file_count, count}, opts)
+       when is_integer(count) and count >= 0,
+       do: Map.put(opts, :output_file_count, count)
+
   # MuonTrap common options
+  defp validate_option(_any, {:output_chunk_size, bytes}, opts)
+       when is_integer(bytes) and bytes > 0 and bytes <= 16_777_216,
+       do: Map.put(opts, :output_chunk_size, bytes)
+
+  defp validate_option(_any, {:output_window, count}, opts) when is_integer(count) and count > 0,
+    do: Map.put(opts, :output_window, count)
+
   defp validate_option(_any, {:cgroup_controllers, controllers}, opts) when is_list(controllers),
     do: Map.put(opts, :cgroup_controllers, controllers)
 
@@ -118,6 +260,11 @@ defmodule MuonTrap.Options do
     Map.put(opts, :cgroup_base, path)
   end
 
+  # Streams can stop at any time, so there's no telling when to return the group
+  defp validate_option(context, {:cgroup_pool, pool}, opts)
+       when context in [:cmd, :daemon] and pool != nil,
+       do: Map.put(opts, :cgroup_pool, pool)
+
   defp validate_option(_any, {:delay_to_sigkill, delay}, opts) when is_integer(delay),
     do: Map.put(opts, :delay_to_sigkill, delay)
 
@@ -130,6 +277,12 @@ defmodule MuonTrap.Options do
   defp validate_option(_any, {:gid, id}, opts) when is_integer(id) or is_binary(id),
     do: Map.put(opts, :gid, id)
 
+  defp validate_option(_any, {:subreaper, bool}, opts) when is_boolean(bool),
+    do: Map.put(opts, :subreaper, bool)
+
+  defp validate_option(_any, {:pid_namespace, bool}, opts) when is_boolean(bool),
+    do: Map.put(opts, :pid_namespace, bool)
+
   defp validate_option(_any, {key, val}, _opts),
     do: raise(ArgumentError, "invalid option #{inspect(key)} with value #{inspect(val)}")
 
@@ -161,5 +314,6 @@ defmodule MuonTrap.Options do
   end
 
   defp operation(:cmd), do: "MuonTrap.cmd/3"
+  defp operation(:stream), do: "MuonTrap.stream/3"
   defp operation(:daemon), do: "MuonTrap.Daemon.start_link/3"
 end
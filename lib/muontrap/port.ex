@@ -12,22 +12,147 @@ defmodule MuonTrap.Port do
   This code is mostly copy/pasted from System.cmd/3's implementation so that
   it works similarly.
   """
-  @spec cmd(MuonTrap.Options.t()) :: {Collectable.t(), exit_status :: non_neg_integer()}
+  @spec cmd(MuonTrap.Options.t()) ::
+          {Collectable.t(), exit_status :: non_neg_integer()}
+          | {Collectable.t(), exit_status :: non_neg_integer(), stats :: map()}
+  def cmd(%{cgroup_pool: pool} = options) do
+    # Groups with custom settings can't be reused
+    lease = checkout_cgroup!(pool, not Map.has_key?(options, :cgroup_sets))
+
+    try do
+      options
+      |> Map.delete(:cgroup_pool)
+      |> with_cgroup_lease(lease)
+      |> cmd()
+    after
+      MuonTrap.CgroupPool.checkin(pool, lease)
+    end
+  end
+
+  def cmd(%{server: server} = options) do
+    {initial, fun} = Collectable.into(options.into)
+    started_at = System.monotonic_time()
+
+    try do
+      monitor_ref = Process.monitor(server)
+      ref = MuonTrap.Server.spawn_command(server, options)
+      result = do_server_cmd(ref, monitor_ref, initial, fun, "", first_output(options))
+      Process.demonitor(monitor_ref, [:flush])
+      result
+    catch
+      kind, reason ->
+        fun.(initial, :halt)
+        :erlang.raise(kind, reason, __STACKTRACE__)
+    else
+      {acc, status, report, first_output_at} ->
+        finish(options, fun.(acc, :done), status, report, started_at, first_output_at)
+    end
+  end
+
   def cmd(options) do
     opts = port_options(options)
-    {initial, fun} = Collectable.into(options.into)
+    {initial, fun} = collector(options)
+    started_at = System.monotonic_time()
 
     try do
-      do_cmd(Port.open({:spawn_executable, to_charlist(muontrap_path())}, opts), initial, fun)
+      port = Port.open({:spawn_executable, to_charlist(muontrap_path())}, opts)
+      port_opened(options, started_at)
+
+      cond do
+        framed?(options) ->
+          do_framed_cmd(port, initial, fun, options, nil, first_output(options))
+
+        reporting?(options) -> do_cmd(port, initial, fun, "", first_output(options))
+        true -> do_cmd(port, initial, fun)
+      end
     catch
       kind, reason ->
         fun.(initial, :halt)
         :erlang.raise(kind, reason, __STACKTRACE__)
     else
-      {acc, status} -> {fun.(acc, :done), status}
+      {acc, status} ->
+        result(options, fun.(acc, :done), status, %{})
+
+      {acc, status, report, first_output_at} ->
+        finish(options, fun.(acc, :done), status, report, started_at, first_output_at)
+    end
+  end
+
+  # With :stderr_into, stderr is collected alongside the output and the
+  # accumulator is {output, stderr_output}. Stderr comes in as {:stderr, data}.
+  defp collector(%{stderr_into: stderr_into} = options) do
+    {initial, fun} = Collectable.into(options.into)
+    {stderr_initial, stderr_fun} = Collectable.into(stderr_into)
+
+    collect = fn
+      {acc, stderr_acc}, {:cont, {:stderr, data}} -> {acc, stderr_fun.(stderr_acc, {:cont, data})}
+      {acc, stderr_acc}, {:cont, data} -> {fun.(acc, {:cont, data}), stderr_acc}
+      {acc, stderr_acc}, command -> {fun.(acc, command), stderr_fun.(stderr_acc, command)}
+    end
+
+    {{initial, stderr_initial}, collect}
+  end
+
+  defp collector(options), do: Collectable.into(options.into)
+
+  # Chunked output has to come through muontrap rather than straight from the
+  # command and Daemon samples and early exit statuses need to be told apart
+  # from the output, so they use the server protocol. See src/muontrap.c.
+  @msg_data ?d
+  @msg_exit ?x
+  @msg_exited ?e
+  @msg_credits ?C
+  @msg_stderr ?r
+
+  # Options that need the server protocol besides :async_cleanup
+  @framed_options [
+    :output_chunk_size,
+    :sample_interval,
+    :output_file,
+    :log_sample,
+    :output_window,
+    :stderr_into,
+    :log_stderr
+  ]
+
+  @doc """
+  Return whether the command needs muontrap's server protocol
+  """
+  @spec framed?(MuonTrap.Options.t()) :: boolean()
+  def framed?(options) do
+    Enum.any?(@framed_options, &Map.has_key?(options, &1)) or options[:async_cleanup] == true
+  end
+
+  # Stats and timings come from muontrap after the command exits
+  defp reporting?(options), do: options[:stats] == true or Map.has_key?(options, :telemetry)
+
+  # Only look at the clock for the first output if someone wants to know
+  defp first_output(%{telemetry: _metadata}), do: :waiting
+  defp first_output(_options), do: nil
+
+  defp port_opened(%{telemetry: metadata}, started_at) do
+    MuonTrap.Telemetry.phase(:cmd, :port_open, started_at, System.monotonic_time(), metadata)
+  end
+
+  defp port_opened(_options, _started_at), do: :ok
+
+  defp finish(options, collected, status, report, started_at, first_output_at) do
+    with %{telemetry: metadata} <- options do
+      received_at = System.monotonic_time()
+
+      if is_integer(first_output_at) do
+        MuonTrap.Telemetry.phase(:cmd, :first_output, started_at, first_output_at, metadata)
+      end
+
+      MuonTrap.Telemetry.launcher_phases(:cmd, report, received_at, metadata)
     end
+
+    result(options, collected, status, parse_stats(report))
   end
 
+  defp result(%{stats: true}, collected, status, stats), do: {collected, status, stats}
+  defp result(_options, collected, status, _stats), do: {collected, status}
+
   defp do_cmd(port, acc, fun) do
     receive do
       {^port, {:data, data}} ->
@@ -38,7 +163,255 @@ defmodule MuonTrap.Port do
     end
   end
 
+  # The stats and timings trailer comes after the output, so hold back
+  # enough of the output to find it when muontrap exits.
+  defp do_cmd(port, acc, fun, held, first_output_at) do
+    receive do
+      {^port, {:data, data}} ->
+        {output, held} = hold_back_trailer(held <> data)
+        do_cmd(port, collect(acc, fun, output), fun, held, output_seen(first_output_at, output))
+
+      {^port, {:exit_status, status}} ->
+        {output, report} = split_stats_trailer(held)
+        {collect(acc, fun, output), status, report, output_seen(first_output_at, output)}
+    end
+  end
+
+  # muontrap reports the exit status before it exits. Wait for the port to
+  # close so that nothing is left in the mailbox. With :async_cleanup, it
+  # reports the exit status early and the port is handed off to finish up.
+  defp do_framed_cmd(port, acc, fun, options, exit, first_output_at) do
+    receive do
+      {^port, {:data, <<@msg_data, 0::32, data::binary>>}} ->
+        acc = fun.(acc, {:cont, data})
+        if Map.has_key?(options, :output_window), do: output_handled(port)
+        do_framed_cmd(port, acc, fun, options, exit, output_seen(first_output_at, data))
+
+      {^port, {:data, <<@msg_stderr, 0::32, data::binary>>}} ->
+        acc = fun.(acc, {:cont, {:stderr, data}})
+        if Map.has_key?(options, :output_window), do: output_handled(port)
+        do_framed_cmd(port, acc, fun, options, exit, first_output_at)
+
+      {^port, {:data, <<@msg_exited, 0::32, status::32>>}} ->
+        MuonTrap.Cleanup.hand_off(port, options)
+        {acc, status, "", first_output_at}
+
+      {^port, {:data, <<@msg_exit, 0::32, status::32, _teardown_us::32, report::binary>>}} ->
+        do_framed_cmd(port, acc, fun, options, {status, report}, first_output_at)
+
+      {^port, {:data, _other}} ->
+        do_framed_cmd(port, acc, fun, options, exit, first_output_at)
+
+      {^port, {:exit_status, status}} ->
+        {status, report} = exit || {status, ""}
+        {acc, status, report, first_output_at}
+    end
+  end
+
+  @doc """
+  Let muontrap send another output message when using `:output_window`
+  """
+  @spec output_handled(port()) :: :ok
+  def output_handled(port) do
+    Port.command(port, <<@msg_credits, 0::32, 1::32>>)
+    :ok
+  rescue
+    # muontrap has exited already
+    ArgumentError -> :ok
+  end
+
+  @doc """
+  Run a command and return a stream of its output
+
+  See `MuonTrap.stream/3`.
+  """
+  @spec stream(MuonTrap.Options.t()) :: Enumerable.t()
+  def stream(options) do
+    Stream.resource(fn -> open_stream(options) end, &next_output/1, &close_stream/1)
+  end
+
+  defp open_stream(options) do
+    Port.open({:spawn_executable, to_charlist(muontrap_path())}, port_options(options))
+  end
+
+  defp next_output(port) do
+    receive do
+      {^port, {:data, <<@msg_data, 0::32, data::binary>>}} ->
+        output_handled(port)
+        {[data], port}
+
+      {^port, {:data, _other}} ->
+        {[], port}
+
+      {^port, {:exit_status, _status}} ->
+        {:halt, nil}
+    end
+  end
+
+  defp close_stream(nil), do: :ok
+
+  # Stopped early. Closing the port tells muontrap to kill the command.
+  defp close_stream(port) do
+    try do
+      Port.close(port)
+    rescue
+      ArgumentError -> true
+    end
+
+    flush_stream(port)
+  end
+
+  defp flush_stream(port) do
+    receive do
+      {^port, _message} -> flush_stream(port)
+    after
+      0 -> :ok
+    end
+  end
+
+  defp do_server_cmd(ref, monitor_ref, acc, fun, report, first_output_at) do
+    receive do
+      {^ref, {:data, data}} ->
+        acc = fun.(acc, {:cont, data})
+        do_server_cmd(ref, monitor_ref, acc, fun, report, output_seen(first_output_at, data))
+
+      {^ref, {:stats, text}} ->
+        do_server_cmd(ref, monitor_ref, acc, fun, text, first_output_at)
+
+      {^ref, {:exit_status, status}} ->
+        {acc, status, report, first_output_at}
+
+      {:DOWN, ^monitor_ref, :process, _pid, reason} ->
+        exit({reason, {MuonTrap.Server, :spawn_command, [ref]}})
+    end
+  end
+
+  # Data that's held back might turn out to only be the trailer, so the first
+  # output's time is pending until some output makes it through.
+  defp output_seen(:waiting, ""), do: {:pending, System.monotonic_time()}
+  defp output_seen(:waiting, _output), do: System.monotonic_time()
+  defp output_seen({:pending, time}, output) when output != "", do: time
+  defp output_seen(first_output_at, _output), do: first_output_at
+
+  defp collect(acc, _fun, ""), do: acc
+  defp collect(acc, fun, data), do: fun.(acc, {:cont, data})
+
+  # See --stats in src/muontrap.c for the trailer format
+  @stats_trailer_magic <<0, "MUONTRAP-STATS", 0>>
+  @stats_trailer_overhead 4 + byte_size(@stats_trailer_magic)
+  @max_stats_trailer 1024 + @stats_trailer_overhead
+
+  defp hold_back_trailer(data) when byte_size(data) <= @max_stats_trailer, do: {"", data}
+
+  defp hold_back_trailer(data) do
+    output_size = byte_size(data) - @max_stats_trailer
+    <<output::binary-size(output_size), held::binary>> = data
+    {output, held}
+  end
+
+  defp split_stats_trailer(data) when byte_size(data) >= @stats_trailer_overhead do
+    size = byte_size(data) - @stats_trailer_overhead
+
+    case data do
+      <<rest::binary-size(size), len::32, @stats_trailer_magic::binary>> when len <= size ->
+        output_size = size - len
+        <<output::binary-size(output_size), text::binary>> = rest
+        {output, text}
+
+      _ ->
+        {data, ""}
+    end
+  end
+
+  defp split_stats_trailer(data), do: {data, ""}
+
+  @stat_names [
+    :utime_us,
+    :stime_us,
+    :maxrss_kb,
+    :minflt,
+    :majflt,
+    :nvcsw,
+    :nivcsw,
+    :inblock,
+    :oublock,
+    :cgroup_cpu_us,
+    :cgroup_user_us,
+    :cgroup_system_us,
+    :cgroup_memory_peak_bytes,
+    :cgroup_memory_bytes,
+    :cgroup_pids,
+    :cgroup_io_read_bytes,
+    :cgroup_io_write_bytes
+  ]
+  @stat_name_lookup Map.new(@stat_names, &{Atom.to_string(&1), &1})
+
+  @doc """
+  Parse the "<name> <value>" lines that muontrap reports for --stats and
+  --sample-interval
+
+  Unknown names are skipped. If more than one cgroup reports a value, the
+  first one is kept.
+  """
+  @spec parse_stats(binary()) :: %{atom() => non_neg_integer()}
+  def parse_stats(text) do
+    text
+    |> String.split("\n", trim: true)
+    |> Enum.reduce(%{}, fn line, acc ->
+      with [name, value] <- String.split(line, " "),
+           {:ok, key} <- Map.fetch(@stat_name_lookup, name),
+           {number, ""} <- Integer.parse(value) do
+        Map.put_new(acc, key, number)
+      else
+        _ -> acc
+      end
+    end)
+  end
+
+  @doc """
+  Lease a group from a MuonTrap.CgroupPool or raise
+  """
+  @spec checkout_cgroup!(GenServer.server(), boolean()) :: MuonTrap.CgroupPool.lease()
+  def checkout_cgroup!(pool, recycle?) do
+    case MuonTrap.CgroupPool.checkout(pool, recycle?) do
+      {:ok, lease} ->
+        lease
+
+      {:error, reason} ->
+        raise RuntimeError, "couldn't lease a cgroup from #{inspect(pool)}: #{inspect(reason)}"
+    end
+  end
+
+  @doc """
+  Run in a leased group rather than creating one
+  """
+  @spec with_cgroup_lease(MuonTrap.Options.t(), MuonTrap.CgroupPool.lease()) ::
+          MuonTrap.Options.t()
+  def with_cgroup_lease(options, lease) do
+    Map.merge(options, %{
+      cgroup_path: lease.cgroup_path,
+      cgroup_controllers: lease.cgroup_controllers,
+      pooled_cgroup: true
+    })
+  end
+
   def port_options(options) do
+    if framed?(options), do: framed_port_options(options), else: stream_port_options(options)
+  end
+
+  defp framed_port_options(options) do
+    [
+      :use_stdio,
+      :exit_status,
+      :binary,
+      :hide,
+      {:packet, 4},
+      {:args, ["--framed" | framed_args(options)]}
+      | Enum.filter(options, &match?({:parallelism, _}, &1))
+    ]
+  end
+
+  defp stream_port_options(options) do
     [
       :use_stdio,
       :exit_status,
@@ -48,15 +421,66 @@ defmodule MuonTrap.Port do
     ]
   end
 
-  defp muontrap_args(options) do
-    Enum.flat_map(options, &muontrap_arg/1) ++ ["--", options.cmd] ++ options.args
+  @spec muontrap_args(MuonTrap.Options.t()) :: [String.t()]
+  def muontrap_args(options) do
+    cgroup_root_args() ++
+      Enum.flat_map(options, &muontrap_arg/1) ++ ["--", options.cmd] ++ options.args
+  end
+
+  @doc """
+  Return the muontrap arguments for running a command using the server protocol
+
+  Output goes through messages rather than the port, so options that would
+  otherwise be port options are passed to muontrap.
+  """
+  @spec framed_args(MuonTrap.Options.t()) :: [String.t()]
+  def framed_args(options) do
+    Enum.flat_map(options, &framed_arg/1) ++ muontrap_args(options)
+  end
+
+  # Only set when testing against a fake cgroup filesystem
+  defp cgroup_root_args() do
+    case Application.fetch_env(:muontrap, :cgroup_root) do
+      {:ok, root} -> ["--cgroup-root", root]
+      :error -> []
+    end
   end
 
+  # These are port options when not framed
+  defp framed_arg({:cd, bin}), do: ["--cd", bin]
+  defp framed_arg({:stderr_to_stdout, true}), do: ["--stderr-to-stdout"]
+
+  defp framed_arg({:env, env}) do
+    Enum.flat_map(env, fn
+      {key, false} -> ["--env", to_string(key)]
+      {key, value} -> ["--env", "#{key}=#{value}"]
+    end)
+  end
+
+  defp framed_arg(_other), do: []
+
   defp muontrap_arg({:cgroup_path, path}), do: ["--group", path]
   defp muontrap_arg({:delay_to_sigkill, delay}), do: ["--delay-to-sigkill", to_string(delay)]
+  defp muontrap_arg({:timeout, ms}), do: ["--timeout", to_string(ms)]
+  defp muontrap_arg({:stats, true}), do: ["--stats"]
+  defp muontrap_arg({:telemetry, _metadata}), do: ["--timings"]
+  defp muontrap_arg({:sample_interval, ms}), do: ["--sample-interval", to_string(ms)]
+  defp muontrap_arg({:output_chunk_size, bytes}), do: ["--output-chunk-size", to_string(bytes)]
+  defp muontrap_arg({:async_cleanup, true}), do: ["--early-exit-status"]
+  defp muontrap_arg({:output_discard, true}), do: ["--output-discard"]
+  defp muontrap_arg({:output_file, path}), do: ["--output-file", path]
+  defp muontrap_arg({:output_file_max_bytes, n}), do: ["--output-file-max-bytes", to_string(n)]
+  defp muontrap_arg({:output_file_count, count}), do: ["--output-file-count", to_string(count)]
+  defp muontrap_arg({:log_sample, n}), do: ["--output-sample", to_string(n)]
+  defp muontrap_arg({:output_window, count}), do: ["--output-credits", to_string(count)]
+  defp muontrap_arg({:stderr_into, _collectable}), do: ["--capture-stderr"]
+  defp muontrap_arg({:log_stderr, _level}), do: ["--capture-stderr"]
   defp muontrap_arg({:uid, id}), do: ["--uid", to_string(id)]
   defp muontrap_arg({:gid, id}), do: ["--gid", to_string(id)]
   defp muontrap_arg({:arg0, arg0}), do: ["--arg0", arg0]
+  defp muontrap_arg({:pooled_cgroup, true}), do: ["--pooled-group"]
+  defp muontrap_arg({:subreaper, true}), do: ["--subreaper"]
+  defp muontrap_arg({:pid_namespace, true}), do: ["--pid-namespace"]
 
   defp muontrap_arg({:cgroup_controllers, controllers}) do
     Enum.flat_map(controllers, fn controller -> ["--controller", controller] end)
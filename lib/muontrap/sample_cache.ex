@@ -0,0 +1,62 @@
+defmodule MuonTrap.SampleCache do
+  @moduledoc false
+
+  # Holds the last cgroup sample from each MuonTrap.Daemon that has a
+  # :sample_interval. Daemons write to the table directly and readers look up
+  # samples without going through any process. This process owns the table
+  # and removes samples when their daemons exit.
+
+  use GenServer
+
+  @table __MODULE__
+
+  @spec start_link(keyword()) :: GenServer.on_start()
+  def start_link(opts) do
+    GenServer.start_link(__MODULE__, opts, name: __MODULE__)
+  end
+
+  @doc """
+  Remove the calling process's sample when it exits
+  """
+  @spec register() :: :ok
+  def register() do
+    GenServer.cast(__MODULE__, {:register, self()})
+  end
+
+  @doc """
+  Store the calling process's latest sample
+  """
+  @spec put(map()) :: true
+  def put(sample) do
+    :ets.insert(@table, {self(), sample})
+  end
+
+  @doc """
+  Return the latest sample for a process or nil if there isn't one
+  """
+  @spec get(pid()) :: map() | nil
+  def get(pid) do
+    case :ets.lookup(@table, pid) do
+      [{^pid, sample}] -> sample
+      [] -> nil
+    end
+  end
+
+  @impl true
+  def init(_opts) do
+    _ = :ets.new(@table, [:named_table, :public, :set, read_concurrency: true])
+    {:ok, nil}
+  end
+
+  @impl true
+  def handle_cast({:register, pid}, state) do
+    _ = Process.monitor(pid)
+    {:noreply, state}
+  end
+
+  @impl true
+  def handle_info({:DOWN, _ref, :process, pid, _reason}, state) do
+    :ets.delete(@table, pid)
+    {:noreply, state}
+  end
+end
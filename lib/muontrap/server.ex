@@ -0,0 +1,234 @@
+defmodule MuonTrap.Server do
+  use GenServer
+
+  require Logger
+
+  @moduledoc """
+  Run many commands through one long-lived `muontrap` process.
+
+  Each call to `MuonTrap.cmd/3` normally starts a new `muontrap` port process
+  which then starts the command. When running lots of short commands, starting
+  `muontrap` can take as long as the command. A `MuonTrap.Server` starts
+  `muontrap` once and sends it requests to run commands instead.
+
+  Add a server to one of your supervision trees:
+
+  ```elixir
+  children = [
+    {MuonTrap.Server, name: MyApp.MuonTrap}
+  ]
+  ```
+
+  And then pass it to `MuonTrap.cmd/3`:
+
+  ```elixir
+  iex> MuonTrap.cmd("echo", ["hello"], server: MyApp.MuonTrap)
+  {"hello\\n", 0}
+  ```
+
+  Commands are still contained. If the process calling `MuonTrap.cmd/3` exits,
+  its command is killed. If the server exits, all of its commands are killed.
+
+  The `:parallelism` option only applies to ports, so it's ignored when
+  running commands through a server.
+  """
+
+  # See src/muontrap.c for the protocol
+  @msg_spawn ?S
+  @msg_kill ?K
+  @msg_status ?Q
+  @msg_started ?s
+  @msg_data ?d
+  @msg_exit ?x
+  @msg_status_reply ?q
+
+  defmodule State do
+    @moduledoc false
+
+    defstruct port: nil, next_id: 1, commands: %{}, refs: %{}, status_requests: %{}
+  end
+
+  @doc """
+  Start a server.
+
+  Options:
+
+  * `:name` - Name the server GenServer
+  """
+  @spec start_link(keyword()) :: GenServer.on_start()
+  def start_link(opts \\ []) do
+    genserver_opts = Keyword.take(opts, [:name])
+
+    GenServer.start_link(__MODULE__, opts, genserver_opts)
+  end
+
+  @doc """
+  Start a command
+
+  This is normally called via `MuonTrap.cmd/3`. The command's output is sent
+  to the calling process as `{ref, {:data, data}}` messages followed by a
+  final `{ref, {:exit_status, status}}` message. With the `:stats` option,
+  a `{ref, {:stats, text}}` message comes just before the exit status.
+  """
+  @spec spawn_command(GenServer.server(), MuonTrap.Options.t()) :: reference()
+  def spawn_command(server, options) do
+    GenServer.call(server, {:spawn, MuonTrap.Port.framed_args(options)})
+  end
+
+  @doc """
+  Kill a command
+
+  The command gets a SIGTERM and then a SIGKILL if it hasn't exited after
+  the `:delay_to_sigkill` time.
+  """
+  @spec kill(GenServer.server(), reference()) :: :ok
+  def kill(server, ref) do
+    GenServer.cast(server, {:kill, ref})
+  end
+
+  @doc """
+  Return the state and OS pid of a command
+  """
+  @spec status(GenServer.server(), reference()) ::
+          {:running | :terminating, non_neg_integer()} | :not_found
+  def status(server, ref) do
+    GenServer.call(server, {:status, ref})
+  end
+
+  @impl true
+  def init(_opts) do
+    Process.flag(:trap_exit, true)
+
+    port =
+      Port.open({:spawn_executable, to_charlist(MuonTrap.muontrap_path())}, [
+        {:args, ["--server"]},
+        {:packet, 4},
+        :use_stdio,
+        :exit_status,
+        :binary,
+        :hide
+      ])
+
+    {:ok, %State{port: port}}
+  end
+
+  @impl true
+  def handle_call({:spawn, args}, {pid, _tag}, state) do
+    id = free_id(state.next_id, state.commands)
+    ref = make_ref()
+    monitor_ref = Process.monitor(pid)
+
+    Port.command(state.port, [@msg_spawn, <<id::32>> | Enum.map(args, &[&1, 0])])
+
+    new_state = %{
+      state
+      | next_id: next_id(id),
+        commands: Map.put(state.commands, id, {pid, ref, monitor_ref}),
+        refs: Map.put(state.refs, ref, id)
+    }
+
+    {:reply, ref, new_state}
+  end
+
+  def handle_call({:status, ref}, from, state) do
+    case Map.fetch(state.refs, ref) do
+      {:ok, id} ->
+        Port.command(state.port, <<@msg_status, id::32>>)
+        requests = Map.update(state.status_requests, id, [from], &[from | &1])
+        {:noreply, %{state | status_requests: requests}}
+
+      :error ->
+        {:reply, :not_found, state}
+    end
+  end
+
+  @impl true
+  def handle_cast({:kill, ref}, state) do
+    case Map.fetch(state.refs, ref) do
+      {:ok, id} -> Port.command(state.port, <<@msg_kill, id::32>>)
+      :error -> :ok
+    end
+
+    {:noreply, state}
+  end
+
+  @impl true
+  def handle_info(
+        {port, {:data, <<type, id::32, payload::binary>>}},
+        %State{port: port} = state
+      ) do
+    {:noreply, handle_message(type, id, payload, state)}
+  end
+
+  def handle_info({:DOWN, monitor_ref, :process, _pid, _reason}, state) do
+    # The caller exited, so kill its command. The command's exit message
+    # will clean up the rest.
+    case Enum.find(state.commands, fn {_id, {_pid, _ref, mref}} -> mref == monitor_ref end) do
+      {id, _} -> Port.command(state.port, <<@msg_kill, id::32>>)
+      nil -> :ok
+    end
+
+    {:noreply, state}
+  end
+
+  def handle_info({port, {:exit_status, status}}, %State{port: port} = state) do
+    {:stop, {:muontrap_exited, status}, state}
+  end
+
+  def handle_info({:EXIT, port, reason}, %State{port: port} = state) do
+    {:stop, reason, state}
+  end
+
+  def handle_info(_other, state) do
+    {:noreply, state}
+  end
+
+  # Ids are 32 bits on the wire. 0 isn't used, and ids stay taken until the
+  # command's exit message arrives.
+  defp next_id(id), do: rem(id, 0xFFFFFFFF) + 1
+
+  defp free_id(id, commands) do
+    if Map.has_key?(commands, id), do: free_id(next_id(id), commands), else: id
+  end
+
+  defp handle_message(@msg_started, _id, _payload, state), do: state
+
+  defp handle_message(@msg_data, id, data, state) do
+    case Map.fetch(state.commands, id) do
+      {:ok, {pid, ref, _}} -> send(pid, {ref, {:data, data}})
+      :error -> :ok
+    end
+
+    state
+  end
+
+  defp handle_message(@msg_exit, id, <<status::32, teardown_us::32, stats::binary>>, state) do
+    case Map.pop(state.commands, id) do
+      {{pid, ref, monitor_ref}, commands} ->
+        _ = Logger.debug("MuonTrap.Server: command #{id} teardown took #{teardown_us} us")
+        Process.demonitor(monitor_ref, [:flush])
+        if stats != "", do: send(pid, {ref, {:stats, stats}})
+        send(pid, {ref, {:exit_status, status}})
+        %{state | commands: commands, refs: Map.delete(state.refs, ref)}
+
+      {nil, _} ->
+        state
+    end
+  end
+
+  defp handle_message(@msg_status_reply, id, <<code, os_pid::32>>, state) do
+    {requests, status_requests} = Map.pop(state.status_requests, id, [])
+
+    reply =
+      case code do
+        1 -> {:running, os_pid}
+        2 -> {:terminating, os_pid}
+        _ -> :not_found
+      end
+
+    Enum.each(requests, &GenServer.reply(&1, reply))
+    %{state | status_requests: status_requests}
+  end
+
+  defp handle_message(_type, _id, _payload, state), do: state
+end
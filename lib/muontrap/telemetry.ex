@@ -0,0 +1,131 @@
+defmodule MuonTrap.Telemetry do
+  @moduledoc """
+  Telemetry events for finding out where the time goes when running commands
+
+  `MuonTrap.cmd/3` runs in a span:
+
+  * `[:muontrap, :cmd, :start]` - measurements: `%{system_time: native_time}`
+  * `[:muontrap, :cmd, :stop]` - measurements: `%{duration: native_time}`.
+    Metadata includes the `:exit_status`.
+  * `[:muontrap, :cmd, :exception]` - if the command raises
+
+  Each phase of running a command also gets a pair of events. These are named
+  `[:muontrap, context, phase, :start]` and `[:muontrap, context, phase, :stop]`
+  where `context` is `:cmd` or `:daemon`. The start event has a
+  `:monotonic_time` measurement and the stop event has `:monotonic_time` and
+  `:duration` measurements. Both are in `:native` time units. The phases are:
+
+  * `:validate` - checking the options
+  * `:port_open` - starting the `muontrap` port process. `MuonTrap.Server`
+    commands skip this.
+  * `:cgroup` - creating the cgroups and writing `:cgroup_sets`
+  * `:exec` - starting the command
+  * `:first_output` - from starting `muontrap` until the first output from
+    the command
+  * `:run` - from starting the command until it exits
+  * `:teardown` - killing anything left over and removing the cgroups. It
+    starts when the command exits or when `muontrap` starts killing it,
+    whichever comes first.
+
+  Both events for a phase are sent when it's over, so they don't nest like
+  spans. The `:cgroup`, `:exec` and `:teardown` phases happen in `muontrap`.
+  It records when they happened and reports it after the command exits, so
+  their events come last. The times are converted to the Erlang monotonic
+  clock so that phases can be compared. `muontrap` only reports them if
+  there are handlers for `MuonTrap`'s events when the command starts.
+  `MuonTrap.Daemon` only gets these phases when the `:sample_interval` or
+  `:output_chunk_size` option is set.
+
+  With `async_cleanup: true`, the `:teardown` phase is still running when
+  `MuonTrap.cmd/3` returns. Its events come when it's done, followed by:
+
+  * `[:muontrap, :cmd, :cleanup]` - measurements: `%{teardown_us: integer,
+    leftover_pids: integer, cgroup_errors: integer, discarded_bytes: integer}`.
+    `leftover_pids` is how many descendants couldn't be killed and
+    `cgroup_errors` is how many cgroups couldn't be removed.
+    `discarded_bytes` is output that descendants wrote after the command
+    exited. It isn't collected since `MuonTrap.cmd/3` has already returned.
+
+  The metadata for all events has the `:command` and its `:args`.
+  """
+
+  @doc false
+  @spec enabled?(:cmd | :daemon) :: boolean()
+  def enabled?(context) do
+    :telemetry.list_handlers([:muontrap, context]) != []
+  end
+
+  @doc false
+  @spec phase(:cmd | :daemon, atom(), integer(), integer(), map()) :: :ok
+  def phase(context, phase, start_time, stop_time, metadata) do
+    :telemetry.execute(
+      [:muontrap, context, phase, :start],
+      %{monotonic_time: start_time},
+      metadata
+    )
+
+    :telemetry.execute(
+      [:muontrap, context, phase, :stop],
+      %{monotonic_time: stop_time, duration: stop_time - start_time},
+      metadata
+    )
+  end
+
+  @doc false
+  @spec launcher_phases(:cmd | :daemon, binary(), integer(), map()) :: :ok
+  def launcher_phases(context, report, received_at, metadata) do
+    times = parse_times(report)
+
+    with {:ok, now} <- Map.fetch(times, "now") do
+      # Line up muontrap's clock with ours at the time that it sent the report
+      to_native = fn us ->
+        received_at - System.convert_time_unit(now - us, :microsecond, :native)
+      end
+
+      launcher_phase(context, :cgroup, times, "cgroup_start", "cgroup_stop", to_native, metadata)
+      launcher_phase(context, :exec, times, "exec_start", "exec_stop", to_native, metadata)
+      launcher_phase(context, :run, times, "exec_stop", "exit", to_native, metadata)
+
+      launcher_phase(
+        context,
+        :teardown,
+        times,
+        "teardown_start",
+        "teardown_stop",
+        to_native,
+        metadata
+      )
+    end
+
+    :ok
+  end
+
+  defp launcher_phase(context, phase, times, start, stop, to_native, metadata) do
+    case times do
+      %{^start => start_us, ^stop => stop_us} when start_us > 0 and stop_us > 0 ->
+        phase(context, phase, to_native.(start_us), to_native.(stop_us), metadata)
+
+      _ ->
+        :ok
+    end
+  end
+
+  # See --timings in src/muontrap.c. Lines are "time_<name>_us <microseconds>".
+  defp parse_times(report) do
+    report
+    |> String.split("\n", trim: true)
+    |> Enum.reduce(%{}, fn
+      "time_" <> line, acc ->
+        with [name, value] <- String.split(line, " "),
+             true <- String.ends_with?(name, "_us"),
+             {number, ""} <- Integer.parse(value) do
+          Map.put(acc, String.replace_suffix(name, "_us", ""), number)
+        else
+          _ -> acc
+        end
+
+      _other, acc ->
+        acc
+    end)
+  end
+end
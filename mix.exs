@@ -16,6 +16,7 @@ defmodule MuonTrap.MixProject do
       docs: docs(),
       start_permanent: Mix.env() == :prod,
       deps: deps(),
+      aliases: [bench: "run bench/cmd_bench.exs"],
       build_embedded: true,
       compilers: [:elixir_make | Mix.compilers()],
       make_targets: ["all"],
@@ -31,12 +32,13 @@ defmodule MuonTrap.MixProject do
   defp elixirc_paths(_), do: ["lib"]
 
   def application do
-    [extra_applications: [:logger]]
+    [extra_applications: [:logger], mod: {MuonTrap.Application, []}]
   end
 
   defp deps() do
     [
       {:elixir_make, "~> 0.6", runtime: false},
+      {:telemetry, "~> 0.4.2"},
       {:ex_doc, "~> 0.19", only: :docs, runtime: false},
       {:excoveralls, "~> 0.8", only: :test, runtime: false},
       {:dialyxir, "~> 1.0.0-rc.4", only: [:dev, :test], runtime: false}
@@ -1,3 +1,4 @@
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -5,19 +6,66 @@
 #include <grp.h>
 #include <poll.h>
 #include <pwd.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/vfs.h>
+
+// Define what's needed for clone3(CLONE_INTO_CGROUP) here so that older
+// kernel headers work. The kernel reports when it's not supported.
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+#ifndef CGROUP_SUPER_MAGIC
+#define CGROUP_SUPER_MAGIC 0x27e0eb
+#endif
+#ifndef CGROUP2_SUPER_MAGIC
+#define CGROUP2_SUPER_MAGIC 0x63677270
+#endif
+#ifndef __NR_clone3
+#define __NR_clone3 435
+#endif
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+struct clone3_args {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t child_tid;
+    uint64_t parent_tid;
+    uint64_t exit_signal;
+    uint64_t stack;
+    uint64_t stack_size;
+    uint64_t tls;
+    uint64_t set_tid;
+    uint64_t set_tid_size;
+    uint64_t cgroup;
+};
+#endif
+
 #ifdef DEBUG
 static FILE *debug_fp = NULL;
-#define INFO(MSG, ...) do { fprintf(debug_fp, "%d:" MSG "\n", microsecs(), ## __VA_ARGS__); fflush(debug_fp); } while (0)
+#define INFO(MSG, ...) do { fprintf(debug_fp, "%lld:" MSG "\n", (long long) microsecs(), ## __VA_ARGS__); fflush(debug_fp); } while (0)
 #else
 #define INFO(MSG, ...) ;
 #endif
@@ -27,11 +75,32 @@ static FILE *debug_fp = NULL;
 
 static struct option long_options[] = {
     {"arg0", required_argument, 0, '0'},
+    {"cd", required_argument, 0, 'C'},
     {"controller", required_argument, 0, 'c'},
+    {"cgroup-root", required_argument, 0, 'r'},
     {"help",     no_argument,       0, 'h'},
     {"delay-to-sigkill", required_argument, 0, 'k'},
+    {"env", required_argument, 0, 'e'},
+    {"framed", no_argument, 0, 'F'},
     {"group", required_argument, 0, 'g'},
+    {"pooled-group", no_argument, 0, 'G'},
     {"set", required_argument, 0, 's'},
+    {"sample-interval", required_argument, 0, 'I'},
+    {"output-chunk-size", required_argument, 0, 'O'},
+    {"early-exit-status", no_argument, 0, 'X'},
+    {"output-discard", no_argument, 0, 'N'},
+    {"output-file", required_argument, 0, 'L'},
+    {"output-file-max-bytes", required_argument, 0, 'M'},
+    {"output-file-count", required_argument, 0, 'K'},
+    {"output-sample", required_argument, 0, 'S'},
+    {"output-credits", required_argument, 0, 'W'},
+    {"stats", no_argument, 0, 'U'},
+    {"timings", no_argument, 0, 'T'},
+    {"stderr-to-stdout", no_argument, 0, 'E'},
+    {"capture-stderr", no_argument, 0, 'D'},
+    {"timeout", required_argument, 0, 't'},
+    {"subreaper", no_argument, 0, 'R'},
+    {"pid-namespace", no_argument, 0, 'P'},
     {"uid", required_argument, 0, 'u'},
     {"gid", required_argument, 0, 'a'},
     {0,          0,                 0, 0 }
@@ -39,114 +108,742 @@ static struct option long_options[] = {
 
 #define CGROUP_MOUNT_PATH "/sys/fs/cgroup"
 
+// Exit status when --timeout kills the program. This is the same as timeout(1).
+#define TIMEOUT_EXIT_STATUS 124
+
+// --stats reports "<name> <value>\n" lines. In the normal mode, they're
+// written to stdout after the program's output and followed by their 4-byte
+// big endian length and this marker so that the Erlang side can find them.
+// --timings adds lines to the same report.
+#define STATS_TRAILER_MAGIC "\0MUONTRAP-STATS\0"
+#define STATS_TRAILER_MAGIC_LEN 16
+#define STATS_SIZE 1024
+
+// Largest --output-chunk-size. Each command with one gets a buffer this big.
+#define MAX_OUTPUT_CHUNK_SIZE (16 * 1024 * 1024)
+
+// Most pidfds that teardown holds for one command. Past this, it checks on a
+// timer so that a big process tree can't use up the fd table.
+#define MAX_EXIT_WAITERS 64
+
+// CLOCK_MONOTONIC timestamps in microseconds for --timings. 0 if the phase
+// didn't happen.
+struct phase_times {
+    int64_t cgroup_start_us;
+    int64_t cgroup_stop_us;
+    int64_t exec_start_us;
+    int64_t exec_stop_us;
+    int64_t exit_us;
+    int64_t teardown_start_us;
+    int64_t teardown_stop_us;
+};
+
 struct controller_var {
     struct controller_var *next;
-    const char *key;
-    const char *value;
+    char *key;
+    char *value;
 };
 
 struct controller_info {
     const char *name;
     char *group_path;
     char *procfile;
+    int mkdir_start; // index of the first directory in group_path that muontrap may create
+    char *enable; // cgroup v2 only: controllers to enable in ancestors (e.g., "+cpu +memory")
+    int emulated; // Not on a cgroup filesystem. See --cgroup-root.
 
     struct controller_var *vars;
     struct controller_info *next;
 };
 
-static struct controller_info *controllers = NULL;
-static const char *cgroup_path = NULL;
-static int brutal_kill_wait_ms = 500;
-static uid_t run_as_uid = 0; // 0 means don't set, since we don't support privilege escalation
-static gid_t run_as_gid = 0; // 0 means don't set, since we don't support privilege escalation
+// Controllers that aren't mounted as cgroup v1 hierarchies are managed
+// together in one group in the cgroup v2 (unified) hierarchy.
+#define CGROUP2_CONTROLLER_NAME "cgroup2"
 
-static int signal_pipe[2] = { -1, -1};
+struct env_var {
+    struct env_var *next;
+    const char *setting; // "<name>=<value>" or "<name>" to unset
+    size_t name_len;
+};
+
+enum event_type {
+    EVENT_SIGNAL,
+    EVENT_STDIN,
+    EVENT_TIMER,
+    EVENT_OUTPUT,
+    EVENT_STDERR,
+    EVENT_EXIT,
+    EVENT_CLEANUP
+};
+
+// What the event loop is waiting on. See wait_for_events().
+struct event_source {
+    enum event_type type;
+    struct command *cmd;
+};
+
+enum command_state {
+    COMMAND_RUNNING = 1,
+    COMMAND_TERMINATING,
+    COMMAND_KILLING,
+    COMMAND_CLEANING // the program exited and what's left is being torn down
+};
+
+// Processes that have been killed, but may not have exited yet
+struct exit_waiter {
+    struct pollfd *fds;
+    int count;
+    int size;
+    int incomplete; // 1 if a process isn't being waited on
+};
+
+// Everything needed to run and clean up after one command. In the normal
+// mode, there's only one of these. In server mode, there's one per request.
+struct command {
+    struct controller_info *controllers;
+    const char *cgroup_root; // NULL to use the mounted hierarchies
+    const char *cgroup_path;
+    int pooled_group; // 1 if the group is created and removed by the caller
+    char *stats_baseline; // pooled group counters when the command started
+    int memory_peak_fd; // cgroup v2 memory.peak that was reset or -1
+    int memory_peak_reset; // 1 if cgroup v1 memory.max_usage_in_bytes was reset
+    int brutal_kill_wait_ms;
+    int timeout_ms; // 0 means no timeout
+    uid_t run_as_uid; // 0 means don't set, since we don't support privilege escalation
+    gid_t run_as_gid; // 0 means don't set, since we don't support privilege escalation
+    const char *cd;
+    struct env_var *env;
+    int stderr_to_stdout;
+    int capture_stderr; // send stderr in its own messages
+    int report_stats;
+    int report_timings;
+    int sample_interval_ms; // 0 means don't sample
+    int output_chunk_size; // 0 means send output as it's read
+    int output_discard; // send the program's output to /dev/null
+    const char *output_file; // NULL if the output isn't saved
+    long long output_file_max_bytes; // 0 means don't rotate
+    int output_file_count; // rotated files to keep
+    int output_sample; // 0 to send all output, otherwise every nth line
+    int flow_control; // only send output while there are credits
+    int framed;
+    int early_exit_status; // report the exit status before teardown
+    int subreaper;
+    int pid_namespace;
+
+    const char *program;
+    char **argv;
+
+    // If one of the groups is on cgroup v2, the child can be started in it
+    // directly. This is that group, an open fd to its directory and one to
+    // its cgroup.procs for when the child joins it instead.
+    struct controller_info *clone_cgroup;
+    int clone_cgroup_fd;
+    int clone_procs_fd;
+
+    // Event loop bookkeeping
+    struct command *next;
+    uint32_t id;
+    pid_t pid;
+    enum command_state state;
+    int output_fd;
+    uint8_t *output_buffer; // output_chunk_size bytes when set
+    int output_file_fd;
+    long long output_file_bytes; // written since the last rotation
+    int output_file_copy; // 1 if splice() doesn't work for the file
+    unsigned long long output_lines; // lines seen for --output-sample
+    uint32_t output_credits; // output messages that can be sent
+    int output_paused; // 1 if not reading output until more credits come
+    int stderr_fd; // -1 unless --capture-stderr
+    int exit_fd; // pidfd for the child on Linux
+    int exit_status;
+    int timed_out;
+    int leftover_pids; // descendants that couldn't be killed
+    int cgroup_errors; // groups that couldn't be removed
+    struct rusage rusage;
+    int64_t deadline_us; // Timeout or next kill step. INT64_MAX if none.
+    int64_t next_sample_us; // INT64_MAX if not sampling
+    struct phase_times times;
+    struct event_source output_source;
+    struct event_source stderr_source;
+    struct event_source exit_source;
+
+    // Teardown after the program exits. See start_cleanup().
+    int64_t cleanup_deadline_us;
+    struct controller_info *killed_group; // cgroup v2 group that got a cgroup.kill
+    int cgroup_events_fd; // cgroup.events of killed_group or -1
+    int group_killed; // 1 if cgroup.kill worked
+    int cgroup_events_watched; // 1 if the event loop hears when it changes
+    struct exit_waiter cleanup_waiter; // descendants that were sent a SIGKILL
+    struct event_source cleanup_source;
+    int cleanup_ready; // 1 if something teardown waits on happened
+    int processes_gone; // 1 once the descendants exited or teardown gave up
+    int exit_reported; // 1 once the early exit status was sent
+    unsigned long long output_read; // bytes read from the output pipe
+    unsigned long long stderr_read; // bytes read from the stderr pipe
+    unsigned long long output_mark; // forward output up to here before moving on
+    unsigned long long stderr_mark;
+    unsigned long long output_dropped; // bytes that came too late to send
+
+    // Server mode request that the options point into
+    char *request;
+    char **request_argv;
+};
+
+static int server_mode = 0;
+static sigset_t child_sigmask; // Signal mask to restore in children
 
-#define FOREACH_CONTROLLER for (struct controller_info *controller = controllers; controller != NULL; controller = controller->next)
+#define FOREACH_CONTROLLER(CMD) for (struct controller_info *controller = (CMD)->controllers; controller != NULL; controller = controller->next)
 
-static void move_pid_to_cgroups(pid_t pid);
+extern char **environ;
 
 static void usage()
 {
     printf("Usage: muontrap [OPTION] -- <program> <args>\n");
+    printf("       muontrap --server\n");
     printf("\n");
     printf("Options:\n");
 
     printf("--arg0,-0 <arg0>\n");
+    printf("--cd <directory> run the program in this directory\n");
     printf("--controller,-c <cgroup controller> (may be specified multiple times)\n");
+    printf("--cgroup-root <path> look for cgroup hierarchies here rather than where they're mounted\n");
+    printf("--env <name>=<value> set an environment variable or pass just <name> to unset it (may be specified multiple times)\n");
     printf("--group,-g <cgroup path>\n");
+    printf("--pooled-group the cgroup already exists and isn't removed on exit\n");
     printf("--set,-s <cgroup variable>=<value>\n (may be specified multiple times)\n");
     printf("--delay-to-sigkill,-k <microseconds>\n");
+    printf("--stats report resource usage after the program exits\n");
+    printf("--timings report when each phase of running the program happened\n");
+    printf("--sample-interval <milliseconds> report cgroup usage periodically (needs --framed)\n");
+    printf("--output-chunk-size <bytes> batch output into messages up to this size (needs --framed)\n");
+    printf("--early-exit-status report the exit status before cleaning up (needs --framed)\n");
+    printf("--output-discard send the program's output to /dev/null\n");
+    printf("--output-file <path> write the program's output to a file rather than sending it (needs --framed)\n");
+    printf("--output-file-max-bytes <bytes> rotate the output file when it gets this big\n");
+    printf("--output-file-count <count> rotated output files to keep (default 1)\n");
+    printf("--output-sample <n> only send every nth line of output (needs --framed)\n");
+    printf("--output-credits <n> send this many output messages until more are granted (needs --framed)\n");
+    printf("--stderr-to-stdout redirect the program's stderr to its stdout\n");
+    printf("--capture-stderr send the program's stderr separately from its stdout (needs --framed)\n");
+    printf("--timeout <milliseconds> kill the program if it runs longer than this\n");
+    printf("--subreaper adopt orphaned descendants and kill them on exit (Linux only)\n");
+    printf("--pid-namespace run the program in a new PID namespace (Linux only)\n");
     printf("--uid <uid/user> drop privilege to this uid or user\n");
     printf("--gid <gid/group> drop privilege to this gid or group\n");
+    printf("--framed use the server protocol on stdin/stdout for this one program\n");
     printf("-- the program to run and its arguments come after this\n");
+    printf("\n");
+    printf("--server runs commands sent as framed requests on stdin. See muontrap.c.\n");
 }
 
-static int microsecs()
+static int64_t microsecs()
 {
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+    return ((int64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
 }
 
-void sigchild_handler(int signum)
+static struct command *new_command()
 {
-    if (signal_pipe[1] >= 0 &&
-            write(signal_pipe[1], &signum, sizeof(signum)) < 0)
-        warn("write(signal_pipe)");
+    struct command *cmd = calloc(1, sizeof(struct command));
+    if (!cmd)
+        err(EXIT_FAILURE, "calloc");
+
+    cmd->brutal_kill_wait_ms = 500;
+    cmd->clone_cgroup_fd = -1;
+    cmd->clone_procs_fd = -1;
+    cmd->output_fd = -1;
+    cmd->stderr_fd = -1;
+    cmd->output_file_fd = -1;
+    cmd->output_file_count = 1;
+    cmd->exit_fd = -1;
+    cmd->cgroup_events_fd = -1;
+    cmd->memory_peak_fd = -1;
+    cmd->deadline_us = INT64_MAX;
+    cmd->next_sample_us = INT64_MAX;
+    return cmd;
 }
 
-void enable_signal_handlers()
+static void free_controller_vars(struct controller_var *var)
 {
-    struct sigaction sa;
-    sa.sa_handler = sigchild_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
+    while (var) {
+        struct controller_var *next_var = var->next;
+        free(var->key);
+        free(var->value);
+        free(var);
+        var = next_var;
+    }
+}
+
+static void free_controllers(struct controller_info *controller)
+{
+    while (controller) {
+        struct controller_info *next_controller = controller->next;
+        free_controller_vars(controller->vars);
+        free(controller->group_path);
+        free(controller->procfile);
+        free(controller->enable);
+        free(controller);
+        controller = next_controller;
+    }
+}
+
+static void free_command(struct command *cmd)
+{
+    free_controllers(cmd->controllers);
+
+    struct env_var *env = cmd->env;
+    while (env) {
+        struct env_var *next_env = env->next;
+        free(env);
+        env = next_env;
+    }
+
+    if (cmd->clone_cgroup_fd >= 0)
+        close(cmd->clone_cgroup_fd);
+    if (cmd->clone_procs_fd >= 0)
+        close(cmd->clone_procs_fd);
+    if (cmd->exit_fd >= 0)
+        close(cmd->exit_fd);
+    if (cmd->output_file_fd >= 0)
+        close(cmd->output_file_fd);
+    if (cmd->stderr_fd >= 0)
+        close(cmd->stderr_fd);
+    if (cmd->cgroup_events_fd >= 0)
+        close(cmd->cgroup_events_fd);
+    if (cmd->memory_peak_fd >= 0)
+        close(cmd->memory_peak_fd);
+    free(cmd->cleanup_waiter.fds);
+    free(cmd->stats_baseline);
+    free(cmd->output_buffer);
+    free(cmd->request_argv);
+    free(cmd->request);
+    free(cmd);
+}
+
+static int env_name_matches(const char *entry, const char *name, size_t name_len)
+{
+    return strncmp(entry, name, name_len) == 0 && entry[name_len] == '=';
+}
+
+static int env_var_overridden(const struct env_var *env, const char *entry)
+{
+    for (; env != NULL; env = env->next) {
+        if (env_name_matches(entry, env->setting, env->name_len))
+            return 1;
+    }
+    return 0;
+}
+
+static char **make_envp(struct command *cmd)
+{
+    if (!cmd->env)
+        return environ;
+
+    size_t count = 1;
+    for (char **e = environ; *e != NULL; e++)
+        count++;
+    for (struct env_var *env = cmd->env; env != NULL; env = env->next)
+        count++;
+
+    char **envp = malloc(count * sizeof(char *));
+    if (!envp)
+        err(EXIT_FAILURE, "malloc");
+
+    char **p = envp;
+    for (char **e = environ; *e != NULL; e++) {
+        if (!env_var_overridden(cmd->env, *e))
+            *p++ = *e;
+    }
+
+    // Settings are in the order they were specified, so only the last
+    // one for each name counts.
+    for (struct env_var *env = cmd->env; env != NULL; env = env->next) {
+        if (env->setting[env->name_len] == '=' &&
+                !env_var_overridden(env->next, env->setting))
+            *p++ = (char *) env->setting;
+    }
+    *p = NULL;
+
+    return envp;
+}
+
+static int wait_status_to_exit_status(int status)
+{
+    int exit_status;
+    if (WIFSIGNALED(status)) {
+        // Crash on signal, return the signal in the exit status. See POSIX:
+        // http://pubs.opengroup.org/onlinepubs/9699919799/utilities/V3_chap02.html#tag_18_08_02
+        exit_status = 128 + WTERMSIG(status);
+        INFO("child terminated via signal %d. our exit status: %d", status, exit_status);
+    } else if (WIFEXITED(status)) {
+        exit_status = WEXITSTATUS(status);
+        INFO("child exited with exit status: %d", exit_status);
+    } else {
+        INFO("child terminated with unexpected status: %d", status);
+        exit_status = EXIT_FAILURE;
+    }
+    return exit_status;
+}
+
+// Emulated groups (see --cgroup-root) need the real pid since their helper
+// can't tell what "0" means
+static void add_emulated_pid(struct command *cmd, pid_t pid)
+{
+    FOREACH_CONTROLLER(cmd) {
+        if (!controller->emulated)
+            continue;
+
+        int fd = open(controller->procfile, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        char line[16];
+        int len = snprintf(line, sizeof(line), "%d\n", pid);
+        if (write(fd, line, len) != len)
+            warn("write(%s)", controller->procfile);
+        close(fd);
+    }
+}
+
+// Everything the child needs between being created and calling exec. On
+// Linux, the child shares muontrap's memory and runs on its own little stack
+// while muontrap waits (see spawn_child), so all work is done ahead of time
+// and the child may only make async-signal-safe calls. PID namespaces are the
+// exception since they need a long-lived init (see pid_namespace_init).
+struct spawn_args {
+    struct command *cmd;
+    int stdin_fd;
+    int stdout_fd;
+    int stderr_fd;
+    char **envp;
+    sigset_t sigmask;
+    int joined_clone_cgroup;
+    int shares_memory;
+    int id_map_pipe[2]; // Closed by the parent once the user namespace's ids are mapped
+
+    // Set by the child if something fails before exec
+    const char *failed_call;
+    const char *failed_path;
+    int failed_errno;
+};
+
+#ifdef __linux__
+#define CHILD_STACK_SIZE (256 * 1024)
+static void *child_stack = NULL;
+static int clone_into_cgroup_unsupported = 0;
+#endif
+
+static void report_spawn_failure(const struct spawn_args *args)
+{
+    errno = args->failed_errno;
+    if (args->failed_path)
+        warn("%s(%s)", args->failed_call, args->failed_path);
+    else
+        warn("%s", args->failed_call);
+}
 
+static void child_failed(struct spawn_args *args, const char *call, const char *path)
+{
+    args->failed_call = call;
+    args->failed_path = path;
+    args->failed_errno = errno;
+
+    // If the parent can't see this, report the failure here.
+    if (!args->shares_memory)
+        report_spawn_failure(args);
+    _exit(EXIT_FAILURE);
+}
+
+static int exec_child(void *arg)
+{
+    struct spawn_args *args = arg;
+    struct command *cmd = args->cmd;
+
+    // Don't run muontrap's signal handlers in the child. The server also
+    // ignores SIGPIPE and ignored signals survive exec.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
     sigaction(SIGCHLD, &sa, NULL);
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGQUIT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    if (server_mode)
+        sigaction(SIGPIPE, &sa, NULL);
+    sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+
+    // Hook up stdio if not inheriting it from muontrap
+    if (args->stdin_fd >= 0 && dup2(args->stdin_fd, STDIN_FILENO) < 0)
+        child_failed(args, "dup2", "stdin");
+    if (args->stdout_fd >= 0 && dup2(args->stdout_fd, STDOUT_FILENO) < 0)
+        child_failed(args, "dup2", "stdout");
+    if (cmd->stderr_to_stdout && dup2(STDOUT_FILENO, STDERR_FILENO) < 0)
+        child_failed(args, "dup2", "stderr");
+    if (args->stderr_fd >= 0 && dup2(args->stderr_fd, STDERR_FILENO) < 0)
+        child_failed(args, "dup2", "stderr");
+
+    // Move to the container. Writing 0 moves the writer, so there's
+    // no need to format our pid.
+    FOREACH_CONTROLLER(cmd) {
+        if (args->joined_clone_cgroup && controller == cmd->clone_cgroup)
+            continue;
+
+        // muontrap writes the real pid. See add_emulated_pid().
+        if (controller->emulated)
+            continue;
+
+        if (controller == cmd->clone_cgroup && cmd->clone_procs_fd >= 0) {
+            if (write(cmd->clone_procs_fd, "0", 1) < 0)
+                child_failed(args, "Can't add pid to cgroup", controller->procfile);
+            continue;
+        }
+
+        int fd = open(controller->procfile, O_WRONLY);
+        if (fd < 0 || write(fd, "0", 1) < 0)
+            child_failed(args, "Can't add pid to cgroup", controller->procfile);
+        close(fd);
+    }
+
+    if (cmd->cd && chdir(cmd->cd) < 0)
+        child_failed(args, "chdir", cmd->cd);
+
+    // Drop/change privilege if requested
+    // See https://wiki.sei.cmu.edu/confluence/display/c/POS36-C.+Observe+correct+revocation+order+while+relinquishing+privileges
+    if (cmd->run_as_gid > 0 && setgid(cmd->run_as_gid) < 0)
+        child_failed(args, "setgid", NULL);
+
+    if (cmd->run_as_uid > 0 && setuid(cmd->run_as_uid) < 0)
+        child_failed(args, "setuid", NULL);
+
+#ifdef __linux__
+    execvpe(cmd->program, cmd->argv, args->envp);
+#else
+    environ = args->envp;
+    execvp(cmd->program, cmd->argv);
+#endif
+
+    // Not supposed to reach here.
+    child_failed(args, "exec", cmd->program);
+    return EXIT_FAILURE;
 }
 
-void disable_signal_handlers()
+#ifdef __linux__
+static void forward_signal_handler(int signum)
 {
-    sigaction(SIGCHLD, NULL, NULL);
-    sigaction(SIGINT, NULL, NULL);
-    sigaction(SIGQUIT, NULL, NULL);
-    sigaction(SIGTERM, NULL, NULL);
+    // Never called, since signals stay blocked for sigwaitinfo(). PID 1
+    // drops signals from outside its namespace that don't have handlers.
 }
 
-static int fork_exec(const char *path, char *const *argv)
+static int pid_namespace_init(void *arg)
 {
-    INFO("Running %s", path);
-    for (char *const *arg = argv; *arg != NULL; arg++) {
-        INFO("  arg: %s", *arg);
+    // This is PID 1 of the new namespace. It runs the command and forwards
+    // signals to it. When it exits, the kernel kills everything left in the
+    // namespace.
+    struct spawn_args *args = arg;
+
+    // Wait for muontrap to map ids in the user namespace if there is one
+    if (args->id_map_pipe[1] >= 0) {
+        char c;
+        close(args->id_map_pipe[1]);
+        while (read(args->id_map_pipe[0], &c, 1) < 0 && errno == EINTR)
+            ;
+        close(args->id_map_pipe[0]);
     }
 
+    static const int forwarded_signals[] = {
+        SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2, SIGCHLD
+    };
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = forward_signal_handler;
+    for (size_t i = 0; i < sizeof(forwarded_signals) / sizeof(forwarded_signals[0]); i++)
+        sigaction(forwarded_signals[i], &sa, NULL);
+
+    // All signals are still blocked from spawn_child()
     pid_t pid = fork();
-    if (pid == 0) {
-        // child
+    if (pid == 0)
+        exec_child(args);
+    else if (pid < 0)
+        child_failed(args, "fork", NULL);
+
+    sigset_t all_signals;
+    sigfillset(&all_signals);
+    for (;;) {
+        int signum = sigwaitinfo(&all_signals, NULL);
+        if (signum == SIGCHLD) {
+            // Reap orphans too, since that's init's job
+            int status;
+            pid_t dying_pid;
+            while ((dying_pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                if (dying_pid == pid)
+                    _exit(wait_status_to_exit_status(status));
+            }
+        } else if (signum > 0) {
+            kill(pid, signum);
+        }
+    }
+}
+
+static int write_file(const char *group_path, const char *value);
 
-        // Move to the container
-        move_pid_to_cgroups(getpid());
+static int write_proc_file(pid_t pid, const char *name, const char *value)
+{
+    char *path;
+    checked_asprintf(&path, "/proc/%d/%s", pid, name);
+    int rc = write_file(path, value);
+    if (rc < 0) {
+        int saved_errno = errno;
+        warn("Error writing %s", path);
+        errno = saved_errno;
+    }
+    free(path);
+    return rc;
+}
 
-        // Drop/change privilege if requested
-        // See https://wiki.sei.cmu.edu/confluence/display/c/POS36-C.+Observe+correct+revocation+order+while+relinquishing+privileges
-        if (run_as_gid > 0 && setgid(run_as_gid) < 0)
-            err(EXIT_FAILURE, "setgid(%d)", run_as_gid);
+static int write_id_maps(pid_t pid)
+{
+    // Map muontrap's ids to themselves so that the command runs as the same
+    // user. Denying setgroups is required before unprivileged gid mapping.
+    char uid_map[64];
+    char gid_map[64];
+    snprintf(uid_map, sizeof(uid_map), "%d %d 1", geteuid(), geteuid());
+    snprintf(gid_map, sizeof(gid_map), "%d %d 1", getegid(), getegid());
+
+    if (write_proc_file(pid, "setgroups", "deny") < 0 ||
+            write_proc_file(pid, "uid_map", uid_map) < 0 ||
+            write_proc_file(pid, "gid_map", gid_map) < 0)
+        return -1;
+    return 0;
+}
+#endif
 
-        if (run_as_uid > 0 && setuid(run_as_uid) < 0)
-            err(EXIT_FAILURE, "setuid(%d)", run_as_uid);
+static pid_t spawn_child(struct command *cmd, int stdin_fd, int stdout_fd, int stderr_fd)
+{
+    INFO("Running %s", cmd->program);
+    for (char *const *arg = cmd->argv; *arg != NULL; arg++) {
+        INFO("  arg: %s", *arg);
+    }
 
-        execvp(path, argv);
+    struct spawn_args args;
+    memset(&args, 0, sizeof(args));
+    args.cmd = cmd;
+    args.stdin_fd = stdin_fd;
+    args.stdout_fd = stdout_fd;
+    args.stderr_fd = stderr_fd;
+    args.envp = make_envp(cmd);
+    args.id_map_pipe[0] = -1;
+    args.id_map_pipe[1] = -1;
+
+    // Block signals so that handlers can't run in the child before it
+    // resets them. The child then sets the mask that muontrap started with.
+    sigset_t all_signals;
+    sigfillset(&all_signals);
+    sigprocmask(SIG_SETMASK, &all_signals, &args.sigmask);
+
+#ifdef __linux__
+    // A new PID namespace needs an init process that stays around, so the
+    // child can't share memory or suspend muontrap until exec like normal.
+    uint64_t namespace_flags = 0;
+    if (cmd->pid_namespace) {
+        namespace_flags = CLONE_NEWPID;
+
+        // Only root can make PID namespaces, but anyone can make a user
+        // namespace and then make a PID namespace in it.
+        if (geteuid() != 0) {
+            namespace_flags |= CLONE_NEWUSER;
+            if (pipe2(args.id_map_pipe, O_CLOEXEC) < 0)
+                err(EXIT_FAILURE, "pipe2");
+        }
+    }
 
-        // Not supposed to reach here.
-        exit(EXIT_FAILURE);
-    } else {
+    pid_t pid = -1;
+    int use_clone = 1;
+    if (namespace_flags && cmd->clone_cgroup_fd >= 0 && !clone_into_cgroup_unsupported) {
+        // Start the namespace's init in its cgroup so that it's never charged
+        // to muontrap's cgroup. clone3 can't be paired with CLONE_VM without
+        // a libc wrapper to set up the child's stack, so it copies page
+        // tables like fork() does. The init can't share memory anyway, so
+        // that's free here. Other children join the group in exec_child()
+        // instead, which costs much less than copying page tables once
+        // muontrap uses more than a few MB (see bench/spawn_latency.c).
+        struct clone3_args clone_args;
+        memset(&clone_args, 0, sizeof(clone_args));
+        clone_args.flags = namespace_flags | CLONE_INTO_CGROUP;
+        clone_args.exit_signal = SIGCHLD;
+        clone_args.cgroup = cmd->clone_cgroup_fd;
+
+        args.joined_clone_cgroup = 1;
+        pid = syscall(__NR_clone3, &clone_args, sizeof(clone_args));
+        if (pid == 0)
+            _exit(pid_namespace_init(&args));
+
+        // Older kernels don't have clone3 or CLONE_INTO_CGROUP. EINVAL can
+        // also come from the group (a threaded one, say), so it only skips
+        // CLONE_INTO_CGROUP for this child.
+        use_clone = pid < 0 && (errno == ENOSYS || errno == E2BIG || errno == EINVAL);
+        if (use_clone) {
+            if (errno != EINVAL)
+                clone_into_cgroup_unsupported = 1;
+            INFO("clone3(CLONE_INTO_CGROUP) failed: %s", strerror(errno));
+        }
+    }
+
+    if (use_clone) {
+        if (!child_stack) {
+            child_stack = mmap(NULL, CHILD_STACK_SIZE, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+            if (child_stack == MAP_FAILED)
+                err(EXIT_FAILURE, "mmap");
+        }
+        args.joined_clone_cgroup = 0;
+        if (namespace_flags) {
+            pid = clone(pid_namespace_init, (char *) child_stack + CHILD_STACK_SIZE,
+                        namespace_flags | SIGCHLD, &args);
+        } else {
+            // Like vfork, CLONE_VM | CLONE_VFORK skips copying page tables, so
+            // the cost doesn't grow with muontrap's memory use. Unlike vfork,
+            // the child gets its own stack so it can't corrupt ours.
+            args.shares_memory = 1;
+            pid = clone(exec_child, (char *) child_stack + CHILD_STACK_SIZE,
+                        CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+        }
+    }
 
-        return pid;
+    if (args.id_map_pipe[0] >= 0) {
+        int saved_errno = errno;
+        close(args.id_map_pipe[0]);
+        if (pid > 0 && write_id_maps(pid) < 0) {
+            // Unmapped, the command would run as the overflow uid and gid.
+            // Kill it before closing the pipe lets it go on.
+            saved_errno = errno;
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            pid = -1;
+        }
+        close(args.id_map_pipe[1]);
+        errno = saved_errno;
     }
+#else
+    pid_t pid = fork();
+    if (pid == 0)
+        exec_child(&args);
+#endif
+    int saved_errno = errno;
+
+    if (pid > 0)
+        add_emulated_pid(cmd, pid);
+
+    sigprocmask(SIG_SETMASK, &args.sigmask, NULL);
+
+    if (args.failed_call)
+        report_spawn_failure(&args);
+
+    if (args.envp != environ)
+        free(args.envp);
+
+    errno = saved_errno;
+    return pid;
 }
 
 static int mkdir_p(const char *abspath, int start_index)
@@ -175,19 +872,19 @@ static int mkdir_p(const char *abspath, int start_index)
     return rc;
 }
 
-static void create_cgroups()
+static int read_file(const char *path, char *buffer, size_t size)
 {
-    FOREACH_CONTROLLER {
-        int start_index = strlen(CGROUP_MOUNT_PATH) + 1 + strlen(controller->name) + 1;
-        INFO("Create cgroup: mkdir -p %s", controller->group_path);
-        if (mkdir_p(controller->group_path, start_index) < 0) {
-            if (errno == EEXIST)
-                errx(EXIT_FAILURE, "'%s' already exists. Please specify a deeper group_path or clean up the cgroup",
-                     controller->group_path);
-            else
-                err(EXIT_FAILURE, "Couldn't create '%s'. Check permissions.", controller->group_path);
-        }
-    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    ssize_t amt = read(fd, buffer, size - 1);
+    close(fd);
+    if (amt < 0)
+        return -1;
+
+    buffer[amt] = '\0';
+    return amt;
 }
 
 static int write_file(const char *group_path, const char *value)
@@ -197,50 +894,225 @@ static int write_file(const char *group_path, const char *value)
        return -1;
 
    int rc = fwrite(value, 1, strlen(value), fp);
-   fclose(fp);
+
+   // cgroup files report bad values when the write is flushed
+   if (fclose(fp) != 0)
+       return -1;
    return rc;
 }
 
-static void update_cgroup_settings()
+static int enable_subtree_controllers(const char *dir, const char *enable)
+{
+    char *subtree_control;
+    checked_asprintf(&subtree_control, "%s/cgroup.subtree_control", dir);
+
+    char enabled[512];
+    enabled[0] = ' ';
+    if (read_file(subtree_control, &enabled[1], sizeof(enabled) - 2) < 0)
+        enabled[1] = '\0';
+    for (char *c = enabled; *c != '\0'; c++) {
+        if (*c == '\n')
+            *c = ' ';
+    }
+    strcat(enabled, " ");
+
+    // Only write what's missing since writing the root's subtree_control
+    // needs more privilege than writing a delegated group's.
+    char missing[512] = "";
+    char *enable_copy = strdup(enable);
+    for (char *name = strtok(enable_copy, " "); name != NULL; name = strtok(NULL, " ")) {
+        char needle[64];
+        snprintf(needle, sizeof(needle), " %s ", name + 1);
+        if (!strstr(enabled, needle)) {
+            strncat(missing, name, sizeof(missing) - strlen(missing) - 2);
+            strcat(missing, " ");
+        }
+    }
+    free(enable_copy);
+
+    int rc = 0;
+    if (missing[0] != '\0') {
+        INFO("echo '%s' > %s", missing, subtree_control);
+        if (write_file(subtree_control, missing) < 0) {
+            warn("Couldn't enable '%s' in '%s'", missing, subtree_control);
+            rc = -1;
+        }
+    }
+    free(subtree_control);
+    return rc;
+}
+
+static int enable_cgroup2_controllers(struct controller_info *controller)
+{
+    // Controllers need to be enabled in every ancestor of the group starting
+    // at the root of the hierarchy.
+    int rc = 0;
+    char *dir = strdup(controller->group_path);
+    for (int i = controller->mkdir_start - 1; rc == 0 && dir[i] != '\0'; i++) {
+        if (dir[i] == '/') {
+            dir[i] = '\0';
+            rc = enable_subtree_controllers(dir, controller->enable);
+            dir[i] = '/';
+        }
+    }
+    free(dir);
+    return rc;
+}
+
+static int is_cgroup2(const struct controller_info *controller)
+{
+    return strcmp(controller->name, CGROUP2_CONTROLLER_NAME) == 0;
+}
+
+// Make the files that the kernel makes in a new group when --cgroup-root
+// isn't a cgroup filesystem. A helper like test/fake_cgroupfs.test keeps
+// them up to date.
+static int emulate_cgroup(struct command *cmd, struct controller_info *controller)
+{
+    controller->emulated = 1;
+
+    int fd = open(controller->procfile, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        warn("Couldn't create '%s'", controller->procfile);
+        return -1;
+    }
+    close(fd);
+
+    if (!is_cgroup2(controller) || cmd->pooled_group)
+        return 0;
+
+    char *path;
+    checked_asprintf(&path, "%s/cgroup.events", controller->group_path);
+    int rc = write_file(path, "populated 0\n");
+    free(path);
+
+    checked_asprintf(&path, "%s/cgroup.kill", controller->group_path);
+    if (rc >= 0)
+        rc = mkfifo(path, 0600);
+    free(path);
+
+    if (rc < 0)
+        warn("Couldn't emulate '%s'", controller->group_path);
+    return rc < 0 ? -1 : 0;
+}
+
+// Only the control files are in emulated groups, since muontrap doesn't make subgroups
+static void remove_emulated_files(struct controller_info *controller)
+{
+    DIR *dir = opendir(controller->group_path);
+    if (!dir)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        char *path;
+        checked_asprintf(&path, "%s/%s", controller->group_path, entry->d_name);
+        if (unlink(path) < 0) {
+            INFO("unlink %s: %s", path, strerror(errno));
+        }
+        free(path);
+    }
+    closedir(dir);
+}
+
+static int create_cgroups(struct command *cmd)
+{
+    FOREACH_CONTROLLER(cmd) {
+        // Pooled groups already exist, so skip the slow part.
+        INFO("Create cgroup: mkdir -p %s", controller->group_path);
+        if (!cmd->pooled_group && mkdir_p(controller->group_path, controller->mkdir_start) < 0) {
+            if (errno == EEXIST)
+                warnx("'%s' already exists. Please specify a deeper group_path or clean up the cgroup",
+                      controller->group_path);
+            else
+                warn("Couldn't create '%s'. Check permissions.", controller->group_path);
+            return -1;
+        }
+
+        if (controller->enable && enable_cgroup2_controllers(controller) < 0)
+            return -1;
+
+#ifdef __linux__
+        struct statfs sfs;
+        if (cmd->cgroup_root &&
+                statfs(controller->group_path, &sfs) == 0 &&
+                sfs.f_type != CGROUP_SUPER_MAGIC &&
+                sfs.f_type != CGROUP2_SUPER_MAGIC &&
+                emulate_cgroup(cmd, controller) < 0)
+            return -1;
+
+        // Only one group can be passed to clone3, so pick the first cgroup v2 one.
+        if (cmd->clone_cgroup == NULL &&
+                statfs(controller->group_path, &sfs) == 0 &&
+                sfs.f_type == CGROUP2_SUPER_MAGIC) {
+            cmd->clone_cgroup_fd = open(controller->group_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (cmd->clone_cgroup_fd >= 0) {
+                cmd->clone_cgroup = controller;
+                cmd->clone_procs_fd = openat(cmd->clone_cgroup_fd, "cgroup.procs",
+                                             O_WRONLY | O_CLOEXEC);
+            }
+        }
+#endif
+    }
+    return 0;
+}
+
+static int update_cgroup_settings(struct command *cmd)
 {
-    FOREACH_CONTROLLER {
+    FOREACH_CONTROLLER(cmd) {
         for (struct controller_var *var = controller->vars;
              var != NULL;
              var = var->next) {
             char *setting_file;
             checked_asprintf(&setting_file, "%s/%s", controller->group_path, var->key);
-            if (write_file(setting_file, var->value) < 0)
-                err(EXIT_FAILURE, "Error writing '%s' to '%s'", var->value, setting_file);
+            if (write_file(setting_file, var->value) < 0) {
+                warn("Error writing '%s' to '%s'", var->value, setting_file);
+                free(setting_file);
+                return -1;
+            }
             free(setting_file);
         }
     }
+    return 0;
 }
 
-static void move_pid_to_cgroups(pid_t pid)
+static void add_exit_waiter(struct exit_waiter *waiter, int pid)
 {
-    FOREACH_CONTROLLER {
-        FILE *fp = fopen(controller->procfile, "w");
-        if (fp == NULL ||
-            fprintf(fp, "%d", pid) < 0)
-            err(EXIT_FAILURE, "Can't add pid to %s", controller->procfile);
-        fclose(fp);
+    if (!waiter)
+        return;
+
+#ifdef __linux__
+    if (waiter->count == MAX_EXIT_WAITERS) {
+        waiter->incomplete = 1;
+        return;
     }
-}
 
-static void destroy_cgroups()
-{
-    FOREACH_CONTROLLER {
-        // Only remove the final directory, since we don't keep track of
-        // what we actually create.
-        INFO("rmdir %s", controller->group_path);
-        if (rmdir(controller->group_path) < 0) {
-            INFO("Error removing %s (%s)", controller->group_path, strerror(errno));
-            warn("Error removing %s", controller->group_path);
-        }
+    int pidfd = syscall(__NR_pidfd_open, pid, 0);
+    if (pidfd < 0) {
+        // ESRCH means that the process is already gone
+        if (errno != ESRCH)
+            waiter->incomplete = 1;
+        return;
     }
+
+    if (waiter->count == waiter->size) {
+        waiter->size = waiter->size ? 2 * waiter->size : 16;
+        waiter->fds = realloc(waiter->fds, waiter->size * sizeof(struct pollfd));
+        if (!waiter->fds)
+            err(EXIT_FAILURE, "realloc");
+    }
+    waiter->fds[waiter->count].fd = pidfd;
+    waiter->fds[waiter->count].events = POLLIN;
+    waiter->count++;
+#else
+    waiter->incomplete = 1;
+#endif
 }
 
-static int procfile_killall(const char *group_path, int sig)
+static int procfile_killall(const char *group_path, int sig, struct exit_waiter *waiter)
 {
     int children_killed = 0;
 
@@ -251,6 +1123,7 @@ static int procfile_killall(const char *group_path, int sig)
     int pid;
     while (fscanf(fp, "%d", &pid) == 1) {
         INFO("  kill -%d %d", sig, pid);
+        add_exit_waiter(waiter, pid);
         kill(pid, sig);
         children_killed++;
     }
@@ -258,188 +1131,664 @@ static int procfile_killall(const char *group_path, int sig)
     return children_killed;
 }
 
-static int kill_children(int sig)
+static int kill_children(struct command *cmd, int sig, struct exit_waiter *waiter)
 {
     int children_killed = 0;
-    FOREACH_CONTROLLER {
+    FOREACH_CONTROLLER(cmd) {
         INFO("killall -%d from %s", sig, controller->procfile);
-        children_killed += procfile_killall(controller->procfile, sig);
+        children_killed += procfile_killall(controller->procfile, sig, waiter);
     }
     return children_killed;
 }
 
-#ifdef DEBUG
-static void read_proc_cmdline(int pid, char *cmdline)
+static int cgroup_kill(const struct controller_info *controller)
 {
-    char *cmdline_filename;
-
-    checked_asprintf(&cmdline_filename, "/proc/%d/cmdline", pid);
-    FILE *fp = fopen(cmdline_filename, "r");
-    if (fp) {
-        size_t len = fread(cmdline, 1, 128, fp);
-        if (len > 0)
-            cmdline[len] = 0;
-        else
-            strcpy(cmdline, "<NULL>");
-        fclose(fp);
-    } else {
-        sprintf(cmdline, "Error reading %s", cmdline_filename);
-    }
-
-    free(cmdline_filename);
+    // cgroup.kill was added in Linux 5.14. Don't use write_file() since
+    // fopen() would try to create it on older kernels.
+    char *kill_file;
+    checked_asprintf(&kill_file, "%s/cgroup.kill", controller->group_path);
+    // An emulated cgroup.kill is a FIFO, so don't wait if no one's reading it
+    int fd = open(kill_file, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    free(kill_file);
+    if (fd < 0)
+        return -1;
+
+    INFO("echo 1 > %s/cgroup.kill", controller->group_path);
+    ssize_t rc = write(fd, "1", 1);
+    close(fd);
+    return rc == 1 ? 0 : -1;
 }
 
-static void procfile_dump_children(const char *group_path)
+static void destroy_cgroups(struct command *cmd)
 {
-    INFO("---Begin child list for %s", group_path);
-    FILE *fp = fopen(group_path, "r");
-    if (!fp) {
-        INFO("Error reading child list!");
-        return;
+    if (cmd->clone_cgroup_fd >= 0) {
+        close(cmd->clone_cgroup_fd);
+        cmd->clone_cgroup_fd = -1;
+    }
+    if (cmd->clone_procs_fd >= 0) {
+        close(cmd->clone_procs_fd);
+        cmd->clone_procs_fd = -1;
     }
 
-    int pid;
-    while (fscanf(fp, "%d", &pid) == 1) {
-        char cmdline[129];
-        read_proc_cmdline(pid, cmdline);
-        INFO("  %d: %s", pid, cmdline);
+    // rmdir fails with EBUSY until the last process has exited. The event
+    // loop only gets here after that or after giving up on the stragglers.
+    FOREACH_CONTROLLER(cmd) {
+        // Pooled groups go back to the pool once they're empty
+        if (cmd->pooled_group)
+            continue;
+
+        if (controller->emulated)
+            remove_emulated_files(controller);
+
+        // Only remove the final directory, since we don't keep track of
+        // what we actually create.
+        INFO("rmdir %s", controller->group_path);
+        if (rmdir(controller->group_path) < 0) {
+            INFO("Error removing %s (%s)", controller->group_path, strerror(errno));
+            warn("Error removing %s", controller->group_path);
+            cmd->cgroup_errors++;
+        }
     }
-    fclose(fp);
-    INFO("---End child list for %s", group_path);
 }
 
-static void dump_all_children_from_cgroups()
+static void append_stat(char *buffer, size_t size, size_t *len, const char *name,
+                        unsigned long long value)
 {
-    FOREACH_CONTROLLER {
-        procfile_dump_children(controller->procfile);
-    }
+    int amt = snprintf(&buffer[*len], size - *len, "%s %llu\n", name, value);
+    if (amt > 0 && (size_t) amt < size - *len)
+        *len += amt;
 }
-#endif
 
-static void finish_controller_init()
+static int read_group_file(struct controller_info *controller, const char *name,
+                           char *buffer, size_t size)
 {
-    FOREACH_CONTROLLER {
-        checked_asprintf(&controller->group_path, "%s/%s/%s", CGROUP_MOUNT_PATH, controller->name, cgroup_path);
-        checked_asprintf(&controller->procfile, "%s/cgroup.procs", controller->group_path);
-    }
+    char *path;
+    checked_asprintf(&path, "%s/%s", controller->group_path, name);
+    int rc = read_file(path, buffer, size);
+    free(path);
+    return rc;
 }
 
-static int wait_for_sigchld(pid_t pid_to_match, int timeout_ms)
+// Look up a "<key> <value>" line like in cpu.stat
+static int find_stat(const char *text, const char *key, unsigned long long *value)
 {
-    struct pollfd fds[1];
-    fds[0].fd = signal_pipe[0];
-    fds[0].events = POLLIN;
+    size_t key_len = strlen(key);
+    for (const char *line = text; *line != '\0'; ) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ' ') {
+            *value = strtoull(&line[key_len + 1], NULL, 10);
+            return 0;
+        }
+        const char *next = strchr(line, '\n');
+        if (!next)
+            break;
+        line = next + 1;
+    }
+    return -1;
+}
 
-    int end_timeout_us = microsecs() + (1000 * timeout_ms);
-    int next_time_to_wait_ms = timeout_ms;
-    do {
-        INFO("poll - %d ms", next_time_to_wait_ms);
-        if (poll(fds, 1, next_time_to_wait_ms) < 0) {
-            if (errno == EINTR)
-                continue;
+// Sum the values after every occurrence of a label. This adds up the
+// per-device lines in io.stat and blkio.throttle.io_service_bytes.
+static unsigned long long sum_stats(const char *text, const char *label)
+{
+    unsigned long long total = 0;
+    size_t label_len = strlen(label);
+    for (const char *p = strstr(text, label); p != NULL; p = strstr(p + label_len, label))
+        total += strtoull(p + label_len, NULL, 10);
+    return total;
+}
 
-            warn("poll");
+// Pooled groups were used by earlier commands. A peak from before the
+// command started is wrong, so it's only reported if it could be reset.
+static int read_memory_peak(struct command *cmd, struct controller_info *controller,
+                            char *buffer, size_t size)
+{
+    if (!is_cgroup2(controller)) {
+        if (cmd->pooled_group && !cmd->memory_peak_reset)
             return -1;
+        return read_group_file(controller, "memory.max_usage_in_bytes", buffer, size);
+    }
+
+    if (!cmd->pooled_group)
+        return read_group_file(controller, "memory.peak", buffer, size);
+    if (cmd->memory_peak_fd < 0)
+        return -1;
+
+    ssize_t amt = pread(cmd->memory_peak_fd, buffer, size - 1, 0);
+    if (amt < 0)
+        return -1;
+    buffer[amt] = '\0';
+    return amt;
+}
+
+static int is_cumulative_stat(const char *name)
+{
+    static const char *cumulative_stats[] = {
+        "cgroup_cpu_us", "cgroup_user_us", "cgroup_system_us",
+        "cgroup_io_read_bytes", "cgroup_io_write_bytes", NULL
+    };
+    for (const char **stat = cumulative_stats; *stat != NULL; stat++) {
+        if (strcmp(name, *stat) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Rewrite the counters from start on to be relative to the baseline
+static void subtract_baseline(const char *baseline, char *buffer, size_t size, size_t *len,
+                              size_t start)
+{
+    char text[STATS_SIZE];
+    size_t text_len = *len - start;
+    if (text_len >= sizeof(text))
+        return;
+    memcpy(text, &buffer[start], text_len);
+    text[text_len] = '\0';
+
+    *len = start;
+    for (char *line = text; *line != '\0'; ) {
+        char *next = strchr(line, '\n');
+        if (!next)
+            break;
+        *next = '\0';
+
+        char *space = strchr(line, ' ');
+        if (space) {
+            *space = '\0';
+            unsigned long long value = strtoull(space + 1, NULL, 10);
+            unsigned long long base;
+            if (is_cumulative_stat(line) && find_stat(baseline, line, &base) == 0)
+                value = value > base ? value - base : 0;
+            append_stat(buffer, size, len, line, value);
         }
+        line = next + 1;
+    }
+}
 
-        if (fds[0].revents) {
-            int signal;
-            ssize_t amt = read(signal_pipe[0], &signal, sizeof(signal));
-            if (amt < 0) {
-                warn("read signal_pipe");
-                return -1;
+// Totals for everything that ran in the cgroups. Files that don't exist
+// for a controller are skipped. Samples report current memory and process
+// counts where the final stats report the peak memory use.
+static void append_cgroup_stats(struct command *cmd, char *buffer, size_t size, size_t *len,
+                                int sampling)
+{
+    char text[4096];
+    unsigned long long value;
+    size_t start = *len;
+    FOREACH_CONTROLLER(cmd) {
+        if (is_cgroup2(controller)) {
+            if (read_group_file(controller, "cpu.stat", text, sizeof(text)) >= 0) {
+                if (find_stat(text, "usage_usec", &value) == 0)
+                    append_stat(buffer, size, len, "cgroup_cpu_us", value);
+                if (find_stat(text, "user_usec", &value) == 0)
+                    append_stat(buffer, size, len, "cgroup_user_us", value);
+                if (find_stat(text, "system_usec", &value) == 0)
+                    append_stat(buffer, size, len, "cgroup_system_us", value);
             }
-
-            INFO("signal_pipe - SIGNAL %d", signal);
-            switch (signal) {
-            case SIGCHLD: {
-                int status;
-                pid_t pid = wait(&status);
-                if (pid_to_match == pid) {
-                    INFO("cleaned up matching pid %d.", pid);
-                    return 0;
-                }
-                INFO("cleaned up pid %d.", pid);
-                break;
+            if (sampling) {
+                if (read_group_file(controller, "memory.current", text, sizeof(text)) >= 0)
+                    append_stat(buffer, size, len, "cgroup_memory_bytes", strtoull(text, NULL, 10));
+                if (read_group_file(controller, "pids.current", text, sizeof(text)) >= 0)
+                    append_stat(buffer, size, len, "cgroup_pids", strtoull(text, NULL, 10));
+            } else if (read_memory_peak(cmd, controller, text, sizeof(text)) >= 0) {
+                append_stat(buffer, size, len, "cgroup_memory_peak_bytes", strtoull(text, NULL, 10));
+            }
+            if (read_group_file(controller, "io.stat", text, sizeof(text)) >= 0) {
+                append_stat(buffer, size, len, "cgroup_io_read_bytes", sum_stats(text, "rbytes="));
+                append_stat(buffer, size, len, "cgroup_io_write_bytes", sum_stats(text, "wbytes="));
+            }
+        } else {
+            if (read_group_file(controller, "cpuacct.usage", text, sizeof(text)) >= 0)
+                append_stat(buffer, size, len, "cgroup_cpu_us", strtoull(text, NULL, 10) / 1000);
+            if (read_group_file(controller, "cpuacct.stat", text, sizeof(text)) >= 0) {
+                // Reported in clock ticks
+                unsigned long long us_per_tick = 1000000ULL / sysconf(_SC_CLK_TCK);
+                if (find_stat(text, "user", &value) == 0)
+                    append_stat(buffer, size, len, "cgroup_user_us", value * us_per_tick);
+                if (find_stat(text, "system", &value) == 0)
+                    append_stat(buffer, size, len, "cgroup_system_us", value * us_per_tick);
+            }
+            if (sampling) {
+                if (read_group_file(controller, "memory.usage_in_bytes", text, sizeof(text)) >= 0)
+                    append_stat(buffer, size, len, "cgroup_memory_bytes", strtoull(text, NULL, 10));
+                if (read_group_file(controller, "pids.current", text, sizeof(text)) >= 0)
+                    append_stat(buffer, size, len, "cgroup_pids", strtoull(text, NULL, 10));
+            } else if (read_memory_peak(cmd, controller, text, sizeof(text)) >= 0) {
+                append_stat(buffer, size, len, "cgroup_memory_peak_bytes", strtoull(text, NULL, 10));
+            }
+            if (read_group_file(controller, "blkio.throttle.io_service_bytes", text, sizeof(text)) >= 0) {
+                append_stat(buffer, size, len, "cgroup_io_read_bytes", sum_stats(text, " Read "));
+                append_stat(buffer, size, len, "cgroup_io_write_bytes", sum_stats(text, " Write "));
             }
+        }
+    }
 
-            case SIGTERM:
-            case SIGQUIT:
-            case SIGINT:
-                return -1;
+    if (cmd->stats_baseline)
+        subtract_baseline(cmd->stats_baseline, buffer, size, len, start);
+}
 
-            default:
-                warn("unexpected signal: %d", signal);
-                return -1;
-            }
+// Pooled groups keep their counters from earlier commands. Save them to
+// report the difference and reset the memory peak where the kernel allows
+// it. On cgroup v2 (Linux 6.12+), that only applies to reads through the fd
+// that was written to.
+static void start_pooled_stats(struct command *cmd)
+{
+    char text[STATS_SIZE];
+    size_t len = 0;
+    text[0] = '\0';
+    append_cgroup_stats(cmd, text, sizeof(text), &len, 1);
+    cmd->stats_baseline = strdup(text);
+    if (!cmd->stats_baseline)
+        err(EXIT_FAILURE, "strdup");
+
+    FOREACH_CONTROLLER(cmd) {
+        char *path;
+        checked_asprintf(&path, "%s/%s", controller->group_path,
+                         is_cgroup2(controller) ? "memory.peak" : "memory.max_usage_in_bytes");
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        free(path);
+        if (fd < 0)
+            continue;
+
+        if (write(fd, "0", 1) != 1) {
+            close(fd);
+        } else if (is_cgroup2(controller)) {
+            cmd->memory_peak_fd = fd;
+        } else {
+            cmd->memory_peak_reset = 1;
+            close(fd);
         }
+    }
+}
 
-        next_time_to_wait_ms = (end_timeout_us - microsecs()) / 1000;
-    } while (next_time_to_wait_ms > 0);
+static size_t format_stats(struct command *cmd, char *buffer, size_t size)
+{
+    // The program's own usage and that of descendants that it waited for
+    size_t len = 0;
+    const struct rusage *ru = &cmd->rusage;
+    append_stat(buffer, size, &len, "utime_us",
+                ru->ru_utime.tv_sec * 1000000ULL + ru->ru_utime.tv_usec);
+    append_stat(buffer, size, &len, "stime_us",
+                ru->ru_stime.tv_sec * 1000000ULL + ru->ru_stime.tv_usec);
+    append_stat(buffer, size, &len, "maxrss_kb", ru->ru_maxrss);
+    append_stat(buffer, size, &len, "minflt", ru->ru_minflt);
+    append_stat(buffer, size, &len, "majflt", ru->ru_majflt);
+    append_stat(buffer, size, &len, "nvcsw", ru->ru_nvcsw);
+    append_stat(buffer, size, &len, "nivcsw", ru->ru_nivcsw);
+    append_stat(buffer, size, &len, "inblock", ru->ru_inblock);
+    append_stat(buffer, size, &len, "oublock", ru->ru_oublock);
+
+    append_cgroup_stats(cmd, buffer, size, &len, 0);
+    return len;
+}
 
-    INFO("timed out waiting for pid %d", pid_to_match);
-    return -1;
+// The time that the report is made is included so that the other side can
+// line up these timestamps with its clock.
+static size_t format_timings(struct command *cmd, char *buffer, size_t size, size_t len)
+{
+    append_stat(buffer, size, &len, "time_cgroup_start_us", cmd->times.cgroup_start_us);
+    append_stat(buffer, size, &len, "time_cgroup_stop_us", cmd->times.cgroup_stop_us);
+    append_stat(buffer, size, &len, "time_exec_start_us", cmd->times.exec_start_us);
+    append_stat(buffer, size, &len, "time_exec_stop_us", cmd->times.exec_stop_us);
+    append_stat(buffer, size, &len, "time_exit_us", cmd->times.exit_us);
+    append_stat(buffer, size, &len, "time_teardown_start_us", cmd->times.teardown_start_us);
+    append_stat(buffer, size, &len, "time_teardown_stop_us", cmd->times.teardown_stop_us);
+    append_stat(buffer, size, &len, "time_now_us", microsecs());
+    return len;
 }
 
-static void cleanup_all_children()
-{
-    // In order to cleanup the cgroup, all processes need to exit.
-    // The immediate child of muontrap will have either exited
-    // at this point, so any other processes are orphaned descendents.
-    // I.e., Their parent is now PID 1 and we won't get a SIGCHLD when
-    // they die. We only know who they are since they're in the cgruop.
-
-    // Send every child a SIGKILL
-    int children_left = kill_children(SIGKILL);
-    if (children_left > 0) {
-        INFO("Found %d pids and sent them a SIGKILL", children_left);
-        // poll to see if the cleanup is done every 1 ms
-        int poll_intervals = brutal_kill_wait_ms / 1;
-        do {
-            usleep(1000);
-
-            // Check for children and send SIGKILLs again. This
-            // handles the race where we a new process was spawned
-            // when we iterated through the pids the previous time.
-            children_left = kill_children(SIGKILL);
-            INFO("%d pids are still around", children_left);
-            poll_intervals--;
-        } while (poll_intervals && children_left);
-
-        if (children_left > 0) {
-            warnx("Failed to kill %d pids!", children_left);
 #ifdef DEBUG
-            dump_all_children_from_cgroups();
+static void read_proc_cmdline(int pid, char *cmdline)
+{
+    char *cmdline_filename;
+
+    checked_asprintf(&cmdline_filename, "/proc/%d/cmdline", pid);
+    FILE *fp = fopen(cmdline_filename, "r");
+    if (fp) {
+        size_t len = fread(cmdline, 1, 128, fp);
+        if (len > 0)
+            cmdline[len] = 0;
+        else
+            strcpy(cmdline, "<NULL>");
+        fclose(fp);
+    } else {
+        sprintf(cmdline, "Error reading %s", cmdline_filename);
+    }
+
+    free(cmdline_filename);
+}
+
+static void procfile_dump_children(const char *group_path)
+{
+    INFO("---Begin child list for %s", group_path);
+    FILE *fp = fopen(group_path, "r");
+    if (!fp) {
+        INFO("Error reading child list!");
+        return;
+    }
+
+    int pid;
+    while (fscanf(fp, "%d", &pid) == 1) {
+        char cmdline[129];
+        read_proc_cmdline(pid, cmdline);
+        INFO("  %d: %s", pid, cmdline);
+    }
+    fclose(fp);
+    INFO("---End child list for %s", group_path);
+}
+
+static void dump_all_children_from_cgroups(struct command *cmd)
+{
+    FOREACH_CONTROLLER(cmd) {
+        procfile_dump_children(controller->procfile);
+    }
+}
 #endif
+
+static char *cgroup2_mount_path = NULL; // NULL if there's no cgroup v2 hierarchy
+static char *cgroup2_controllers = NULL; // " <controller> <controller> ... "
+static char *cgroup_v1_options = NULL; // ",<option>,<option>,...," for all cgroup v1 mounts
+
+// Return the controllers in a cgroup v2 hierarchy as " <controller> ... "
+// or NULL if it's not cgroup v2
+static char *read_cgroup2_controllers(const char *root)
+{
+    char *path;
+    char controllers[512];
+    checked_asprintf(&path, "%s/cgroup.controllers", root);
+    int rc = read_file(path, controllers, sizeof(controllers));
+    free(path);
+    if (rc < 0)
+        return NULL;
+
+    char *result;
+    controllers[strcspn(controllers, "\n")] = '\0';
+    checked_asprintf(&result, " %s ", controllers);
+    return result;
+}
+
+static void scan_cgroup_mounts()
+{
+    static int scanned = 0;
+    if (scanned)
+        return;
+    scanned = 1;
+
+#ifdef __linux__
+    FILE *fp = fopen("/proc/self/mountinfo", "r");
+    if (!fp)
+        return;
+
+    // See proc(5). The fields of interest are the mount point and the
+    // filesystem type and super options after the " - ".
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, fp) > 0) {
+        char *separator = strstr(line, " - ");
+        char *mount_point = NULL;
+        char *fstype = NULL;
+        char *super_options = NULL;
+        if (separator &&
+                sscanf(line, "%*s %*s %*s %*s %ms", &mount_point) == 1 &&
+                sscanf(separator, " - %ms %*s %ms", &fstype, &super_options) == 2) {
+            if (strcmp(fstype, "cgroup2") == 0 && cgroup2_mount_path == NULL) {
+                cgroup2_mount_path = mount_point;
+                mount_point = NULL;
+            } else if (strcmp(fstype, "cgroup") == 0) {
+                char *options;
+                checked_asprintf(&options, "%s,%s", cgroup_v1_options ? cgroup_v1_options : "", super_options);
+                free(cgroup_v1_options);
+                cgroup_v1_options = options;
+            }
         }
+        free(mount_point);
+        free(fstype);
+        free(super_options);
+    }
+    free(line);
+    fclose(fp);
+
+    if (cgroup_v1_options) {
+        char *options;
+        checked_asprintf(&options, "%s,", cgroup_v1_options);
+        free(cgroup_v1_options);
+        cgroup_v1_options = options;
+    }
+
+    if (cgroup2_mount_path) {
+        cgroup2_controllers = read_cgroup2_controllers(cgroup2_mount_path);
+        if (!cgroup2_controllers)
+            cgroup2_controllers = strdup("  ");
+        INFO("cgroup v2 at %s with%s", cgroup2_mount_path, cgroup2_controllers);
     }
+#endif
 }
 
-static void kill_child_nicely(pid_t child)
+static int is_cgroup_v1_controller(const char *name)
 {
-    // Start with SIGTERM
-    int rc = kill(child, SIGTERM);
-    INFO("kill -%d %d -> %d (%s)", SIGTERM, child, rc, rc < 0 ? strerror(errno) : "success");
-    if (rc < 0)
+    if (!cgroup_v1_options)
+        return 0;
+
+    char *needle;
+    checked_asprintf(&needle, ",%s,", name);
+    int found = strstr(cgroup_v1_options, needle) != NULL;
+    free(needle);
+    return found;
+}
+
+static void add_cgroup2_enable(struct controller_info *unified, const char *name,
+                               const char *controllers)
+{
+    // Not all cgroup v1 controllers exist in cgroup v2. For example, CPU
+    // accounting is always available and blkio is now io.
+    if (strcmp(name, "blkio") == 0)
+        name = "io";
+
+    char *needle;
+    checked_asprintf(&needle, " %s ", name);
+    int available = strstr(controllers, needle) != NULL;
+    free(needle);
+    if (!available)
         return;
 
-    // Wait a little for the child to exit
-    if (wait_for_sigchld(child, brutal_kill_wait_ms) < 0) {
-        // Child didn't exit, so SIGKILL it.
-        rc = kill(child, SIGKILL);
-        INFO("kill -%d %d -> %d (%s)", SIGKILL, child, rc, rc < 0 ? strerror(errno) : "success");
-        if (rc < 0)
-            return;
+    char *enable;
+    checked_asprintf(&enable, "%s%s+%s", unified->enable ? unified->enable : "", unified->enable ? " " : "", name);
+    free(unified->enable);
+    unified->enable = enable;
+}
+
+static void add_controller_setting(struct controller_info *controller, const char *key, const char *value);
+
+// Translate cgroup v1 settings to their cgroup v2 equivalents so that
+// options work on either. Settings without translations are passed through
+// so that cgroup v2 names can be used directly. The cpu.cfs_* settings are
+// combined into cpu.max by the caller.
+static void add_cgroup2_setting(struct controller_info *unified, const char *key, const char *value)
+{
+    char *new_value = NULL;
+    if (strcmp(key, "memory.limit_in_bytes") == 0) {
+        key = "memory.max";
+        if (strcmp(value, "-1") == 0)
+            value = "max";
+    } else if (strcmp(key, "memory.soft_limit_in_bytes") == 0) {
+        key = "memory.low";
+        if (strcmp(value, "-1") == 0)
+            value = "max";
+    } else if (strcmp(key, "cpu.shares") == 0) {
+        // Same conversion as runc and systemd
+        long shares = strtol(value, NULL, 0);
+        long weight = 1 + ((shares - 2) * 9999) / 262142;
+        key = "cpu.weight";
+        checked_asprintf(&new_value, "%ld", weight < 1 ? 1 : (weight > 10000 ? 10000 : weight));
+        value = new_value;
+    } else if (strcmp(key, "blkio.weight") == 0) {
+        long weight = 1 + ((strtol(value, NULL, 0) - 10) * 9999) / 990;
+        key = "io.weight";
+        checked_asprintf(&new_value, "%ld", weight < 1 ? 1 : (weight > 10000 ? 10000 : weight));
+        value = new_value;
+    }
+
+    add_controller_setting(unified, key, value);
+    free(new_value);
+}
 
-        if (wait_for_sigchld(child, brutal_kill_wait_ms) < 0)
-            warn("SIGKILL didn't work on %d", child);
+static void finish_cgroup2_settings(struct controller_info *unified)
+{
+    // Pull out the cpu.cfs_* settings. The list is newest first, so the
+    // first one found wins.
+    struct controller_var *cfs_vars = NULL;
+    const char *quota = NULL;
+    const char *period = NULL;
+    for (struct controller_var **p = &unified->vars; *p != NULL; ) {
+        struct controller_var *var = *p;
+        int is_quota = strcmp(var->key, "cpu.cfs_quota_us") == 0;
+        int is_period = strcmp(var->key, "cpu.cfs_period_us") == 0;
+        if (is_quota || is_period) {
+            if (is_quota && !quota)
+                quota = var->value;
+            if (is_period && !period)
+                period = var->value;
+
+            *p = var->next;
+            var->next = cfs_vars;
+            cfs_vars = var;
+        } else {
+            p = &var->next;
+        }
+    }
+
+    if (quota || period) {
+        char *cpu_max;
+        checked_asprintf(&cpu_max, "%s %s",
+                         (!quota || strcmp(quota, "-1") == 0) ? "max" : quota,
+                         period ? period : "100000");
+        add_controller_setting(unified, "cpu.max", cpu_max);
+        free(cpu_max);
+    }
+
+    free_controller_vars(cfs_vars);
+}
+
+static void finish_controller_init(struct command *cmd)
+{
+    // --cgroup-root is either one cgroup v2 hierarchy or a directory of
+    // cgroup v1 hierarchies like /sys/fs/cgroup on older systems. It doesn't
+    // have to be a cgroup filesystem. See test/fake_cgroupfs.c.
+    char *root_controllers = NULL;
+    const char *v1_root = CGROUP_MOUNT_PATH;
+    const char *v2_root;
+    const char *v2_controllers;
+    if (cmd->cgroup_root) {
+        root_controllers = read_cgroup2_controllers(cmd->cgroup_root);
+        v1_root = cmd->cgroup_root;
+        v2_root = root_controllers ? cmd->cgroup_root : NULL;
+        v2_controllers = root_controllers;
+    } else {
+        scan_cgroup_mounts();
+        v2_root = cgroup2_mount_path;
+        v2_controllers = cgroup2_controllers;
+    }
+
+    struct controller_info *unified = NULL;
+    for (struct controller_info **p = &cmd->controllers; *p != NULL; ) {
+        struct controller_info *controller = *p;
+        if (v2_root && (cmd->cgroup_root || !is_cgroup_v1_controller(controller->name))) {
+            // Merge into the one cgroup v2 group
+            if (!unified) {
+                unified = calloc(1, sizeof(struct controller_info));
+                unified->name = CGROUP2_CONTROLLER_NAME;
+            }
+            add_cgroup2_enable(unified, controller->name, v2_controllers);
+            for (struct controller_var *var = controller->vars; var != NULL; var = var->next)
+                add_cgroup2_setting(unified, var->key, var->value);
+
+            *p = controller->next;
+            controller->next = NULL;
+            free_controllers(controller);
+            continue;
+        }
+
+        checked_asprintf(&controller->group_path, "%s/%s/%s", v1_root, controller->name, cmd->cgroup_path);
+        checked_asprintf(&controller->procfile, "%s/cgroup.procs", controller->group_path);
+        controller->mkdir_start = strlen(v1_root) + 1 + strlen(controller->name) + 1;
+        p = &controller->next;
+    }
+
+    if (unified) {
+        finish_cgroup2_settings(unified);
+        checked_asprintf(&unified->group_path, "%s/%s", v2_root, cmd->cgroup_path);
+        checked_asprintf(&unified->procfile, "%s/cgroup.procs", unified->group_path);
+        unified->mkdir_start = strlen(v2_root) + 1;
+        unified->next = cmd->controllers;
+        cmd->controllers = unified;
+    }
+    free(root_controllers);
+}
+
+#ifdef __linux__
+static void add_pid(pid_t **pids, size_t *count, size_t *size, pid_t pid)
+{
+    if (*count == *size) {
+        *size = *size ? 2 * *size : 16;
+        *pids = realloc(*pids, *size * sizeof(pid_t));
+        if (!*pids)
+            err(EXIT_FAILURE, "realloc");
+    }
+    (*pids)[(*count)++] = pid;
+}
+
+static void add_proc_children(pid_t **pids, size_t *count, size_t *size, pid_t pid)
+{
+    // Children are listed per thread
+    char *task_path;
+    checked_asprintf(&task_path, "/proc/%d/task", pid);
+    DIR *dir = opendir(task_path);
+    free(task_path);
+    if (!dir)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        char *children_path;
+        checked_asprintf(&children_path, "/proc/%d/task/%s/children", pid, entry->d_name);
+        FILE *fp = fopen(children_path, "r");
+        free(children_path);
+        if (!fp)
+            continue;
+
+        int child;
+        while (fscanf(fp, "%d", &child) == 1)
+            add_pid(pids, count, size, child);
+        fclose(fp);
+    }
+    closedir(dir);
+}
+
+static int kill_descendants(int sig, struct exit_waiter *waiter)
+{
+    // Walk the process tree breadth first starting at muontrap
+    pid_t *pids = NULL;
+    size_t count = 0;
+    size_t size = 0;
+    add_proc_children(&pids, &count, &size, getpid());
+    for (size_t i = 0; i < count; i++)
+        add_proc_children(&pids, &count, &size, pids[i]);
+
+    for (size_t i = 0; i < count; i++) {
+        INFO("  kill -%d %d", sig, pids[i]);
+        add_exit_waiter(waiter, pids[i]);
+        kill(pids[i], sig);
     }
+    free(pids);
+    return count;
 }
+#endif
 
-static struct controller_info *add_controller(const char *name)
+static struct controller_info *add_controller(struct command *cmd, const char *name)
 {
     // If the controller exists, don't add it twice.
-    for (struct controller_info *c = controllers; c != NULL; c = c->next) {
+    for (struct controller_info *c = cmd->controllers; c != NULL; c = c->next) {
         if (strcmp(name, c->name) == 0)
             return c;
     }
@@ -447,9 +1796,13 @@ static struct controller_info *add_controller(const char *name)
     struct controller_info *new_controller = malloc(sizeof(struct controller_info));
     new_controller->name = name;
     new_controller->group_path = NULL;
+    new_controller->procfile = NULL;
+    new_controller->mkdir_start = 0;
+    new_controller->enable = NULL;
+    new_controller->emulated = 0;
     new_controller->vars = NULL;
-    new_controller->next = controllers;
-    controllers = new_controller;
+    new_controller->next = cmd->controllers;
+    cmd->controllers = new_controller;
 
     return new_controller;
 }
@@ -457,222 +1810,1943 @@ static struct controller_info *add_controller(const char *name)
 static void add_controller_setting(struct controller_info *controller, const char *key, const char *value)
 {
     struct controller_var *new_var = malloc(sizeof(struct controller_var));
-    new_var->key = key;
-    new_var->value = value;
+    new_var->key = strdup(key);
+    new_var->value = strdup(value);
     new_var->next = controller->vars;
     controller->vars = new_var;
 }
 
-static int child_wait_loop(pid_t child_pid, int *still_running)
+static void add_env_var(struct command *cmd, const char *setting)
 {
-    struct pollfd fds[2];
-    fds[0].fd = STDIN_FILENO;
-    fds[0].events = POLLHUP; // POLLERR is implicit
-    fds[1].fd = signal_pipe[0];
-    fds[1].events = POLLIN;
-
-    for (;;) {
-        if (poll(fds, 2, -1) < 0) {
-            if (errno == EINTR)
-                continue;
-
-            warn("poll");
-            return EXIT_FAILURE;
-        }
-
-        if (fds[0].revents) {
-            INFO("stdin closed. cleaning up...");
-            return EXIT_FAILURE;
-        }
-        if (fds[1].revents) {
-            int signal;
-            ssize_t amt = read(signal_pipe[0], &signal, sizeof(signal));
-            if (amt < 0) {
-                warn("read signal_pipe");
-                return EXIT_FAILURE;
-            }
-
-            switch (signal) {
-            case SIGCHLD: {
-                int status;
-                pid_t dying_pid = wait(&status);
-                if (dying_pid == child_pid) {
-                    // Let the caller know that the child isn't running and has been cleaned up
-                    *still_running = 0;
-
-                    int exit_status;
-                    if (WIFSIGNALED(status)) {
-                        // Crash on signal, return the signal in the exit status. See POSIX:
-                        // http://pubs.opengroup.org/onlinepubs/9699919799/utilities/V3_chap02.html#tag_18_08_02
-                        exit_status = 128 + WTERMSIG(status);
-                        INFO("child terminated via signal %d. our exit status: %d", status, exit_status);
-                    } else if (WIFEXITED(status)) {
-                        exit_status = WEXITSTATUS(status);
-                        INFO("child exited with exit status: %d", exit_status);
-                    } else {
-                        INFO("child terminated with unexpected status: %d", status);
-                        exit_status = EXIT_FAILURE;
-                    }
-                    return exit_status;
-                } else {
-                    INFO("something else caused sigchild: pid=%d, status=%d. our child=%d", dying_pid, status, child_pid);
-                }
-                break;
-            }
-
-            case SIGTERM:
-            case SIGQUIT:
-            case SIGINT:
-                return EXIT_FAILURE;
-
-            default:
-                warn("unexpected signal: %d", signal);
-                return EXIT_FAILURE;
-            }
-        }
-    }
+    struct env_var *new_env = malloc(sizeof(struct env_var));
+    new_env->setting = setting;
+    new_env->name_len = strcspn(setting, "=");
+
+    // Keep the order that they were specified so that later settings win
+    struct env_var **last = &cmd->env;
+    while (*last)
+        last = &(*last)->next;
+    new_env->next = NULL;
+    *last = new_env;
 }
 
-int main(int argc, char *argv[])
+static int parse_options(struct command *cmd, int argc, char *argv[])
 {
-#ifdef DEBUG
-    char filename[64];
-    sprintf(filename, "muontrap-%d.log", getpid());
-    debug_fp = fopen(filename, "w");
-    if (!debug_fp)
-        debug_fp = stderr;
-#endif
-    INFO("muontrap argc=%d", argc);
-    if (argc == 1) {
-        usage();
-        exit(EXIT_FAILURE);
-    }
-
     int opt;
     char *argv0 = NULL;
     struct controller_info *current_controller = NULL;
+
+    // Reset getopt since server mode parses one set of options per request
+    optind = 0;
     while ((opt = getopt_long(argc, argv, "a:c:g:hk:s:0:", long_options, NULL)) != -1) {
         switch (opt) {
         case 'a': // --gid
         {
             char *endptr;
-            run_as_gid = strtoul(optarg, &endptr, 0);
+            cmd->run_as_gid = strtoul(optarg, &endptr, 0);
             if (*endptr != '\0') {
                 struct group *group = getgrnam(optarg);
-                if (!group)
-                    errx(EXIT_FAILURE, "Unknown group '%s'", optarg);
-                run_as_gid = group->gr_gid;
+                if (!group) {
+                    warnx("Unknown group '%s'", optarg);
+                    return -1;
+                }
+                cmd->run_as_gid = group->gr_gid;
+            }
+            if (cmd->run_as_gid == 0) {
+                warnx("Setting the group to root or gid 0 is not allowed");
+                return -1;
             }
-            if (run_as_gid == 0)
-                errx(EXIT_FAILURE, "Setting the group to root or gid 0 is not allowed");
             break;
         }
 
         case 'c':
-            current_controller = add_controller(optarg);
+            current_controller = add_controller(cmd, optarg);
             break;
 
-        case 'g':
-            if (cgroup_path)
-                errx(EXIT_FAILURE, "Only one cgroup group_path supported.");
-            cgroup_path = optarg;
+        case 'r': // --cgroup-root
+            cmd->cgroup_root = optarg;
             break;
 
-        case 'h':
-            usage();
-            exit(EXIT_SUCCESS);
+        case 'C': // --cd
+            cmd->cd = optarg;
+            break;
 
-        case 'k': // --delay-to-sigkill
-            // Specified in microseconds for legacy reasons
-            brutal_kill_wait_ms = strtoul(optarg, NULL, 0) / 1000;
-            if (brutal_kill_wait_ms > 1000)
-                errx(EXIT_FAILURE, "Delay to sending a SIGKILL must be < 1,000,000 (1 second)");
+        case 'e': // --env
+            add_env_var(cmd, optarg);
             break;
 
-        case 's':
-        {
-            if (!current_controller)
-                errx(EXIT_FAILURE, "Specify a cgroup controller (-c) before setting a variable");
+        case 'U': // --stats
+            cmd->report_stats = 1;
+            break;
 
-            char *equalsign = strchr(optarg, '=');
-            if (!equalsign)
-                errx(EXIT_FAILURE, "No '=' found when setting a variable: '%s'", optarg);
+        case 'T': // --timings
+            cmd->report_timings = 1;
+            break;
 
-            // NULL terminate the key. We can do this since we're already modifying
-            // the arguments by using getopt.
-            *equalsign = '\0';
-            add_controller_setting(current_controller, optarg, equalsign + 1);
+        case 'I': // --sample-interval
+            cmd->sample_interval_ms = strtoul(optarg, NULL, 0);
             break;
-        }
 
-        case 'u': // --uid
-        {
-            char *endptr;
-            run_as_uid = strtoul(optarg, &endptr, 0);
-            if (*endptr != '\0') {
-                struct passwd *passwd = getpwnam(optarg);
-                if (!passwd)
-                    errx(EXIT_FAILURE, "Unknown user '%s'", optarg);
-                run_as_uid = passwd->pw_uid;
+        case 'O': // --output-chunk-size
+            cmd->output_chunk_size = strtoul(optarg, NULL, 0);
+            if (cmd->output_chunk_size <= 0 || cmd->output_chunk_size > MAX_OUTPUT_CHUNK_SIZE) {
+                warnx("Output chunk size must be between 1 and %d bytes", MAX_OUTPUT_CHUNK_SIZE);
+                return -1;
             }
-            if (run_as_uid == 0)
-                errx(EXIT_FAILURE, "Setting the user to root or uid 0 is not allowed");
             break;
-        }
 
-        case '0': // --argv0
-            argv0 = optarg;
+        case 'X': // --early-exit-status
+            cmd->early_exit_status = 1;
             break;
 
-        default:
-            usage();
-            exit(EXIT_FAILURE);
-        }
-    }
+        case 'N': // --output-discard
+            cmd->output_discard = 1;
+            break;
 
-    if (argc == optind)
-        errx(EXIT_FAILURE, "Specify a program to run");
+        case 'L': // --output-file
+            cmd->output_file = optarg;
+            break;
 
-    if (cgroup_path == NULL && controllers)
-        errx(EXIT_FAILURE, "Specify a cgroup group_path (-g)");
+        case 'M': // --output-file-max-bytes
+            cmd->output_file_max_bytes = strtoll(optarg, NULL, 0);
+            if (cmd->output_file_max_bytes <= 0) {
+                warnx("Output file max bytes must be positive");
+                return -1;
+            }
+            break;
 
-    if (cgroup_path && !controllers)
-        errx(EXIT_FAILURE, "Specify a cgroup controller (-c) if you specify a group_path");
+        case 'K': // --output-file-count
+            cmd->output_file_count = strtoul(optarg, NULL, 0);
+            break;
 
-    finish_controller_init();
+        case 'W': // --output-credits
+            cmd->flow_control = 1;
+            cmd->output_credits = strtoul(optarg, NULL, 0);
+            break;
 
-    // Finished processing commandline. Initialize and run child.
+        case 'S': // --output-sample
+            cmd->output_sample = strtoul(optarg, NULL, 0);
+            if (cmd->output_sample <= 0) {
+                warnx("Output sample must be positive");
+                return -1;
+            }
+            break;
 
-    if (pipe(signal_pipe) < 0)
-        err(EXIT_FAILURE, "pipe");
-    if (fcntl(signal_pipe[0], F_SETFD, FD_CLOEXEC) < 0 ||
-        fcntl(signal_pipe[1], F_SETFD, FD_CLOEXEC) < 0)
-        warn("fcntl(FD_CLOEXEC)");
+        case 'F': // --framed
+            if (server_mode) {
+                warnx("--framed isn't supported in server requests");
+                return -1;
+            }
+            cmd->framed = 1;
+            break;
 
-    enable_signal_handlers();
+        case 'E': // --stderr-to-stdout
+            cmd->stderr_to_stdout = 1;
+            break;
 
-    create_cgroups();
+        case 'D': // --capture-stderr
+            cmd->capture_stderr = 1;
+            break;
 
-    update_cgroup_settings();
+        case 'R': // --subreaper
+            cmd->subreaper = 1;
+            break;
 
-    const char *program_name = argv[optind];
-    if (argv0)
-        argv[optind] = argv0;
-    pid_t pid = fork_exec(program_name, &argv[optind]);
+        case 'P': // --pid-namespace
+#ifdef __linux__
+            cmd->pid_namespace = 1;
+#else
+            warnx("--pid-namespace is only supported on Linux");
+            return -1;
+#endif
+            break;
 
-    int still_running = 1;
-    int exit_status = child_wait_loop(pid, &still_running);
+        case 'G': // --pooled-group
+            cmd->pooled_group = 1;
+            break;
 
-    if (still_running) {
-        // Kill our immediate child if it's still running
-        kill_child_nicely(pid);
+        case 'g':
+            if (cmd->cgroup_path) {
+                warnx("Only one cgroup group_path supported.");
+                return -1;
+            }
+            cmd->cgroup_path = optarg;
+            break;
+
+        case 'h':
+            if (server_mode) {
+                warnx("--help isn't supported in server requests");
+                return -1;
+            }
+            usage();
+            exit(EXIT_SUCCESS);
+
+        case 'k': // --delay-to-sigkill
+            // Specified in microseconds for legacy reasons
+            cmd->brutal_kill_wait_ms = strtoul(optarg, NULL, 0) / 1000;
+            if (cmd->brutal_kill_wait_ms > 1000) {
+                warnx("Delay to sending a SIGKILL must be < 1,000,000 (1 second)");
+                return -1;
+            }
+            break;
+
+        case 't': // --timeout
+            cmd->timeout_ms = strtoul(optarg, NULL, 0);
+            break;
+
+        case 's':
+        {
+            if (!current_controller) {
+                warnx("Specify a cgroup controller (-c) before setting a variable");
+                return -1;
+            }
+
+            char *equalsign = strchr(optarg, '=');
+            if (!equalsign) {
+                warnx("No '=' found when setting a variable: '%s'", optarg);
+                return -1;
+            }
+
+            // NULL terminate the key. We can do this since we're already modifying
+            // the arguments by using getopt.
+            *equalsign = '\0';
+            add_controller_setting(current_controller, optarg, equalsign + 1);
+            break;
+        }
+
+        case 'u': // --uid
+        {
+            char *endptr;
+            cmd->run_as_uid = strtoul(optarg, &endptr, 0);
+            if (*endptr != '\0') {
+                struct passwd *passwd = getpwnam(optarg);
+                if (!passwd) {
+                    warnx("Unknown user '%s'", optarg);
+                    return -1;
+                }
+                cmd->run_as_uid = passwd->pw_uid;
+            }
+            if (cmd->run_as_uid == 0) {
+                warnx("Setting the user to root or uid 0 is not allowed");
+                return -1;
+            }
+            break;
+        }
+
+        case '0': // --argv0
+            argv0 = optarg;
+            break;
+
+        default:
+            // stdout is the request channel in server mode
+            if (!server_mode)
+                usage();
+            return -1;
+        }
+    }
+
+    if (argc == optind) {
+        warnx("Specify a program to run");
+        return -1;
+    }
+
+    if (cmd->cgroup_path == NULL && cmd->controllers) {
+        warnx("Specify a cgroup group_path (-g)");
+        return -1;
+    }
+
+    if (cmd->cgroup_path && !cmd->controllers) {
+        warnx("Specify a cgroup controller (-c) if you specify a group_path");
+        return -1;
+    }
+
+    // Orphans from every command would be adopted by the one server
+    // process, so there'd be no way to tell whose they were.
+    if (cmd->subreaper && server_mode) {
+        warnx("--subreaper isn't supported in server mode");
+        return -1;
+    }
+
+    // Samples need somewhere to go besides the program's output
+    if (cmd->sample_interval_ms > 0 && !server_mode && !cmd->framed) {
+        warnx("--sample-interval needs --framed or --server");
+        return -1;
+    }
+
+    // In the normal mode, the program writes straight to the port
+    if (cmd->output_chunk_size > 0 && !server_mode && !cmd->framed) {
+        warnx("--output-chunk-size needs --framed or --server");
+        return -1;
+    }
+
+    // The exit status only goes out at the end in the normal mode
+    if (cmd->early_exit_status && !server_mode && !cmd->framed) {
+        warnx("--early-exit-status needs --framed or --server");
+        return -1;
+    }
+
+    // Output only goes through muontrap when it's framed
+    if ((cmd->output_file || cmd->output_sample > 0 || cmd->flow_control) &&
+        !server_mode && !cmd->framed) {
+        warnx("--output-file, --output-sample and --output-credits need --framed or --server");
+        return -1;
+    }
+
+    if (cmd->capture_stderr && !server_mode && !cmd->framed) {
+        warnx("--capture-stderr needs --framed or --server");
+        return -1;
+    }
+
+    if (cmd->capture_stderr && cmd->stderr_to_stdout) {
+        warnx("--capture-stderr can't be used with --stderr-to-stdout");
+        return -1;
+    }
+
+    if (cmd->output_discard && (cmd->output_file || cmd->output_sample > 0)) {
+        warnx("--output-discard can't be used with --output-file or --output-sample");
+        return -1;
+    }
+
+    cmd->program = argv[optind];
+    cmd->argv = &argv[optind];
+    if (argv0)
+        cmd->argv[0] = argv0;
+
+    finish_controller_init(cmd);
+    return 0;
+}
+
+// Server mode
+//
+// In server mode, one muontrap process runs many commands so that callers
+// don't pay for starting a new muontrap for each one. Requests come in on
+// stdin and replies and command output go out on stdout. Every message is
+// framed with a 4-byte big endian length just like Erlang's {packet, 4}
+// option. The payload starts with a one byte message type and a 4-byte big
+// endian command id that's picked by the Erlang side.
+//
+// Requests:
+//   'S' <id> <arg>\0<arg>\0...  Spawn. The args are the same as the normal
+//                               commandline except for --server.
+//   'K' <id>                    Kill the command (SIGTERM, then SIGKILL)
+//   'Q' <id>                    Query the command's status
+//   'C' <id> <credits>          Allow this many more 'd' and 'r' messages for
+//                               --output-credits. When they run out, the
+//                               output isn't read, so the program blocks
+//                               once the pipe is full.
+//
+// Replies:
+//   's' <id> <os pid>           Command started
+//   'd' <id> <output>           Output from the command. With
+//                               --output-chunk-size, everything that's
+//                               ready is sent at once up to that size.
+//                               With --output-sample, only every nth
+//                               line is sent. With --output-file, output
+//                               is only sent if it's sampled.
+//   'r' <id> <output>           Output from the command's stderr. Only sent
+//                               with --capture-stderr.
+//   'x' <id> <exit status> <teardown us> [<stats>]
+//                               Command exited and has been cleaned up.
+//                               Teardown is the time in microseconds to
+//                               kill descendants and remove the cgroups.
+//                               Output that's in the pipes once they're
+//                               gone is sent first, still within the
+//                               credits. Anything after that is dropped
+//                               with a warning.
+//                               Stats are only sent for --stats or --timings
+//                               and are the same text as the normal mode's
+//                               trailer.
+//                               Failures to start also report this.
+//                               With --early-exit-status, it's sent after
+//                               'e' and the text also has
+//                               "cleanup_leftover_pids <n>",
+//                               "cleanup_cgroup_errors <n>" and
+//                               "cleanup_discarded_bytes <n>" lines.
+//   'e' <id> <exit status>      Command exited, but hasn't been cleaned up
+//                               yet. Only sent with --early-exit-status.
+//                               It's the last of the output. What
+//                               descendants write after it is counted in
+//                               cleanup_discarded_bytes.
+//   'q' <id> <state> <os pid>   Status. State is 0 for not found, 1 for
+//                               running, and 2 for being killed.
+//   'm' <id> <sample>           Periodic cgroup usage for --sample-interval.
+//                               It's "<name> <value>\n" lines like --stats.
+//
+// With --framed, muontrap runs the one program on its commandline using this
+// protocol. The program's id is 0 and muontrap exits after reporting that
+// it exited. Spawn requests aren't supported.
+
+#define MSG_SPAWN        'S'
+#define MSG_KILL         'K'
+#define MSG_STATUS       'Q'
+#define MSG_CREDITS      'C'
+#define MSG_STARTED      's'
+#define MSG_DATA         'd'
+#define MSG_EXIT         'x'
+#define MSG_STATUS_REPLY 'q'
+#define MSG_SAMPLE       'm'
+#define MSG_EXITED       'e'
+#define MSG_STDERR       'r'
+
+#define MSG_HEADER_LEN   9 // length + type + id
+#define SERVER_READ_SIZE 65536
+#define SPLICE_SIZE      (1024 * 1024)
+
+static struct command *commands = NULL;
+static int shutting_down = 0;
+static int children_exited = 0;
+static int command_exit_status = EXIT_FAILURE; // Normal mode only
+static int single_command = 0; // Exit after the first command (--framed)
+static int dev_null_fd = -1;
+
+static uint8_t *request_buffer = NULL;
+static size_t request_buffer_len = 0;
+static size_t request_buffer_size = 0;
+
+static void open_dev_null()
+{
+    // Programs read from it in server mode and can write to it with
+    // --output-discard
+    dev_null_fd = open("/dev/null", O_RDWR);
+    if (dev_null_fd < 0)
+        err(EXIT_FAILURE, "open(/dev/null)");
+    if (fcntl(dev_null_fd, F_SETFD, FD_CLOEXEC) < 0)
+        warn("fcntl(FD_CLOEXEC)");
+}
+
+static void put_be32(uint8_t *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static int write_all(int fd, const uint8_t *buffer, size_t len)
+{
+    while (len > 0) {
+        ssize_t amt = write(fd, buffer, len);
+        if (amt < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += amt;
+        len -= amt;
+    }
+    return 0;
+}
+
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t amt = writev(fd, iov, iovcnt);
+        if (amt < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t) amt >= iov->iov_len) {
+            amt -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + amt;
+            iov->iov_len -= amt;
+        }
+    }
+    return 0;
+}
+
+static void send_message(uint8_t type, uint32_t id, const void *data, size_t len)
+{
+    uint8_t header[MSG_HEADER_LEN];
+    put_be32(header, len + 5);
+    header[4] = type;
+    put_be32(&header[5], id);
+
+    // Output can be large, so send it from where it was read
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = sizeof(header) },
+        { .iov_base = (void *) data, .iov_len = len }
+    };
+    if (writev_all(STDOUT_FILENO, iov, 2) < 0) {
+        // The Erlang side is gone, so clean up like stdin was closed.
+        INFO("write(stdout) failed: %s", strerror(errno));
+        shutting_down = 1;
+    }
+}
+
+static void send_u32_message(uint8_t type, uint32_t id, uint32_t value)
+{
+    uint8_t payload[4];
+    put_be32(payload, value);
+    send_message(type, id, payload, sizeof(payload));
+}
+
+static void send_exit_message(uint32_t id, uint32_t exit_status, int64_t teardown_us,
+                              const char *stats, size_t stats_len)
+{
+    uint8_t payload[8 + STATS_SIZE];
+    put_be32(payload, exit_status);
+    put_be32(&payload[4], teardown_us > UINT32_MAX ? UINT32_MAX : (uint32_t) teardown_us);
+    if (stats_len > 0)
+        memcpy(&payload[8], stats, stats_len);
+    send_message(MSG_EXIT, id, payload, 8 + stats_len);
+}
+
+static void send_stats_trailer(const char *stats, size_t stats_len)
+{
+    uint8_t trailer[STATS_SIZE + 4 + STATS_TRAILER_MAGIC_LEN];
+    memcpy(trailer, stats, stats_len);
+    put_be32(&trailer[stats_len], stats_len);
+    memcpy(&trailer[stats_len + 4], STATS_TRAILER_MAGIC, STATS_TRAILER_MAGIC_LEN);
+    if (write_all(STDOUT_FILENO, trailer, stats_len + 4 + STATS_TRAILER_MAGIC_LEN) < 0) {
+        INFO("write(stdout) failed for stats: %s", strerror(errno));
+    }
+}
+
+static struct command *find_command_by_id(uint32_t id)
+{
+    for (struct command *cmd = commands; cmd != NULL; cmd = cmd->next) {
+        if (cmd->id == id)
+            return cmd;
+    }
+    return NULL;
+}
+
+static struct command *find_command_by_pid(pid_t pid)
+{
+    // pids of commands that are being torn down may have been reused
+    for (struct command *cmd = commands; cmd != NULL; cmd = cmd->next) {
+        if (cmd->pid == pid && cmd->state != COMMAND_CLEANING)
+            return cmd;
+    }
+    return NULL;
+}
+
+// Event loop
+//
+// Both modes run their commands from one event loop. It waits on signals,
+// stdin, command output, child exits, teardown and kill deadlines. On Linux,
+// it's an epoll loop over a signalfd, stdin, the output pipes, a pidfd for
+// each child, the pidfds and cgroup.events files that teardown waits on and a
+// timerfd for the next deadline. Elsewhere, it's a poll loop and signal
+// handlers write to a self-pipe.
+
+#ifdef __linux__
+static int epoll_fd = -1;
+static int signal_fd = -1;
+static int timer_fd = -1;
+static int64_t timer_deadline_us = INT64_MAX;
+static struct event_source signal_source = { EVENT_SIGNAL, NULL };
+static struct event_source stdin_source = { EVENT_STDIN, NULL };
+static struct event_source timer_source = { EVENT_TIMER, NULL };
+
+static int watch_fd(int fd, uint32_t events, struct event_source *source)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = source;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void init_event_loop()
+{
+    // Handle signals synchronously so that there's nothing to overflow
+    // when there are lots of them.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, &child_sigmask);
+
+    // Ignored SIGCHLDs cause children to be reaped automatically
+    signal(SIGCHLD, SIG_DFL);
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd < 0 || timer_fd < 0 || epoll_fd < 0)
+        err(EXIT_FAILURE, "event loop");
+
+    if (watch_fd(signal_fd, EPOLLIN, &signal_source) < 0 ||
+        watch_fd(timer_fd, EPOLLIN, &timer_source) < 0)
+        err(EXIT_FAILURE, "epoll_ctl");
+
+    // Only hangups matter in the normal mode. epoll reports them even if
+    // they're not asked for. Files like /dev/null can't be watched, but
+    // they don't hang up either.
+    if (watch_fd(STDIN_FILENO, server_mode ? EPOLLIN : 0, &stdin_source) < 0) {
+        INFO("Not watching stdin: %s", strerror(errno));
+    }
+}
+
+static void unwatch_stdin()
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+}
+
+static void close_watched_fd(int *fd)
+{
+    // Closing removes the fd from epoll unless a child still has a copy.
+    // Remove it explicitly so that events can't reference freed commands.
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, *fd, NULL);
+    close(*fd);
+    *fd = -1;
+}
+
+static void watch_command(struct command *cmd)
+{
+    cmd->output_source.type = EVENT_OUTPUT;
+    cmd->output_source.cmd = cmd;
+    cmd->stderr_source.type = EVENT_STDERR;
+    cmd->stderr_source.cmd = cmd;
+    cmd->exit_source.type = EVENT_EXIT;
+    cmd->exit_source.cmd = cmd;
+
+    if (cmd->output_fd >= 0 && !cmd->output_paused &&
+        watch_fd(cmd->output_fd, EPOLLIN, &cmd->output_source) < 0)
+        err(EXIT_FAILURE, "epoll_ctl");
+    if (cmd->stderr_fd >= 0 && !cmd->output_paused &&
+        watch_fd(cmd->stderr_fd, EPOLLIN, &cmd->stderr_source) < 0)
+        err(EXIT_FAILURE, "epoll_ctl");
+
+    // pidfds need Linux 5.3. SIGCHLD still works without them.
+    cmd->exit_fd = syscall(__NR_pidfd_open, cmd->pid, 0);
+    if (cmd->exit_fd >= 0 && watch_fd(cmd->exit_fd, EPOLLIN, &cmd->exit_source) < 0)
+        err(EXIT_FAILURE, "epoll_ctl");
+}
+
+// Stop reading output while there are no credits for it. The program blocks
+// when the pipe fills up.
+static void pause_output(struct command *cmd)
+{
+    cmd->output_paused = 1;
+    if (cmd->output_fd >= 0)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cmd->output_fd, NULL);
+    if (cmd->stderr_fd >= 0)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cmd->stderr_fd, NULL);
+}
+
+static void resume_output(struct command *cmd)
+{
+    cmd->output_paused = 0;
+    if (cmd->output_fd >= 0 && watch_fd(cmd->output_fd, EPOLLIN, &cmd->output_source) < 0)
+        err(EXIT_FAILURE, "epoll_ctl");
+    if (cmd->stderr_fd >= 0 && watch_fd(cmd->stderr_fd, EPOLLIN, &cmd->stderr_source) < 0)
+        err(EXIT_FAILURE, "epoll_ctl");
+}
+
+// Wake up teardown when a killed process exits or the killed cgroup v2 group
+// empties. pidfds are readable once their process exits.
+static void watch_cleanup(struct command *cmd)
+{
+    cmd->cleanup_source.type = EVENT_CLEANUP;
+    cmd->cleanup_source.cmd = cmd;
+
+    struct exit_waiter *waiter = &cmd->cleanup_waiter;
+    for (int i = 0; i < waiter->count; i++) {
+        if (watch_fd(waiter->fds[i].fd, EPOLLIN, &cmd->cleanup_source) < 0)
+            err(EXIT_FAILURE, "epoll_ctl");
+    }
+
+    // The kernel notifies pollers of cgroup.events when "populated" changes.
+    // Emulated groups are regular files, which epoll can't watch.
+    if (cmd->cgroup_events_fd >= 0 && !cmd->cgroup_events_watched &&
+            !cmd->killed_group->emulated &&
+            watch_fd(cmd->cgroup_events_fd, EPOLLPRI, &cmd->cleanup_source) == 0)
+        cmd->cgroup_events_watched = 1;
+}
+#else
+static int signal_pipe[2] = { -1, -1};
+static int stdin_watched = 1;
+
+void signal_handler(int signum)
+{
+    if (signal_pipe[1] >= 0 &&
+            write(signal_pipe[1], &signum, sizeof(signum)) < 0 &&
+            errno != EAGAIN)
+        warn("write(signal_pipe)");
+}
+
+static void init_event_loop()
+{
+    sigprocmask(SIG_SETMASK, NULL, &child_sigmask);
+
+    if (pipe(signal_pipe) < 0)
+        err(EXIT_FAILURE, "pipe");
+    if (fcntl(signal_pipe[0], F_SETFD, FD_CLOEXEC) < 0 ||
+        fcntl(signal_pipe[1], F_SETFD, FD_CLOEXEC) < 0)
+        warn("fcntl(FD_CLOEXEC)");
+
+    // SIGCHLDs from many children can fill the pipe. Every read reaps all of
+    // them, so dropping signals when it's full is fine.
+    if (fcntl(signal_pipe[0], F_SETFL, O_NONBLOCK) < 0 ||
+        fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK) < 0)
+        warn("fcntl(O_NONBLOCK)");
+
+    struct sigaction sa;
+    sa.sa_handler = signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+
+    sigaction(SIGCHLD, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGQUIT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+static void unwatch_stdin()
+{
+    stdin_watched = 0;
+}
+
+static void close_watched_fd(int *fd)
+{
+    close(*fd);
+    *fd = -1;
+}
+
+static void watch_command(struct command *cmd)
+{
+    // The poll loop checks the command list every time
+}
+
+static void pause_output(struct command *cmd)
+{
+    cmd->output_paused = 1;
+}
+
+static void resume_output(struct command *cmd)
+{
+    cmd->output_paused = 0;
+}
+
+static void watch_cleanup(struct command *cmd)
+{
+    // Nothing notifies teardown here, so it checks back on a timer
+}
+#endif
+
+// splice() can't write to files opened with O_APPEND, so seek to the end
+// to add to an existing file.
+static int open_output_file(struct command *cmd, int truncate)
+{
+    int fd = open(cmd->output_file, O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+    if (fd < 0) {
+        warn("open(%s)", cmd->output_file);
+        return -1;
+    }
+
+    off_t size = lseek(fd, 0, SEEK_END);
+    cmd->output_file_fd = fd;
+    cmd->output_file_bytes = size > 0 ? size : 0;
+    return 0;
+}
+
+// Keep draining the output when the file can't be written so that the
+// program doesn't block. The next rotation tries the file again.
+static void discard_output_file(struct command *cmd)
+{
+    if (cmd->output_file_fd >= 0)
+        close(cmd->output_file_fd);
+
+    cmd->output_file_fd = fcntl(dev_null_fd, F_DUPFD_CLOEXEC, 0);
+    if (cmd->output_file_fd < 0)
+        err(EXIT_FAILURE, "fcntl(F_DUPFD_CLOEXEC)");
+}
+
+// Move <file>.1 to <file>.2 and so on, dropping the oldest, move <file> to
+// <file>.1 and start a new <file>
+static void rotate_output_file(struct command *cmd)
+{
+    INFO("Rotating %s after %lld bytes", cmd->output_file, cmd->output_file_bytes);
+    close(cmd->output_file_fd);
+    cmd->output_file_fd = -1;
+
+    for (int i = cmd->output_file_count; i > 0; i--) {
+        char *from;
+        char *to;
+        if (i > 1)
+            checked_asprintf(&from, "%s.%d", cmd->output_file, i - 1);
+        else
+            checked_asprintf(&from, "%s", cmd->output_file);
+        checked_asprintf(&to, "%s.%d", cmd->output_file, i);
+
+        if (rename(from, to) < 0 && errno != ENOENT)
+            warn("rename(%s, %s)", from, to);
+        free(from);
+        free(to);
+    }
+
+    if (open_output_file(cmd, 1) < 0)
+        discard_output_file(cmd);
+}
+
+// How much can go in the output file before it's rotated
+static size_t output_file_room(struct command *cmd, size_t len)
+{
+    if (cmd->output_file_max_bytes > 0 &&
+        cmd->output_file_max_bytes - cmd->output_file_bytes < (long long) len)
+        return cmd->output_file_max_bytes - cmd->output_file_bytes;
+    return len;
+}
+
+static void output_file_written(struct command *cmd, size_t len)
+{
+    cmd->output_file_bytes += len;
+    if (cmd->output_file_max_bytes > 0 && cmd->output_file_bytes >= cmd->output_file_max_bytes)
+        rotate_output_file(cmd);
+}
+
+static void write_output_file(struct command *cmd, const uint8_t *buffer, size_t len)
+{
+    while (len > 0) {
+        size_t amt = output_file_room(cmd, len);
+        if (write_all(cmd->output_file_fd, buffer, amt) < 0) {
+            warn("write(%s)", cmd->output_file);
+            discard_output_file(cmd);
+            continue;
+        }
+
+        buffer += amt;
+        len -= amt;
+        output_file_written(cmd, amt);
+    }
+}
+
+// Keep every nth line for --output-sample. Lines can span reads, so the
+// count carries over.
+static size_t sample_lines(struct command *cmd, uint8_t *buffer, size_t len)
+{
+    size_t kept = 0;
+    size_t start = 0;
+    while (start < len) {
+        uint8_t *newline = memchr(&buffer[start], '\n', len - start);
+        size_t end = newline ? (size_t) (newline - buffer) + 1 : len;
+
+        if (cmd->output_lines % cmd->output_sample == 0) {
+            memmove(&buffer[kept], &buffer[start], end - start);
+            kept += end - start;
+        }
+        if (newline)
+            cmd->output_lines++;
+        start = end;
+    }
+    return kept;
+}
+
+static void use_output_credit(struct command *cmd)
+{
+    if (cmd->flow_control && cmd->output_credits > 0 && --cmd->output_credits == 0)
+        pause_output(cmd);
+}
+
+static void grant_output_credits(struct command *cmd, uint32_t credits)
+{
+    cmd->output_credits += credits;
+    if (cmd->output_paused && cmd->output_credits > 0)
+        resume_output(cmd);
+}
+
+static ssize_t forward_output(struct command *cmd);
+
+// After the early exit status, the caller has all of the output that it'll
+// get. Anything else is read, counted and thrown away.
+static ssize_t drop_output(struct command *cmd, int *fd)
+{
+    uint8_t buffer[SERVER_READ_SIZE];
+    ssize_t amt = read(*fd, buffer, sizeof(buffer));
+    if (amt > 0)
+        cmd->output_dropped += amt;
+    else if (amt == 0 || (errno != EAGAIN && errno != EINTR))
+        close_watched_fd(fd);
+    return amt;
+}
+
+#ifdef __linux__
+// When the output only goes to a file, move it from the pipe without
+// copying it through muontrap.
+static ssize_t splice_output(struct command *cmd)
+{
+    ssize_t amt = splice(cmd->output_fd, NULL, cmd->output_file_fd, NULL,
+                         output_file_room(cmd, SPLICE_SIZE), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (amt > 0) {
+        cmd->output_read += amt;
+        output_file_written(cmd, amt);
+        return amt;
+    }
+
+    if (amt == 0) {
+        INFO("output closed for %d", cmd->pid);
+        close_watched_fd(&cmd->output_fd);
+        return 0;
+    }
+
+    // Reading from the pipe can only fail with these, so anything else is
+    // the file's fault.
+    if (errno == EAGAIN || errno == EINTR)
+        return amt;
+
+    if (errno == EINVAL) {
+        INFO("Can't splice to %s, so copying instead", cmd->output_file);
+        cmd->output_file_copy = 1;
+    } else {
+        warn("splice(%s)", cmd->output_file);
+        discard_output_file(cmd);
+    }
+    return forward_output(cmd);
+}
+#endif
+
+static ssize_t forward_output(struct command *cmd)
+{
+    if (cmd->exit_reported)
+        return drop_output(cmd, &cmd->output_fd);
+
+#ifdef __linux__
+    if (cmd->output_file && cmd->output_sample == 0 && !cmd->output_file_copy)
+        return splice_output(cmd);
+#endif
+
+    uint8_t small_buffer[SERVER_READ_SIZE];
+    uint8_t *buffer = small_buffer;
+    size_t size = sizeof(small_buffer);
+    if (cmd->output_buffer) {
+        buffer = cmd->output_buffer;
+        size = cmd->output_chunk_size;
+    }
+
+    // With a chunk size, drain the pipe so that the Erlang side gets fewer,
+    // bigger messages. Otherwise send each read as it comes.
+    size_t len = 0;
+    ssize_t amt;
+    do {
+        amt = read(cmd->output_fd, &buffer[len], size - len);
+        if (amt > 0)
+            len += amt;
+    } while (amt > 0 && len < size && cmd->output_buffer);
+    cmd->output_read += len;
+
+    if (len > 0) {
+        if (cmd->output_file)
+            write_output_file(cmd, buffer, len);
+
+        size_t send_len = len;
+        if (cmd->output_sample > 0)
+            send_len = sample_lines(cmd, buffer, len);
+        else if (cmd->output_file)
+            send_len = 0;
+
+        if (send_len > 0) {
+            send_message(MSG_DATA, cmd->id, buffer, send_len);
+            use_output_credit(cmd);
+        }
+    }
+
+    if (amt == 0 || (amt < 0 && errno != EAGAIN && errno != EINTR)) {
+        INFO("output closed for %d", cmd->pid);
+        close_watched_fd(&cmd->output_fd);
+    }
+    return len > 0 ? (ssize_t) len : amt;
+}
+
+// stderr is sent as it's read. It isn't batched, saved or sampled like
+// stdout, but it uses the same credits.
+static ssize_t forward_stderr(struct command *cmd)
+{
+    if (cmd->exit_reported)
+        return drop_output(cmd, &cmd->stderr_fd);
+
+    uint8_t buffer[SERVER_READ_SIZE];
+    ssize_t amt = read(cmd->stderr_fd, buffer, sizeof(buffer));
+    if (amt > 0) {
+        cmd->stderr_read += amt;
+        send_message(MSG_STDERR, cmd->id, buffer, amt);
+        use_output_credit(cmd);
+    } else if (amt == 0 || (errno != EAGAIN && errno != EINTR)) {
+        INFO("stderr closed for %d", cmd->pid);
+        close_watched_fd(&cmd->stderr_fd);
+    }
+    return amt;
+}
+
+// Teardown
+//
+// Once the program exits, whatever it left behind gets a SIGKILL and the
+// event loop waits for it to go without holding up the other commands.
+// pidfds say when killed processes exit and cgroup.events says when the
+// killed cgroup v2 group empties. brutal_kill_wait_ms caps the whole wait.
+// Output that's in the pipes when the processes are gone is still sent, but
+// anything after that is dropped so that leftover writers can't keep the
+// command around.
+
+static unsigned long long pipe_bytes(int fd)
+{
+    int amt;
+    if (fd < 0 || ioctl(fd, FIONREAD, &amt) < 0 || amt < 0)
+        return 0;
+    return amt;
+}
+
+// Send the output up to here before moving on
+static void mark_output(struct command *cmd)
+{
+    cmd->output_mark = cmd->output_read + pipe_bytes(cmd->output_fd);
+    cmd->stderr_mark = cmd->stderr_read + pipe_bytes(cmd->stderr_fd);
+}
+
+static int output_sent(struct command *cmd)
+{
+    // Nothing more gets sent after the early exit status or when there's no
+    // one left to send it to.
+    if (cmd->exit_reported || shutting_down)
+        return 1;
+
+    return (cmd->output_fd < 0 || cmd->output_read >= cmd->output_mark) &&
+           (cmd->stderr_fd < 0 || cmd->stderr_read >= cmd->stderr_mark);
+}
+
+static void close_output(struct command *cmd, int *fd)
+{
+    if (*fd >= 0) {
+        cmd->output_dropped += pipe_bytes(*fd);
+        close_watched_fd(fd);
+    }
+}
+
+static void clear_cleanup_waiter(struct command *cmd)
+{
+    struct exit_waiter *waiter = &cmd->cleanup_waiter;
+    for (int i = 0; i < waiter->count; i++)
+        close_watched_fd(&waiter->fds[i].fd);
+    waiter->count = 0;
+    waiter->incomplete = 0;
+}
+
+// Stop waiting on the processes that exited and return how many are left
+static int remove_exited(struct exit_waiter *waiter)
+{
+    if (waiter->count == 0 || poll(waiter->fds, waiter->count, 0) <= 0)
+        return waiter->count;
+
+    int left = 0;
+    for (int i = 0; i < waiter->count; i++) {
+        if (waiter->fds[i].revents)
+            close_watched_fd(&waiter->fds[i].fd);
+        else
+            waiter->fds[left++] = waiter->fds[i];
+    }
+    waiter->count = left;
+    return left;
+}
+
+static int group_populated(struct command *cmd)
+{
+    char events[256];
+    ssize_t amt = pread(cmd->cgroup_events_fd, events, sizeof(events) - 1, 0);
+    if (amt < 0)
+        return 0;
+    events[amt] = '\0';
+    return strstr(events, "populated 0") == NULL;
+}
+
+// Send everything that's left a SIGKILL and return how many processes that
+// was. This gets called until there aren't any to handle the race where a
+// new process was spawned while iterating through the pids.
+//
+// cgroup.kill already got a cgroup v2 group and cgroup.events says when
+// it's empty, so its pids only get listed on the last pass to report who's
+// stuck. Nothing waits on processes killed by the last pass.
+static int kill_leftovers(struct command *cmd, int final)
+{
+    clear_cleanup_waiter(cmd);
+
+    int per_pid = final || !cmd->group_killed;
+    struct exit_waiter *waiter = final ? NULL : &cmd->cleanup_waiter;
+    int left = per_pid ? kill_children(cmd, SIGKILL, waiter) : 0;
+#ifdef __linux__
+    if (cmd->subreaper) {
+        // As a subreaper, muontrap adopts orphaned descendants, so everything
+        // that's left is under it in the process tree. Reap first so that
+        // zombies aren't counted.
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            ;
+        if (per_pid)
+            left += kill_descendants(SIGKILL, waiter);
+    }
+#endif
+    return left;
+}
+
+static void check_leftovers(struct command *cmd, int64_t now)
+{
+    // Wait for everything that was killed before looking again
+    if (remove_exited(&cmd->cleanup_waiter) > 0 && now < cmd->deadline_us)
+        return;
+
+    int final = now >= cmd->cleanup_deadline_us;
+    int left = kill_leftovers(cmd, final);
+    int populated = cmd->cgroup_events_fd >= 0 && group_populated(cmd);
+
+    // Everything is in the group, so it has the last word
+    if (cmd->cgroup_events_fd >= 0 && !populated)
+        left = 0;
+
+    if (left > 0 || populated) {
+        if (!final) {
+            INFO("Found %d pids and sent them a SIGKILL", left);
+            watch_cleanup(cmd);
+
+            // Check back soon when nothing will say that they're gone
+            struct exit_waiter *waiter = &cmd->cleanup_waiter;
+            int notified = cmd->cgroup_events_watched ||
+                           (!waiter->incomplete && waiter->count > 0);
+            cmd->deadline_us = cmd->cleanup_deadline_us;
+            if (!notified && now + 1000 < cmd->deadline_us)
+                cmd->deadline_us = now + 1000;
+            return;
+        }
+
+        if (left > 0) {
+            warnx("Failed to kill %d pids!", left);
+            cmd->leftover_pids += left;
+#ifdef DEBUG
+            dump_all_children_from_cgroups(cmd);
+#endif
+        } else {
+            INFO("%s still populated", cmd->killed_group->group_path);
+        }
+    }
+
+    clear_cleanup_waiter(cmd);
+    if (cmd->cgroup_events_fd >= 0)
+        close_watched_fd(&cmd->cgroup_events_fd);
+    cmd->processes_gone = 1;
+    cmd->deadline_us = INT64_MAX;
+
+    // The early exit status already has its output
+    if (!cmd->early_exit_status)
+        mark_output(cmd);
+}
+
+// Let the Erlang side reply to its caller while descendants are killed and
+// the cgroups are removed. The output that was ready when the program exited
+// goes first so that none of it is after the exit status.
+static void send_early_exit_status(struct command *cmd)
+{
+    send_u32_message(MSG_EXITED, cmd->id,
+                     cmd->timed_out ? TIMEOUT_EXIT_STATUS : cmd->exit_status);
+    cmd->exit_reported = 1;
+
+    // Dropping output doesn't need credits
+    if (cmd->output_paused)
+        resume_output(cmd);
+}
+
+static void finish_command(struct command *cmd)
+{
+    // Collect stats after everything has exited, but before the cgroups go
+    char stats[STATS_SIZE];
+    size_t stats_len = cmd->report_stats ? format_stats(cmd, stats, sizeof(stats)) : 0;
+
+    destroy_cgroups(cmd);
+    cmd->times.teardown_stop_us = microsecs();
+    int64_t teardown_us = cmd->times.teardown_stop_us - cmd->times.exit_us;
+    INFO("teardown of %d took %lld us", cmd->pid, (long long) teardown_us);
+
+    if (cmd->timed_out)
+        cmd->exit_status = TIMEOUT_EXIT_STATUS;
+
+    if (server_mode) {
+        // Orphaned descendants that hold on to the pipes (no cgroups) get
+        // cut off here.
+        close_output(cmd, &cmd->output_fd);
+        close_output(cmd, &cmd->stderr_fd);
+        if (cmd->output_dropped > 0 && !cmd->exit_reported)
+            warnx("Dropped %llu bytes of output that %d's descendants wrote after it exited",
+                  cmd->output_dropped, cmd->pid);
+
+        if (cmd->report_timings)
+            stats_len = format_timings(cmd, stats, sizeof(stats), stats_len);
+        if (cmd->early_exit_status) {
+            append_stat(stats, sizeof(stats), &stats_len, "cleanup_leftover_pids", cmd->leftover_pids);
+            append_stat(stats, sizeof(stats), &stats_len, "cleanup_cgroup_errors", cmd->cgroup_errors);
+            append_stat(stats, sizeof(stats), &stats_len, "cleanup_discarded_bytes", cmd->output_dropped);
+        }
+        send_exit_message(cmd->id, cmd->exit_status, teardown_us, stats, stats_len);
+    } else {
+        command_exit_status = cmd->exit_status;
+        if (cmd->report_timings)
+            stats_len = format_timings(cmd, stats, sizeof(stats), stats_len);
+        if (cmd->report_stats || cmd->report_timings)
+            send_stats_trailer(stats, stats_len);
+    }
+
+    for (struct command **p = &commands; *p != NULL; p = &(*p)->next) {
+        if (*p == cmd) {
+            *p = cmd->next;
+            break;
+        }
+    }
+    free_command(cmd);
+}
+
+// Called from the event loop until teardown is done and the command is freed
+static void continue_cleanup(struct command *cmd, int64_t now)
+{
+    if (!cmd->processes_gone && (cmd->cleanup_ready || now >= cmd->deadline_us)) {
+        cmd->cleanup_ready = 0;
+        check_leftovers(cmd, now);
+    }
+
+    if (server_mode && cmd->early_exit_status && !cmd->exit_reported && output_sent(cmd))
+        send_early_exit_status(cmd);
+
+    if (cmd->processes_gone && output_sent(cmd))
+        finish_command(cmd);
+}
+
+static void start_cleanup(struct command *cmd)
+{
+    int64_t now = microsecs();
+    cmd->times.exit_us = now;
+    if (cmd->times.teardown_start_us == 0)
+        cmd->times.teardown_start_us = now;
+
+    if (cmd->exit_fd >= 0)
+        close_watched_fd(&cmd->exit_fd);
+
+    cmd->state = COMMAND_CLEANING;
+    cmd->cleanup_deadline_us = now + 1000 * cmd->brutal_kill_wait_ms;
+    cmd->deadline_us = now;
+    cmd->next_sample_us = INT64_MAX;
+
+    // In order to cleanup the cgroup, all processes need to exit. The
+    // immediate child of muontrap has exited, so any other processes are
+    // orphaned descendants. I.e., Their parent is now PID 1 and we won't get
+    // a SIGCHLD when they die. We only know who they are since they're in
+    // the cgroup.
+    //
+    // Every group has the same processes, so killing one cgroup v2 group is
+    // enough. cgroup.kill kills the whole group atomically, so there's no
+    // race with processes that are forking. Older kernels don't have it, but
+    // the group can still say when it's empty.
+    FOREACH_CONTROLLER(cmd) {
+        if (is_cgroup2(controller)) {
+            cmd->group_killed = cgroup_kill(controller) == 0;
+
+            char *events_file;
+            checked_asprintf(&events_file, "%s/cgroup.events", controller->group_path);
+            cmd->cgroup_events_fd = open(events_file, O_RDONLY | O_CLOEXEC);
+            free(events_file);
+            cmd->killed_group = controller;
+            break;
+        }
+    }
+
+    if (server_mode && cmd->early_exit_status)
+        mark_output(cmd);
+
+    continue_cleanup(cmd, now);
+}
+
+static void start_termination(struct command *cmd)
+{
+    if (cmd->state != COMMAND_RUNNING)
+        return;
+
+    if (kill(cmd->pid, SIGTERM) < 0) {
+        INFO("kill -%d %d failed (%s)", SIGTERM, cmd->pid, strerror(errno));
+    }
+    cmd->state = COMMAND_TERMINATING;
+    cmd->times.teardown_start_us = microsecs();
+    cmd->deadline_us = cmd->times.teardown_start_us + 1000 * cmd->brutal_kill_wait_ms;
+}
+
+static void start_timeout(struct command *cmd)
+{
+    if (cmd->timeout_ms > 0)
+        cmd->deadline_us = microsecs() + 1000 * (int64_t) cmd->timeout_ms;
+    if (cmd->sample_interval_ms > 0)
+        cmd->next_sample_us = microsecs() + 1000 * (int64_t) cmd->sample_interval_ms;
+}
+
+static void send_sample(struct command *cmd)
+{
+    char sample[STATS_SIZE];
+    size_t len = 0;
+    append_cgroup_stats(cmd, sample, sizeof(sample), &len, 1);
+    send_message(MSG_SAMPLE, cmd->id, sample, len);
+}
+
+static void check_deadlines(int64_t now)
+{
+    struct command *cmd = commands;
+    while (cmd != NULL) {
+        struct command *next = cmd->next;
+        if (now >= cmd->next_sample_us) {
+            if (cmd->state == COMMAND_RUNNING) {
+                send_sample(cmd);
+                cmd->next_sample_us = now + 1000 * (int64_t) cmd->sample_interval_ms;
+            } else {
+                cmd->next_sample_us = INT64_MAX;
+            }
+        }
+
+        if (cmd->state == COMMAND_CLEANING) {
+            continue_cleanup(cmd, now);
+        } else if (now >= cmd->deadline_us) {
+            if (cmd->state == COMMAND_RUNNING) {
+                INFO("%d timed out", cmd->pid);
+                cmd->timed_out = 1;
+                start_termination(cmd);
+            } else if (cmd->state == COMMAND_TERMINATING) {
+                // Child didn't exit, so SIGKILL it.
+                if (kill(cmd->pid, SIGKILL) < 0) {
+                    INFO("kill -%d %d failed (%s)", SIGKILL, cmd->pid, strerror(errno));
+                }
+                cmd->state = COMMAND_KILLING;
+                cmd->deadline_us = now + 1000 * cmd->brutal_kill_wait_ms;
+            } else {
+                warnx("SIGKILL didn't work on %d", cmd->pid);
+                cmd->exit_status = EXIT_FAILURE;
+                start_cleanup(cmd);
+            }
+        }
+        cmd = next;
+    }
+}
+
+static int64_t next_deadline_us()
+{
+    int64_t next_deadline = INT64_MAX;
+    for (struct command *cmd = commands; cmd != NULL; cmd = cmd->next) {
+        if (cmd->deadline_us < next_deadline)
+            next_deadline = cmd->deadline_us;
+        if (cmd->next_sample_us < next_deadline)
+            next_deadline = cmd->next_sample_us;
+    }
+    return next_deadline;
+}
+
+static void reap_children()
+{
+    int status;
+    struct rusage rusage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &rusage)) > 0) {
+        struct command *cmd = find_command_by_pid(pid);
+        if (cmd) {
+            cmd->exit_status = wait_status_to_exit_status(status);
+            cmd->rusage = rusage;
+            start_cleanup(cmd);
+        } else {
+            INFO("reaped unknown pid %d", pid);
+        }
+    }
+}
+
+static void start_server_command(struct command *cmd);
+
+static void server_spawn(uint32_t id, const uint8_t *payload, size_t len)
+{
+    struct command *cmd = new_command();
+    cmd->id = id;
+    cmd->exit_status = EXIT_FAILURE;
+
+    // Keep a copy of the request since the options point into it
+    int argc = 1;
+    cmd->request = malloc(len + 1);
+    memcpy(cmd->request, payload, len);
+    cmd->request[len] = '\0';
+    for (size_t i = 0; i < len; i++) {
+        if (cmd->request[i] == '\0')
+            argc++;
+    }
+    if (len > 0 && cmd->request[len - 1] != '\0')
+        argc++;
+
+    cmd->request_argv = malloc((argc + 1) * sizeof(char *));
+    cmd->request_argv[0] = "muontrap";
+    char *arg = cmd->request;
+    for (int i = 1; i < argc; i++) {
+        cmd->request_argv[i] = arg;
+        arg += strlen(arg) + 1;
+    }
+    cmd->request_argv[argc] = NULL;
+
+    if (parse_options(cmd, argc, cmd->request_argv) < 0) {
+        send_exit_message(id, EXIT_FAILURE, 0, NULL, 0);
+        free_command(cmd);
+        return;
+    }
+
+    start_server_command(cmd);
+}
+
+// A pipe for output that muontrap reads without blocking
+static int open_output_pipe(int fds[2])
+{
+    if (pipe(fds) < 0) {
+        warn("pipe");
+        return -1;
+    }
+    if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) < 0 ||
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC) < 0 ||
+        fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0)
+        warn("fcntl(output_pipe)");
+    return 0;
+}
+
+static void close_pipe_end(int *fd)
+{
+    if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+// Start a command whose output and exit status are sent as messages
+static void start_server_command(struct command *cmd)
+{
+    int output_pipe[2] = { -1, -1 };
+    int stderr_pipe[2] = { -1, -1 };
+    cmd->times.cgroup_start_us = microsecs();
+    if (create_cgroups(cmd) < 0)
+        goto failed;
+
+    if (update_cgroup_settings(cmd) < 0)
+        goto failed_with_cgroups;
+    if (cmd->pooled_group && (cmd->report_stats || cmd->sample_interval_ms > 0))
+        start_pooled_stats(cmd);
+    cmd->times.cgroup_stop_us = microsecs();
+
+    if (cmd->output_file) {
+        if (open_output_file(cmd, 0) < 0)
+            goto failed_with_cgroups;
+
+        // Start a new file if the old one is already full
+        if (cmd->output_file_max_bytes > 0 && cmd->output_file_bytes >= cmd->output_file_max_bytes)
+            rotate_output_file(cmd);
+    }
+
+    if (!cmd->output_discard && open_output_pipe(output_pipe) < 0)
+        goto failed_with_cgroups;
+
+    if (cmd->capture_stderr && open_output_pipe(stderr_pipe) < 0)
+        goto failed_with_pipes;
+
+    if (cmd->output_chunk_size > 0 && output_pipe[0] >= 0) {
+        cmd->output_buffer = malloc(cmd->output_chunk_size);
+        if (!cmd->output_buffer)
+            err(EXIT_FAILURE, "malloc");
+#ifdef F_SETPIPE_SZ
+        // A bigger pipe lets the program keep writing while a chunk is sent.
+        // Unprivileged users are limited by /proc/sys/fs/pipe-max-size, so
+        // carry on with the default size if this fails.
+        if (fcntl(output_pipe[0], F_SETPIPE_SZ, cmd->output_chunk_size) < 0) {
+            INFO("F_SETPIPE_SZ(%d) failed: %s", cmd->output_chunk_size, strerror(errno));
+        }
+#endif
+    }
+
+    cmd->times.exec_start_us = microsecs();
+    cmd->pid = spawn_child(cmd, dev_null_fd, cmd->output_discard ? dev_null_fd : output_pipe[1],
+                           stderr_pipe[1]);
+    cmd->times.exec_stop_us = microsecs();
+    close_pipe_end(&output_pipe[1]);
+    close_pipe_end(&stderr_pipe[1]);
+    if (cmd->pid < 0) {
+        warn("spawn");
+        goto failed_with_pipes;
+    }
+
+    cmd->output_fd = output_pipe[0];
+    cmd->stderr_fd = stderr_pipe[0];
+    cmd->output_paused = cmd->flow_control && cmd->output_credits == 0;
+    cmd->state = COMMAND_RUNNING;
+    cmd->next = commands;
+    commands = cmd;
+    watch_command(cmd);
+    start_timeout(cmd);
+
+    send_u32_message(MSG_STARTED, cmd->id, cmd->pid);
+    return;
+
+failed_with_pipes:
+    close_pipe_end(&output_pipe[0]);
+    close_pipe_end(&output_pipe[1]);
+    close_pipe_end(&stderr_pipe[0]);
+    close_pipe_end(&stderr_pipe[1]);
+failed_with_cgroups:
+    destroy_cgroups(cmd);
+failed:
+    send_exit_message(cmd->id, EXIT_FAILURE, 0, NULL, 0);
+    free_command(cmd);
+}
+
+static void server_status(uint32_t id)
+{
+    uint8_t payload[5];
+    struct command *cmd = find_command_by_id(id);
+    if (cmd) {
+        payload[0] = cmd->state == COMMAND_RUNNING ? 1 : 2;
+        put_be32(&payload[1], cmd->pid);
+    } else {
+        payload[0] = 0;
+        put_be32(&payload[1], 0);
+    }
+    send_message(MSG_STATUS_REPLY, id, payload, sizeof(payload));
+}
+
+static void handle_request(const uint8_t *request, size_t len)
+{
+    if (len < 5) {
+        warnx("Ignoring short request");
+        return;
+    }
+
+    uint32_t id = get_be32(&request[1]);
+    switch (request[0]) {
+    case MSG_SPAWN:
+        if (single_command) {
+            warnx("Ignoring spawn request with --framed");
+            send_exit_message(id, EXIT_FAILURE, 0, NULL, 0);
+        } else {
+            server_spawn(id, &request[5], len - 5);
+        }
+        break;
+
+    case MSG_KILL: {
+        struct command *cmd = find_command_by_id(id);
+        if (cmd)
+            start_termination(cmd);
+        break;
+    }
+
+    case MSG_STATUS:
+        server_status(id);
+        break;
+
+    case MSG_CREDITS: {
+        struct command *cmd = find_command_by_id(id);
+        if (cmd && len >= 9)
+            grant_output_credits(cmd, get_be32(&request[5]));
+        break;
+    }
+
+    default:
+        warnx("Ignoring unknown request type %d", request[0]);
+        break;
+    }
+}
+
+static void process_requests()
+{
+    if (request_buffer_len == request_buffer_size) {
+        request_buffer_size = request_buffer_size ? 2 * request_buffer_size : SERVER_READ_SIZE;
+        request_buffer = realloc(request_buffer, request_buffer_size);
+        if (!request_buffer)
+            err(EXIT_FAILURE, "realloc");
+    }
+
+    ssize_t amt = read(STDIN_FILENO, &request_buffer[request_buffer_len], request_buffer_size - request_buffer_len);
+    if (amt <= 0) {
+        if (amt < 0 && errno == EINTR)
+            return;
+
+        INFO("stdin closed. cleaning up...");
+        shutting_down = 1;
+        return;
+    }
+    request_buffer_len += amt;
+
+    size_t offset = 0;
+    while (request_buffer_len - offset >= 4) {
+        size_t len = get_be32(&request_buffer[offset]);
+        if (request_buffer_len - offset - 4 < len)
+            break;
+
+        handle_request(&request_buffer[offset + 4], len);
+        offset += 4 + len;
+    }
+
+    if (offset > 0) {
+        memmove(request_buffer, &request_buffer[offset], request_buffer_len - offset);
+        request_buffer_len -= offset;
+    }
+}
+
+static void process_stdin()
+{
+    if (server_mode) {
+        process_requests();
+    } else {
+        // The normal mode only watches for the Erlang side closing the port
+        INFO("stdin closed. cleaning up...");
+        shutting_down = 1;
+    }
+}
+
+#ifdef __linux__
+static void process_signals()
+{
+    struct signalfd_siginfo info[16];
+    ssize_t amt = read(signal_fd, info, sizeof(info));
+    if (amt < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            warn("read signalfd");
+        return;
+    }
+
+    for (size_t i = 0; i < amt / sizeof(struct signalfd_siginfo); i++) {
+        switch (info[i].ssi_signo) {
+        case SIGCHLD:
+            children_exited = 1;
+            break;
+
+        case SIGTERM:
+        case SIGQUIT:
+        case SIGINT:
+            shutting_down = 1;
+            break;
+
+        default:
+            warnx("unexpected signal: %d", info[i].ssi_signo);
+            break;
+        }
+    }
+}
+
+static void wait_for_events()
+{
+    int64_t deadline_us = next_deadline_us();
+    if (deadline_us != timer_deadline_us) {
+        // Absolute deadlines on the monotonic clock don't drift
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        if (deadline_us != INT64_MAX) {
+            its.it_value.tv_sec = deadline_us / 1000000;
+            its.it_value.tv_nsec = (deadline_us % 1000000) * 1000;
+        }
+        if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+            err(EXIT_FAILURE, "timerfd_settime");
+        timer_deadline_us = deadline_us;
+    }
+
+    struct epoll_event events[64];
+    int count = epoll_wait(epoll_fd, events, 64, -1);
+    if (count < 0) {
+        if (errno == EINTR)
+            return;
+
+        err(EXIT_FAILURE, "epoll_wait");
+    }
+
+    // Forward output first, since handling the other events can free
+    // commands.
+    for (int i = 0; i < count; i++) {
+        struct event_source *source = events[i].data.ptr;
+        if (source->type == EVENT_OUTPUT)
+            forward_output(source->cmd);
+        else if (source->type == EVENT_STDERR)
+            forward_stderr(source->cmd);
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct event_source *source = events[i].data.ptr;
+        switch (source->type) {
+        case EVENT_SIGNAL:
+            process_signals();
+            break;
+
+        case EVENT_STDIN:
+            process_stdin();
+            break;
+
+        case EVENT_TIMER: {
+            uint64_t expirations;
+            if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                warn("read timerfd");
+            timer_deadline_us = INT64_MAX;
+            break;
+        }
+
+        case EVENT_EXIT:
+            children_exited = 1;
+            break;
+
+        case EVENT_CLEANUP:
+            source->cmd->cleanup_ready = 1;
+            break;
+
+        case EVENT_OUTPUT:
+        case EVENT_STDERR:
+            break;
+        }
+    }
+}
+#else
+static void process_signals()
+{
+    int signals[16];
+    ssize_t amt = read(signal_pipe[0], signals, sizeof(signals));
+    if (amt < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            warn("read signal_pipe");
+        return;
+    }
+
+    for (size_t i = 0; i < amt / sizeof(int); i++) {
+        switch (signals[i]) {
+        case SIGCHLD:
+            children_exited = 1;
+            break;
+
+        case SIGTERM:
+        case SIGQUIT:
+        case SIGINT:
+            shutting_down = 1;
+            break;
+
+        default:
+            warnx("unexpected signal: %d", signals[i]);
+            break;
+        }
+    }
+}
+
+static void wait_for_events()
+{
+    static struct pollfd *fds = NULL;
+    static struct command **fd_commands = NULL;
+    static size_t fds_size = 0;
+
+    size_t count = 2;
+    for (struct command *cmd = commands; cmd != NULL; cmd = cmd->next)
+        count += 2;
+
+    if (count > fds_size) {
+        fds_size = 2 * count;
+        fds = realloc(fds, fds_size * sizeof(struct pollfd));
+        fd_commands = realloc(fd_commands, fds_size * sizeof(struct command *));
+        if (!fds || !fd_commands)
+            err(EXIT_FAILURE, "realloc");
+    }
+
+    fds[0].fd = signal_pipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = stdin_watched ? STDIN_FILENO : -1;
+    fds[1].events = server_mode ? POLLIN : POLLHUP; // POLLERR is implicit
+    size_t nfds = 2;
+    for (struct command *cmd = commands; cmd != NULL; cmd = cmd->next) {
+        if (cmd->output_fd >= 0 && !cmd->output_paused) {
+            fds[nfds].fd = cmd->output_fd;
+            fds[nfds].events = POLLIN;
+            fd_commands[nfds] = cmd;
+            nfds++;
+        }
+        if (cmd->stderr_fd >= 0 && !cmd->output_paused) {
+            fds[nfds].fd = cmd->stderr_fd;
+            fds[nfds].events = POLLIN;
+            fd_commands[nfds] = cmd;
+            nfds++;
+        }
+    }
+
+    int timeout_ms = -1;
+    int64_t deadline_us = next_deadline_us();
+    if (deadline_us != INT64_MAX) {
+        int64_t now = microsecs();
+        timeout_ms = deadline_us <= now ? 0 : (deadline_us - now + 999) / 1000;
+    }
+
+    if (poll(fds, nfds, timeout_ms) < 0) {
+        if (errno == EINTR)
+            return;
+
+        err(EXIT_FAILURE, "poll");
+    }
+
+    // Forward output first, since handling the other events can free
+    // commands.
+    for (size_t i = 2; i < nfds; i++) {
+        if (!fds[i].revents)
+            continue;
+
+        if (fds[i].fd == fd_commands[i]->stderr_fd)
+            forward_stderr(fd_commands[i]);
+        else
+            forward_output(fd_commands[i]);
+    }
+
+    if (fds[0].revents)
+        process_signals();
+
+    if (fds[1].revents)
+        process_stdin();
+}
+#endif
+
+static void run_event_loop()
+{
+    for (;;) {
+        if (shutting_down) {
+            unwatch_stdin();
+            for (struct command *cmd = commands; cmd != NULL; cmd = cmd->next)
+                start_termination(cmd);
+        }
+
+        // The normal and framed modes are done when their one command is.
+        // The server keeps going until it's told to stop.
+        if (commands == NULL && (shutting_down || !server_mode || single_command))
+            break;
+
+        wait_for_events();
+
+        if (children_exited) {
+            children_exited = 0;
+            reap_children();
+        }
+        check_deadlines(microsecs());
+    }
+}
+
+static void watch_parent(pid_t parent_pid)
+{
+#ifdef __linux__
+    // If the Erlang VM is killed, stdin may not close right away or at all
+    // if something else has the other end. Have the kernel send SIGTERM when
+    // the parent exits so that cleanup starts immediately. The parent could
+    // have exited before the prctl, so check that it's still the same.
+    if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0)
+        warn("prctl(PR_SET_PDEATHSIG)");
+    else if (getppid() != parent_pid)
+        raise(SIGTERM);
+#endif
+}
+
+static void become_subreaper()
+{
+    // Descendants that double fork to get away from their parents
+    // reparent to muontrap rather than init.
+#ifdef __linux__
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0)
+        warn("prctl(PR_SET_CHILD_SUBREAPER)");
+#else
+    warnx("--subreaper is only supported on Linux");
+#endif
+}
+
+static void init_server(pid_t parent_pid)
+{
+    server_mode = 1;
+
+    // EPIPE on stdout is handled by shutting down.
+    signal(SIGPIPE, SIG_IGN);
+
+    open_dev_null();
+    init_event_loop();
+    watch_parent(parent_pid);
+}
+
+static int server_main(pid_t parent_pid)
+{
+    init_server(parent_pid);
+    run_event_loop();
+    return EXIT_SUCCESS;
+}
+
+static int framed_main(struct command *cmd, pid_t parent_pid)
+{
+    init_server(parent_pid);
+    single_command = 1;
+
+    if (cmd->subreaper)
+        become_subreaper();
+
+    start_server_command(cmd);
+    run_event_loop();
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    pid_t parent_pid = getppid();
+
+#ifdef DEBUG
+    char filename[64];
+    sprintf(filename, "muontrap-%d.log", getpid());
+    debug_fp = fopen(filename, "w");
+    if (!debug_fp)
+        debug_fp = stderr;
+#endif
+    INFO("muontrap argc=%d", argc);
+    if (argc == 1) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    if (argc == 2 && strcmp(argv[1], "--server") == 0)
+        exit(server_main(parent_pid));
+
+    struct command *cmd = new_command();
+    if (parse_options(cmd, argc, argv) < 0)
+        exit(EXIT_FAILURE);
+
+    if (cmd->framed)
+        exit(framed_main(cmd, parent_pid));
+
+    // Finished processing commandline. Initialize and run child.
+
+    init_event_loop();
+    watch_parent(parent_pid);
+
+    if (cmd->subreaper)
+        become_subreaper();
+
+    cmd->times.cgroup_start_us = microsecs();
+    if (create_cgroups(cmd) < 0)
+        exit(EXIT_FAILURE);
+
+    if (update_cgroup_settings(cmd) < 0) {
+        destroy_cgroups(cmd);
+        exit(EXIT_FAILURE);
+    }
+    if (cmd->pooled_group && (cmd->report_stats || cmd->sample_interval_ms > 0))
+        start_pooled_stats(cmd);
+    cmd->times.cgroup_stop_us = microsecs();
+
+    if (cmd->output_discard)
+        open_dev_null();
+
+    cmd->times.exec_start_us = microsecs();
+    cmd->pid = spawn_child(cmd, -1, cmd->output_discard ? dev_null_fd : -1, -1);
+    cmd->times.exec_stop_us = microsecs();
+    if (cmd->pid < 0) {
+        warn("spawn");
+        destroy_cgroups(cmd);
+        exit(EXIT_FAILURE);
     }
 
-    // Cleanup all descendents if using cgroups
-    cleanup_all_children();
+    cmd->state = COMMAND_RUNNING;
+    commands = cmd;
+    watch_command(cmd);
+    start_timeout(cmd);
 
-    destroy_cgroups();
-    disable_signal_handlers();
+    // Run until the child exits or muontrap is told to stop. Stopping
+    // kills the child (SIGTERM, then SIGKILL) and reports a failure.
+    run_event_loop();
 
-    exit(exit_status);
+    exit(shutting_down ? EXIT_FAILURE : command_exit_status);
 }
@@ -0,0 +1,85 @@
+defmodule MuonTrap.CgroupPoolTest do
+  use MuonTrapTest.Case
+
+  alias MuonTrap.CgroupPool
+
+  setup do
+    cgroup_base = random_cgroup_path()
+
+    pool =
+      start_supervised!(
+        {CgroupPool, cgroup_base: cgroup_base, cgroup_controllers: ["cpu"], size: 2}
+      )
+
+    # The pool is stopped first, so this only has to remove the base group
+    on_exit(fn -> MuonTrap.Cgroups.remove_group(["cpu"], cgroup_base) end)
+
+    {:ok, pool: pool, cgroup_base: cgroup_base}
+  end
+
+  @tag :cgroup
+  test "creates groups ahead of time", %{pool: pool} do
+    assert %{size: 2, idle: 2, leased: 0, created: 2, misses: 0} = CgroupPool.stats(pool)
+  end
+
+  @tag :cgroup
+  test "reuses groups after commands exit", %{pool: pool} do
+    for _ <- 1..5 do
+      assert {"hello\n", 0} == MuonTrap.cmd("echo", ["hello"], cgroup_pool: pool)
+    end
+
+    assert %{idle: 2, leased: 0, created: 2, recycled: 5, misses: 0} = CgroupPool.stats(pool)
+  end
+
+  @tag :cgroup
+  test "runs commands in a leased group", %{pool: pool, cgroup_base: cgroup_base} do
+    {output, 0} = MuonTrap.cmd("cat", ["/proc/self/cgroup"], cgroup_pool: pool)
+
+    assert output =~ "/#{cgroup_base}/"
+  end
+
+  @tag :cgroup
+  test "replaces groups with custom settings", %{pool: pool} do
+    sets = [{"cpu", "cpu.shares", "100"}]
+    assert {"", 0} == MuonTrap.cmd("true", [], cgroup_pool: pool, cgroup_sets: sets)
+
+    assert %{idle: 2, leased: 0, created: 3, recycled: 0, removed: 1} = CgroupPool.stats(pool)
+  end
+
+  @tag :cgroup
+  test "stats only count the command with the lease" do
+    cgroup_base = random_cgroup_path()
+    controllers = ["cpu", "memory"]
+    spec = {CgroupPool, cgroup_base: cgroup_base, cgroup_controllers: controllers, size: 1}
+    pool = start_supervised!(Supervisor.child_spec(spec, id: :stats_pool))
+    on_exit(fn -> MuonTrap.Cgroups.remove_group(controllers, cgroup_base) end)
+
+    # Use 20 MB and some CPU time, and then do nothing in the same group
+    busy =
+      "x=$(head -c 20000000 /dev/zero | tr '\\0' a); i=0; " <>
+        "while [ $i -lt 100000 ]; do i=$((i+1)); done"
+
+    {"", 0, first} = MuonTrap.cmd("sh", ["-c", busy], cgroup_pool: pool, stats: true)
+    {"", 0, second} = MuonTrap.cmd("true", [], cgroup_pool: pool, stats: true)
+
+    assert %{created: 1, recycled: 2, misses: 0} = CgroupPool.stats(pool)
+    assert second.cgroup_memory_peak_bytes < div(first.cgroup_memory_peak_bytes, 2)
+
+    if Map.has_key?(first, :cgroup_cpu_us) do
+      assert second.cgroup_cpu_us < div(first.cgroup_cpu_us, 2)
+    end
+  end
+
+  @tag :cgroup
+  test "removes idle groups when stopped", %{cgroup_base: cgroup_base} do
+    {_version, dir} = MuonTrap.Cgroups.group_dir("cpu", cgroup_base)
+    assert length(subdirectories(dir)) == 2
+
+    stop_supervised(CgroupPool)
+    assert subdirectories(dir) == []
+  end
+
+  defp subdirectories(dir) do
+    File.ls!(dir) |> Enum.filter(&File.dir?(Path.join(dir, &1)))
+  end
+end
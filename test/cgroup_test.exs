@@ -55,6 +55,40 @@ defmodule CgroupTest do
     assert !cpu_cgroup_exists(cgroup_path)
   end
 
+  @tag :cgroup
+  test "cleans up a process tree that forks while being killed" do
+    cgroup_path = random_cgroup_path()
+
+    port =
+      Port.open(
+        {:spawn_executable, MuonTrap.muontrap_path()},
+        args: [
+          "-g",
+          cgroup_path,
+          "-c",
+          "cpu",
+          "--",
+          "./test/process_tree.test",
+          "-d",
+          "3",
+          "-f",
+          "4",
+          "-i",
+          "-k"
+        ]
+      )
+
+    # The tree prints how many processes it has once they're all running
+    assert_receive {^port, {:data, '85\n'}}, 1000
+
+    os_pid = os_pid(port)
+    Port.close(port)
+
+    wait_for_close_check()
+    assert_os_pid_exited(os_pid)
+    assert !cpu_cgroup_exists(cgroup_path)
+  end
+
   @tag :cgroup
   test "get and set cgroup variables" do
     cgroup_path = random_cgroup_path()
@@ -77,4 +111,111 @@ defmodule CgroupTest do
 
     Port.close(port)
   end
+
+  @tag :fake_cgroupfs
+  test "kills everything in a fake cgroup v2 group" do
+    {root, _fake} = start_fake_cgroupfs(["-2"])
+    cgroup_path = random_cgroup_path()
+    group = Path.join(root, cgroup_path)
+
+    port =
+      Port.open(
+        {:spawn_executable, MuonTrap.muontrap_path()},
+        args: [
+          "--cgroup-root",
+          root,
+          "-g",
+          cgroup_path,
+          "-c",
+          "memory",
+          "-s",
+          "memory.limit_in_bytes=268435456",
+          "--",
+          "./test/process_tree.test",
+          "-d",
+          "2",
+          "-f",
+          "2"
+        ]
+      )
+
+    assert_receive {^port, {:data, '7\n'}}
+    assert File.read!(Path.join(group, "memory.max")) == "268435456"
+    assert File.read!(Path.join(root, "cgroup.subtree_control")) =~ "+memory"
+
+    os_pids = wait_for_procs(group, 7)
+    Enum.each(os_pids, &assert_os_pid_running/1)
+
+    Port.close(port)
+
+    wait_for_close_check(100)
+    Enum.each(os_pids, &assert_os_pid_exited/1)
+    refute File.exists?(group)
+  end
+
+  @tag :fake_cgroupfs
+  test "the cgroup root can be configured" do
+    {root, _fake} = start_fake_cgroupfs([])
+    cgroup_path = random_cgroup_path()
+    Application.put_env(:muontrap, :cgroup_root, root)
+    on_exit(fn -> Application.delete_env(:muontrap, :cgroup_root) end)
+
+    {:ok, controllers} = Cgroups.get_controllers()
+    assert Enum.sort(controllers) == ["cpu", "memory", "pids"]
+    assert Cgroups.group_dir("cpu", cgroup_path) == {:v1, Path.join([root, "cpu", cgroup_path])}
+
+    shares = Path.join([root, "cpu", cgroup_path, "cpu.shares"])
+
+    assert MuonTrap.cmd("cat", [shares],
+             cgroup_controllers: ["cpu"],
+             cgroup_path: cgroup_path,
+             cgroup_sets: [{"cpu", "cpu.shares", "100"}]
+           ) == {"100", 0}
+
+    refute File.exists?(Path.dirname(shares))
+  end
+
+  test "parses cgroup v1 and v2 mounts" do
+    mountinfo = """
+    25 20 0:22 / /sys/fs/cgroup ro,nosuid,nodev,noexec shared:9 - tmpfs tmpfs ro,mode=755
+    26 25 0:23 / /sys/fs/cgroup/unified rw,nosuid,nodev,noexec shared:10 - cgroup2 cgroup2 rw
+    28 25 0:25 / /sys/fs/cgroup/cpu,cpuacct rw,nosuid shared:12 - cgroup cgroup rw,cpu,cpuacct
+    29 25 0:26 / /sys/fs/cgroup/memory rw,nosuid shared:13 - cgroup cgroup rw,memory
+    """
+
+    %{v1: v1, v2: v2} = Cgroups.parse_mountinfo(mountinfo)
+    assert v2 == "/sys/fs/cgroup/unified"
+    assert "cpu" in v1
+    assert "cpuacct" in v1
+    assert "memory" in v1
+    refute "pids" in v1
+  end
+
+  test "parses a cgroup v2 only system" do
+    mountinfo = """
+    35 24 0:30 / /sys/fs/cgroup rw,nosuid,nodev,noexec shared:9 - cgroup2 cgroup2 rw,nsdelegate
+    """
+
+    assert Cgroups.parse_mountinfo(mountinfo) == %{v1: [], v2: "/sys/fs/cgroup"}
+  end
+
+  defp wait_for_procs(group, count, retries \\ 100) do
+    os_pids =
+      Path.join(group, "cgroup.procs")
+      |> File.read!()
+      |> String.split()
+      |> Enum.map(&String.to_integer/1)
+
+    cond do
+      length(os_pids) == count ->
+        os_pids
+
+      retries == 0 ->
+        flunk("Expected #{count} pids in #{group}, got #{inspect(os_pids)}")
+
+      true ->
+        Process.sleep(10)
+        wait_for_procs(group, count, retries - 1)
+    end
+  end
 end
@@ -175,4 +175,193 @@ defmodule DaemonTest do
     memory = Integer.parse(memory_str)
     assert memory > 1000
   end
+
+  test "daemon logs output when sampling" do
+    fun = fn ->
+      {:ok, _pid} =
+        start_supervised(daemon_spec("echo", ["hello"], log_output: :error, sample_interval: 50))
+
+      wait_for_close_check()
+      Logger.flush()
+    end
+
+    assert capture_log(fun) =~ "hello"
+  end
+
+  test "daemon logs chunked output by line" do
+    fun = fn ->
+      {:ok, _pid} =
+        start_supervised(
+          daemon_spec("printf", ["one\\ntwo\\n"], log_output: :error, output_chunk_size: 65536)
+        )
+
+      wait_for_close_check()
+      Logger.flush()
+    end
+
+    log = capture_log(fun)
+    assert log =~ "one"
+    assert log =~ "two"
+    refute log =~ "one\ntwo"
+  end
+
+  # Run a Daemon that isn't restarted until its command exits
+  defp run_daemon(cmd, args, opts) do
+    spec = Supervisor.child_spec(daemon_spec(cmd, args, opts), restart: :temporary)
+    {:ok, pid} = start_supervised(spec)
+    ref = Process.monitor(pid)
+    assert_receive {:DOWN, ^ref, :process, ^pid, :normal}, 1000
+  end
+
+  test "daemon writes output to a rotated file" do
+    path = Path.join("test", "tmp-daemon_output")
+    on_exit(fn -> Enum.each(Path.wildcard(path <> "*"), &File.rm/1) end)
+
+    run_daemon("printf", ["one\\ntwo\\nthree\\n"],
+      output_file: path,
+      output_file_max_bytes: 8,
+      output_file_count: 1
+    )
+
+    assert File.read!(path <> ".1") == "one\ntwo\n"
+    assert File.read!(path) == "three\n"
+    refute File.exists?(path <> ".2")
+  end
+
+  test "daemon logs a sample of the output" do
+    path = Path.join("test", "tmp-daemon_sampled_output")
+    on_exit(fn -> File.rm(path) end)
+
+    fun = fn ->
+      run_daemon("printf", ["one\\ntwo\\nthree\\n"],
+        output_file: path,
+        log_output: :error,
+        log_sample: 2
+      )
+
+      Logger.flush()
+    end
+
+    log = capture_log(fun)
+    assert log =~ "one"
+    refute log =~ "two"
+    assert log =~ "three"
+    assert File.read!(path) == "one\ntwo\nthree\n"
+  end
+
+  test "daemon logs stderr at its own level" do
+    fun = fn ->
+      run_daemon("sh", ["-c", "echo to stdout; echo to stderr >&2"],
+        log_output: :info,
+        log_stderr: :error
+      )
+
+      Logger.flush()
+    end
+
+    log = capture_log([level: :error], fun)
+    assert log =~ "to stderr"
+    refute log =~ "to stdout"
+    assert capture_log([level: :info], fun) =~ "to stdout"
+  end
+
+  @tag :cgroup
+  test "daemon reports cgroup samples" do
+    handler_id = {__MODULE__, :sample}
+    test_pid = self()
+
+    :ok =
+      :telemetry.attach(
+        handler_id,
+        [:muontrap, :daemon, :sample],
+        fn _event, sample, metadata, _config -> send(test_pid, {:sample, sample, metadata}) end,
+        nil
+      )
+
+    on_exit(fn -> :telemetry.detach(handler_id) end)
+
+    {:ok, pid} =
+      start_supervised(
+        daemon_spec(
+          test_path("do_nothing.test"),
+          [],
+          cgroup_base: "muontrap_test",
+          cgroup_controllers: ["memory"],
+          sample_interval: 50
+        )
+      )
+
+    assert_receive {:sample, sample, %{cgroup_path: "muontrap_test/" <> _}}, 1000
+    assert sample.cgroup_memory_bytes > 0
+    assert %{cgroup_memory_bytes: _} = Daemon.last_sample(pid)
+
+    :ok = stop_supervised(:test_daemon)
+    _ = :sys.get_state(MuonTrap.SampleCache)
+    assert Daemon.last_sample(pid) == nil
+  end
+
+  @tag :cgroup
+  test "many daemons start and stop without leaving anything behind" do
+    children =
+      for i <- 1..50 do
+        Supervisor.child_spec(
+          {Daemon,
+           [
+             test_path("do_nothing.test"),
+             [],
+             [cgroup_base: "muontrap_test", cgroup_controllers: ["cpu"]]
+           ]},
+          id: i
+        )
+      end
+
+    {:ok, sup} = Supervisor.start_link(children, strategy: :one_for_one)
+
+    daemons =
+      for {_id, pid, _type, _modules} <- Supervisor.which_children(sup) do
+        {Daemon.os_pid(pid), :sys.get_state(pid).cgroup_path}
+      end
+
+    assert length(daemons) == 50
+
+    for {os_pid, cgroup_path} <- daemons do
+      assert_os_pid_running(os_pid)
+      assert cpu_cgroup_exists(cgroup_path)
+    end
+
+    # The launchers clean up in parallel after the Daemons stop
+    :ok = Supervisor.stop(sup)
+    wait_for_close_check(500)
+
+    for {os_pid, cgroup_path} <- daemons do
+      assert_os_pid_exited(os_pid)
+      refute cpu_cgroup_exists(cgroup_path)
+    end
+  end
+
+  test "shutdown_all stops daemons in parallel" do
+    children =
+      for i <- 1..4 do
+        Supervisor.child_spec({Daemon, [test_path("ignore_sigterm.test"), []]}, id: i)
+      end
+
+    {:ok, sup} = Supervisor.start_link(children, strategy: :one_for_one)
+
+    os_pids =
+      for {_id, pid, _type, _modules} <- Supervisor.which_children(sup), do: Daemon.os_pid(pid)
+
+    Enum.each(os_pids, &assert_os_pid_running/1)
+
+    # Each muontrap waits 500 ms before sending a SIGKILL
+    {elapsed_us, :ok} = :timer.tc(fn -> MuonTrap.shutdown_all(sup) end)
+    assert elapsed_us < 1_500_000
+
+    Enum.each(os_pids, &assert_os_pid_exited/1)
+
+    for {_id, pid, _type, _modules} <- Supervisor.which_children(sup) do
+      assert pid == :undefined
+    end
+
+    Supervisor.stop(sup)
+  end
 end
@@ -0,0 +1,460 @@
+#ifdef __linux__
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#else
+#include <err.h>
+#include <stdlib.h>
+#endif
+
+// Emulate a cgroup filesystem in a normal directory so that muontrap's
+// cgroup code can be tested and benchmarked without root. Pass the directory
+// to muontrap with --cgroup-root.
+//
+// Usage: fake_cgroupfs.test [-2] <root>
+//
+//   -2  make a cgroup v2 hierarchy. Otherwise there's a cgroup v1 hierarchy
+//       for each of the cpu, memory and pids controllers.
+//
+// muontrap makes the control files when it creates a group in a directory
+// that isn't a cgroup filesystem and writes the pid of the program that it
+// starts to cgroup.procs. This program does what the kernel would do:
+//
+// * cgroup.procs lists the program and all of its descendants that are
+//   still running
+// * cgroup.events says "populated 1" when cgroup.procs isn't empty
+// * writing to cgroup.kill (a FIFO) sends a SIGKILL to everything in the group
+//
+// It prints "ready" once the root is set up and runs until stdin is closed
+// or it gets a SIGTERM. Descendants are found by scanning /proc every
+// millisecond while any group is populated. Unlike the kernel, that misses
+// processes whose parent exits before the next scan, so tests shouldn't
+// depend on orphans that are created while the group is being killed.
+
+#ifdef __linux__
+
+#define MAX_PIDS 65536
+
+struct group {
+    struct group *next;
+    int wd;
+    int kill_fd;
+    char *path;
+    int dirty; // cgroup.procs may have been written
+    int pid_count;
+    pid_t *pids;
+};
+
+static struct group *groups = NULL;
+static int inotify_fd;
+static int epoll_fd;
+static volatile sig_atomic_t done = 0;
+
+// Parent of every process on the system or 0 if it has exited, and a list of
+// the ones that are running so that ppids doesn't need to be scanned
+static pid_t *ppids = NULL;
+static pid_t *running = NULL;
+static int running_count = 0;
+static char *members = NULL;
+static pid_t max_pid = 0;
+
+static void on_signal(int signum)
+{
+    done = 1;
+}
+
+static void write_text(const char *dir, const char *name, const char *text, int create)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_TRUNC | (create ? O_CREAT : 0), 0644);
+    if (fd < 0)
+        return;
+    if (write(fd, text, strlen(text)) < 0)
+        perror(path);
+    close(fd);
+}
+
+static void open_kill_fifo(struct group *group)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/cgroup.kill", group->path);
+    group->kill_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (group->kill_fd < 0)
+        return;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = group;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, group->kill_fd, &event);
+}
+
+static struct group *find_group(int wd)
+{
+    for (struct group *group = groups; group != NULL; group = group->next) {
+        if (group->wd == wd)
+            return group;
+    }
+    return NULL;
+}
+
+static void watch_dir(const char *path)
+{
+    int wd = inotify_add_watch(inotify_fd, path, IN_CREATE | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_ONLYDIR);
+    if (wd < 0 || find_group(wd))
+        return;
+
+    struct group *group = calloc(1, sizeof(struct group));
+    group->wd = wd;
+    group->kill_fd = -1;
+    group->path = strdup(path);
+    group->dirty = 1;
+    group->pids = malloc(MAX_PIDS * sizeof(pid_t));
+    group->next = groups;
+    groups = group;
+
+    // Catch up on anything made before the watch was added
+    DIR *dir = opendir(path);
+    if (!dir)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        if (entry->d_type == DT_DIR)
+            watch_dir(child);
+        else if (strcmp(entry->d_name, "cgroup.kill") == 0 && group->kill_fd < 0)
+            open_kill_fifo(group);
+    }
+    closedir(dir);
+}
+
+static void remove_group(struct group *group)
+{
+    for (struct group **p = &groups; *p != NULL; p = &(*p)->next) {
+        if (*p == group) {
+            *p = group->next;
+            break;
+        }
+    }
+    if (group->kill_fd >= 0)
+        close(group->kill_fd);
+    free(group->pids);
+    free(group->path);
+    free(group);
+}
+
+static void read_ppid(pid_t pid)
+{
+    if (pid <= 0 || pid > max_pid || ppids[pid] != 0)
+        return;
+
+    char path[64];
+    char stat[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    ssize_t amt = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (amt <= 0)
+        return;
+    stat[amt] = '\0';
+
+    // The command name is in parentheses and can contain anything
+    char *end = strrchr(stat, ')');
+    char state;
+    int ppid;
+    if (end && sscanf(end + 1, " %c %d", &state, &ppid) == 2 && state != 'Z') {
+        ppids[pid] = ppid > 0 ? ppid : -1;
+        running[running_count++] = pid;
+    }
+}
+
+static void read_ppids()
+{
+    for (int i = 0; i < running_count; i++)
+        ppids[running[i]] = 0;
+    running_count = 0;
+
+    DIR *dir = opendir("/proc");
+    if (!dir)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+        read_ppid(atoi(entry->d_name));
+    closedir(dir);
+}
+
+static int is_running(pid_t pid)
+{
+    return pid > 0 && pid <= max_pid && ppids[pid] != 0;
+}
+
+static void write_procs(struct group *group)
+{
+    char *text = malloc(group->pid_count * 12 + 1);
+    size_t len = 0;
+    text[0] = '\0';
+    for (int i = 0; i < group->pid_count; i++)
+        len += sprintf(&text[len], "%d\n", group->pids[i]);
+
+    // Replace the file so that muontrap never reads a partial list
+    char path[4096];
+    char new_path[4096];
+    snprintf(path, sizeof(path), "%s/cgroup.procs", group->path);
+    snprintf(new_path, sizeof(new_path), "%s/.cgroup.procs.new", group->path);
+    write_text(group->path, ".cgroup.procs.new", text, 1);
+    if (rename(new_path, path) < 0)
+        unlink(new_path);
+    free(text);
+}
+
+static void update_group(struct group *group)
+{
+    int old_count = group->pid_count;
+    int changed = 0;
+
+    if (group->dirty) {
+        // Start over with what's in cgroup.procs since muontrap added to it
+        group->pid_count = 0;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/cgroup.procs", group->path);
+        FILE *fp = fopen(path, "r");
+        if (fp) {
+            int pid;
+            while (fscanf(fp, "%d", &pid) == 1) {
+                // The pid may be newer than the last scan of /proc
+                read_ppid(pid);
+                if (is_running(pid) && group->pid_count < MAX_PIDS)
+                    group->pids[group->pid_count++] = pid;
+                else
+                    changed = 1;
+            }
+            fclose(fp);
+        }
+        group->dirty = 0;
+    } else {
+        int count = 0;
+        for (int i = 0; i < group->pid_count; i++) {
+            if (is_running(group->pids[i]))
+                group->pids[count++] = group->pids[i];
+        }
+        changed = count != group->pid_count;
+        group->pid_count = count;
+    }
+
+    // Children join their parent's group
+    for (int i = 0; i < group->pid_count; i++)
+        members[group->pids[i]] = 1;
+    for (int i = 0; i < running_count; i++) {
+        pid_t pid = running[i];
+        if (members[pid])
+            continue;
+
+        for (pid_t ancestor = ppids[pid]; ancestor > 0; ancestor = ppids[ancestor]) {
+            if (members[ancestor]) {
+                if (group->pid_count < MAX_PIDS) {
+                    group->pids[group->pid_count++] = pid;
+                    changed = 1;
+                }
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < group->pid_count; i++)
+        members[group->pids[i]] = 0;
+
+    // Only write cgroup.procs when something changed so that pids that
+    // muontrap adds aren't lost
+    if (changed)
+        write_procs(group);
+
+    // Update cgroup.events last since muontrap removes the group once it
+    // says that it's empty
+    if ((group->pid_count == 0) != (old_count == 0))
+        write_text(group->path, "cgroup.events", group->pid_count ? "populated 1\n" : "populated 0\n", 0);
+}
+
+static void kill_group(struct group *group)
+{
+    char buffer[64];
+    ssize_t amt = read(group->kill_fd, buffer, sizeof(buffer));
+    if (amt == 0) {
+        // The writer closed it, so reopen to wait for the next one
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, group->kill_fd, NULL);
+        close(group->kill_fd);
+        open_kill_fifo(group);
+        return;
+    }
+
+    // Make sure that everything that's running is known first
+    read_ppids();
+    update_group(group);
+    for (int i = 0; i < group->pid_count; i++)
+        kill(group->pids[i], SIGKILL);
+}
+
+static void handle_inotify()
+{
+    char buffer[65536] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t amt = read(inotify_fd, buffer, sizeof(buffer));
+    for (char *p = buffer; amt > 0 && p < buffer + amt; ) {
+        struct inotify_event *event = (struct inotify_event *) p;
+        p += sizeof(struct inotify_event) + event->len;
+
+        struct group *group = find_group(event->wd);
+        if (!group)
+            continue;
+
+        if (event->mask & IN_DELETE_SELF) {
+            remove_group(group);
+        } else if ((event->mask & IN_CREATE) && (event->mask & IN_ISDIR)) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", group->path, event->name);
+            watch_dir(path);
+        } else if ((event->mask & IN_CREATE) && strcmp(event->name, "cgroup.kill") == 0) {
+            if (group->kill_fd < 0)
+                open_kill_fifo(group);
+        } else if ((event->mask & IN_CLOSE_WRITE) && strcmp(event->name, "cgroup.procs") == 0) {
+            group->dirty = 1;
+        }
+    }
+}
+
+static pid_t read_max_pid()
+{
+    char text[32];
+    int fd = open("/proc/sys/kernel/pid_max", O_RDONLY);
+    ssize_t amt = fd >= 0 ? read(fd, text, sizeof(text) - 1) : -1;
+    if (fd >= 0)
+        close(fd);
+    if (amt <= 0)
+        return 32768;
+    text[amt] = '\0';
+    return atoi(text);
+}
+
+static void make_root(const char *root, int cgroup2)
+{
+    char path[4096];
+    if (mkdir(root, 0755) < 0 && errno != EEXIST) {
+        perror(root);
+        exit(EXIT_FAILURE);
+    }
+
+    if (cgroup2) {
+        write_text(root, "cgroup.controllers", "cpu io memory pids\n", 1);
+        write_text(root, "cgroup.subtree_control", "", 1);
+    } else {
+        static const char *controllers[] = { "cpu", "memory", "pids" };
+        for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+            snprintf(path, sizeof(path), "%s/%s", root, controllers[i]);
+            mkdir(path, 0755);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int cgroup2 = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "2")) != -1) {
+        switch (opt) {
+        case '2': cgroup2 = 1; break;
+        default:
+            fprintf(stderr, "Usage: fake_cgroupfs.test [-2] <root>\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind + 1 != argc) {
+        fprintf(stderr, "Usage: fake_cgroupfs.test [-2] <root>\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    max_pid = read_max_pid();
+    ppids = calloc(max_pid + 1, sizeof(pid_t));
+    running = calloc(max_pid + 1, sizeof(pid_t));
+    members = calloc(max_pid + 1, 1);
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (inotify_fd < 0 || epoll_fd < 0) {
+        perror("inotify/epoll");
+        exit(EXIT_FAILURE);
+    }
+
+    make_root(argv[optind], cgroup2);
+    watch_dir(argv[optind]);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &event);
+
+    // stdin closing means that the Erlang port closed
+    static struct group stdin_marker;
+    event.data.ptr = &stdin_marker;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event);
+
+    printf("ready\n");
+    fflush(stdout);
+
+    while (!done) {
+        int busy = 0;
+        for (struct group *group = groups; group != NULL; group = group->next)
+            busy |= group->pid_count > 0 || group->dirty;
+
+        struct epoll_event events[16];
+        int count = epoll_wait(epoll_fd, events, 16, busy ? 1 : -1);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                handle_inotify();
+            } else if (events[i].data.ptr == &stdin_marker) {
+                char c;
+                if (read(STDIN_FILENO, &c, 1) <= 0)
+                    done = 1;
+            } else {
+                kill_group(events[i].data.ptr);
+            }
+        }
+
+        if (busy) {
+            read_ppids();
+            for (struct group *group = groups; group != NULL; group = group->next) {
+                if (group->pid_count > 0 || group->dirty)
+                    update_group(group);
+            }
+        }
+    }
+    return 0;
+}
+
+#else
+
+int main(int argc, char *argv[])
+{
+    errx(EXIT_FAILURE, "fake_cgroupfs only works on Linux");
+}
+
+#endif
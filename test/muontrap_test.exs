@@ -61,6 +61,54 @@ defmodule MuonTrapTest do
     assert_os_pid_exited(os_pid)
   end
 
+  @tag :subreaper
+  test "subreaper kills orphaned descendants" do
+    {output, 0} =
+      MuonTrap.cmd("sh", ["-c", "sleep 1000 > /dev/null & echo $!"], subreaper: true)
+
+    orphan_pid = output |> String.trim() |> String.to_integer()
+
+    wait_for_close_check()
+    assert_os_pid_exited(orphan_pid)
+  end
+
+  @tag :subreaper
+  test "async_cleanup reports the cleanup separately" do
+    test_pid = self()
+
+    :ok =
+      :telemetry.attach(
+        :async_cleanup,
+        [:muontrap, :cmd, :cleanup],
+        fn _event, measurements, metadata, _config ->
+          send(test_pid, {:cleanup, measurements, metadata})
+        end,
+        nil
+      )
+
+    on_exit(fn -> :telemetry.detach(:async_cleanup) end)
+
+    args = ["-c", "sleep 1000 > /dev/null & echo $!; exit 3"]
+    {output, 3} = MuonTrap.cmd("sh", args, subreaper: true, async_cleanup: true)
+    orphan_pid = output |> String.trim() |> String.to_integer()
+
+    assert_receive {:cleanup,
+                    %{leftover_pids: 0, cgroup_errors: 0, discarded_bytes: 0, teardown_us: _},
+                    %{command: "sh", args: ^args}},
+                   1000
+
+    assert_os_pid_exited(orphan_pid)
+  end
+
+  @tag :pid_namespace
+  test "runs commands in a new PID namespace" do
+    {our_namespace, 0} = System.cmd("readlink", ["/proc/self/ns/pid"])
+    {namespace, 0} = MuonTrap.cmd("readlink", ["/proc/self/ns/pid"], pid_namespace: true)
+
+    assert namespace != our_namespace
+    assert {"", 3} == MuonTrap.cmd("sh", ["-c", "exit 3"], pid_namespace: true)
+  end
+
   # The following tests are copied from System.cmd to help ensure that
   # MuonTrap.cmd/3 works similarly.
   test "cmd/2 raises for null bytes" do
@@ -121,6 +169,146 @@ defmodule MuonTrapTest do
     assert {"", 128 + 15} == MuonTrap.cmd(test_path("kill_self_with_signal.test"), [])
   end
 
+  test "stats are returned with the output" do
+    {output, 3, stats} = MuonTrap.cmd("sh", ["-c", "echo hello; exit 3"], stats: true)
+
+    assert output == "hello\n"
+    assert stats.maxrss_kb > 0
+    assert is_integer(stats.utime_us)
+  end
+
+  test "stats don't get mixed up with lots of output" do
+    {output, 0, stats} =
+      MuonTrap.cmd("head", ["-c", "100000", "/dev/zero"], stats: true, into: [])
+
+    assert IO.iodata_length(output) == 100_000
+    assert Map.has_key?(stats, :nvcsw)
+  end
+
+  test "output can be sent in large chunks" do
+    {output, 0} =
+      MuonTrap.cmd("head", ["-c", "1000000", "/dev/zero"],
+        output_chunk_size: 262_144,
+        into: []
+      )
+
+    assert IO.iodata_length(output) == 1_000_000
+    assert Enum.all?(output, &(byte_size(&1) <= 262_144))
+
+    {output, 3, stats} =
+      MuonTrap.cmd("sh", ["-c", "echo hello; exit 3"], output_chunk_size: 4096, stats: true)
+
+    assert output == "hello\n"
+    assert stats.maxrss_kb > 0
+  end
+
+  test "stderr can be captured separately" do
+    args = ["-c", "echo out; echo err >&2; exit 3"]
+    assert {{"out\n", "err\n"}, 3} == MuonTrap.cmd("sh", args, stderr_into: "")
+
+    {{output, stderr}, 3, stats} =
+      MuonTrap.cmd("sh", args, into: [], stderr_into: [], stats: true)
+
+    assert IO.iodata_to_binary(output) == "out\n"
+    assert IO.iodata_to_binary(stderr) == "err\n"
+    assert stats.maxrss_kb > 0
+  end
+
+  test "stream/3 returns all of the output" do
+    output = MuonTrap.stream("head", ["-c", "1000000", "/dev/zero"]) |> Enum.to_list()
+
+    assert IO.iodata_length(output) == 1_000_000
+    assert MuonTrap.stream("sh", ["-c", "echo hello; exit 3"]) |> Enum.join() == "hello\n"
+  end
+
+  test "stream/3 only lets output through as it's consumed" do
+    output =
+      MuonTrap.stream("yes", [], output_window: 2)
+      |> Stream.map(fn data ->
+        Process.sleep(20)
+        {:message_queue_len, count} = Process.info(self(), :message_queue_len)
+        assert count <= 2
+        data
+      end)
+      |> Enum.take(5)
+
+    assert length(output) == 5
+    # Halting the stream closed the port and cleared out its messages
+    refute_received _
+  end
+
+  test "cmd/3 with an output window" do
+    {output, 0} =
+      MuonTrap.cmd("head", ["-c", "1000000", "/dev/zero"], output_window: 1, into: [])
+
+    assert IO.iodata_length(output) == 1_000_000
+  end
+
+  @tag :cgroup
+  test "stats include cgroup totals" do
+    {_output, 0, stats} =
+      MuonTrap.cmd("true", [],
+        stats: true,
+        cgroup_controllers: ["memory"],
+        cgroup_base: "muontrap_test"
+      )
+
+    assert Map.has_key?(stats, :cgroup_memory_peak_bytes)
+  end
+
+  @phases [:validate, :port_open, :cgroup, :exec, :first_output, :run, :teardown]
+
+  defp attach_phases(id) do
+    test_pid = self()
+    events = [[:muontrap, :cmd, :stop] | Enum.map(@phases, &[:muontrap, :cmd, &1, :stop])]
+
+    :ok =
+      :telemetry.attach_many(
+        id,
+        events,
+        fn event, measurements, metadata, _config ->
+          send(test_pid, {:telemetry, event, measurements, metadata})
+        end,
+        nil
+      )
+
+    on_exit(fn -> :telemetry.detach(id) end)
+  end
+
+  test "telemetry reports each phase" do
+    attach_phases(:telemetry_phases)
+    args = ["telemetry phases"]
+
+    assert {"telemetry phases\n", 0} == MuonTrap.cmd("echo", args)
+
+    for phase <- @phases do
+      assert_receive {:telemetry, [:muontrap, :cmd, ^phase, :stop], %{duration: duration},
+                      %{args: ^args}}
+
+      assert duration >= 0
+    end
+
+    assert_receive {:telemetry, [:muontrap, :cmd, :stop], %{duration: _},
+                    %{args: ^args, exit_status: 0}}
+  end
+
+  test "telemetry skips first output when there isn't any" do
+    attach_phases(:telemetry_no_output)
+    args = ["-c", "exit 2"]
+
+    assert {"", 2} == MuonTrap.cmd("sh", args)
+    assert_receive {:telemetry, [:muontrap, :cmd, :teardown, :stop], _, %{args: ^args}}
+    refute_received {:telemetry, [:muontrap, :cmd, :first_output, :stop], _, %{args: ^args}}
+  end
+
+  test "timeout kills the command" do
+    {time, result} = :timer.tc(MuonTrap, :cmd, ["sleep", ["10"], [timeout: 100]])
+
+    assert result == {"", 124}
+    assert time < 1_000_000
+    assert {"hello\n", 0} == MuonTrap.cmd("echo", ["hello"], timeout: 10_000)
+  end
+
   test "README.md version is up to date" do
     app = :muontrap
     app_version = Application.spec(app, :vsn) |> to_string()
@@ -17,6 +17,14 @@ defmodule MuonTrap.OptionsTest do
     end
   end
 
+  test "disallow picking the cgroup with a cgroup_pool" do
+    for opt <- [cgroup_base: "base", cgroup_path: "path", cgroup_controllers: ["cpu"]] do
+      assert_raise ArgumentError, fn ->
+        Options.validate(:cmd, "echo", [], [{:cgroup_pool, Something}, opt])
+      end
+    end
+  end
+
   test "errors match System.cmd ones" do
     for context <- [:cmd, :daemon] do
       # :enoent on missing executable
@@ -40,6 +48,42 @@ defmodule MuonTrap.OptionsTest do
       Options.validate(:daemon, "echo", [], into: "")
     end
 
+    assert Map.get(Options.validate(:cmd, "echo", [], server: Something), :server) == Something
+    assert Map.get(Options.validate(:cmd, "echo", [], timeout: 1000), :timeout) == 1000
+    assert Map.get(Options.validate(:cmd, "echo", [], stats: true), :stats)
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [], timeout: 1000)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], timeout: 0)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [], server: Something)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], server: Something, subreaper: true)
+    end
+
+    assert Map.get(Options.validate(:cmd, "echo", [], async_cleanup: true), :async_cleanup)
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [], async_cleanup: true)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], async_cleanup: true, stats: true)
+    end
+
+    assert Map.get(Options.validate(:cmd, "echo", [], pid_namespace: true), :pid_namespace)
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], pid_namespace: :yes)
+    end
+
     # :daemon-only
     assert Map.get(Options.validate(:daemon, "echo", [], name: Something), :name) == Something
 
@@ -59,6 +103,45 @@ defmodule MuonTrap.OptionsTest do
     assert_raise ArgumentError, fn ->
       Options.validate(:daemon, "echo", [], log_output: :bad_level)
     end
+
+    options = Options.validate(:daemon, "echo", [], sample_interval: 100)
+    assert Map.get(options, :sample_interval) == 100
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], sample_interval: 100)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [], sample_interval: 0)
+    end
+  end
+
+  test "daemon output is routed by muontrap" do
+    assert %{output_discard: true} = Options.validate(:daemon, "echo", [], [])
+
+    options = Options.validate(:daemon, "echo", [], log_output: :info)
+    refute Map.has_key?(options, :output_discard)
+    refute Map.has_key?(options, :log_sample)
+
+    options = Options.validate(:daemon, "echo", [], output_file: "out.log", log_sample: 10)
+    assert options.output_file == "out.log"
+    refute Map.has_key?(options, :log_sample)
+    refute Map.has_key?(options, :output_discard)
+
+    options = Options.validate(:daemon, "echo", [], output_file: "out.log", log_output: :info)
+    assert options.log_sample == 1
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [], output_file_max_bytes: 1000)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], output_file: "out.log")
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [], log_sample: 0)
+    end
   end
 
   test "common commands basically work" do
@@ -73,7 +156,8 @@ defmodule MuonTrap.OptionsTest do
       env: [{"KEY", "VALUE"}, {"KEY2", "VALUE2"}],
       cgroup_controllers: ["memory", "cpu"],
       cgroup_base: "base",
-      cgroup_sets: [{"memory", "memory.limit_in_bytes", "268435456"}]
+      cgroup_sets: [{"memory", "memory.limit_in_bytes", "268435456"}],
+      output_chunk_size: 1_048_576
     ]
 
     for context <- [:daemon, :cmd] do
@@ -90,6 +174,70 @@ defmodule MuonTrap.OptionsTest do
       assert Map.get(options, :cgroup_controllers) == ["memory", "cpu"]
       assert Map.get(options, :cgroup_base) == "base"
       assert Map.get(options, :cgroup_sets) == [{"memory", "memory.limit_in_bytes", "268435456"}]
+      assert Map.get(options, :output_chunk_size) == 1_048_576
+    end
+  end
+
+  test "output chunk size is checked" do
+    for size <- [0, 16_777_217, "1024"] do
+      assert_raise ArgumentError, fn ->
+        Options.validate(:cmd, "echo", [], output_chunk_size: size)
+      end
+    end
+  end
+
+  test "stream options" do
+    options = Options.validate(:stream, "echo", [], output_window: 2, timeout: 1000)
+    assert options.output_window == 2
+    assert options.timeout == 1000
+    assert Map.get(Options.validate(:cmd, "echo", [], output_window: 2), :output_window) == 2
+    assert Map.get(Options.validate(:daemon, "echo", [], output_window: 2), :output_window) == 2
+
+    for opts <- [[into: []], [stats: true], [server: Something], [cgroup_pool: Something]] do
+      assert_raise ArgumentError, fn ->
+        Options.validate(:stream, "echo", [], opts)
+      end
+    end
+
+    for count <- [0, -1, "4"] do
+      assert_raise ArgumentError, fn ->
+        Options.validate(:stream, "echo", [], output_window: count)
+      end
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], output_window: 2, server: Something)
+    end
+  end
+
+  test "stderr capture options" do
+    assert Map.get(Options.validate(:cmd, "echo", [], stderr_into: []), :stderr_into) == []
+    assert Map.get(Options.validate(:daemon, "echo", [], log_stderr: :warn), :log_stderr) == :warn
+
+    for {context, opts} <- [daemon: [stderr_into: ""], stream: [stderr_into: ""]] do
+      assert_raise ArgumentError, fn ->
+        Options.validate(context, "echo", [], opts)
+      end
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], log_stderr: :error)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [], log_stderr: :bad_level)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], stderr_into: "", stderr_to_stdout: true)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], stderr_into: "", server: Something)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [], log_stderr: :error, stderr_to_stdout: true)
     end
   end
 end
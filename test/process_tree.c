@@ -0,0 +1,122 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Fork a tree of processes for testing and benchmarking cleanup
+//
+// Usage: process_tree.test [-d depth] [-f fanout] [-i] [-k]
+//
+//   -d <depth>   levels of children under this process (default 4)
+//   -f <fanout>  children per process (default 2)
+//   -i           leaves ignore SIGTERM like ignore_sigterm.test
+//   -k           every process forks another one when it gets a SIGTERM
+//
+// The defaults make the same tree as fork_a_lot.test. Once every process is
+// running, the total number of processes is printed on a line by itself.
+
+static int fanout = 2;
+static int ignore_sigterm = 0;
+static int fork_during_kill = 0;
+static int ready_pipe[2];
+
+static void on_sigterm(int signum)
+{
+    // Leave something behind to clean up while muontrap is killing the tree
+    if (fork() == 0) {
+        for (;;)
+            pause();
+    }
+    _exit(0);
+}
+
+static void become_node(int left)
+{
+    if (fork_during_kill) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_sigterm;
+        sigaction(SIGTERM, &sa, NULL);
+    }
+
+    if (left == 0 && ignore_sigterm) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGTERM);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+    }
+}
+
+static void do_fork(int left)
+{
+    if (left == 0)
+        return;
+
+    for (int i = 0; i < fanout; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+
+        if (pid == 0) {
+            // Child
+            close(ready_pipe[0]);
+            become_node(left - 1);
+            do_fork(left - 1);
+            if (write(ready_pipe[1], "", 1) != 1)
+                exit(EXIT_FAILURE);
+            close(ready_pipe[1]);
+
+            for (;;)
+                pause();
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int depth = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:f:ik")) != -1) {
+        switch (opt) {
+        case 'd': depth = atoi(optarg); break;
+        case 'f': fanout = atoi(optarg); break;
+        case 'i': ignore_sigterm = 1; break;
+        case 'k': fork_during_kill = 1; break;
+        default:
+            fprintf(stderr, "Usage: process_tree.test [-d depth] [-f fanout] [-i] [-k]\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (pipe(ready_pipe) < 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    long children = 0;
+    long level = 1;
+    for (int i = 0; i < depth; i++) {
+        level *= fanout;
+        children += level;
+    }
+
+    become_node(depth);
+    do_fork(depth);
+    close(ready_pipe[1]);
+
+    // Wait for every child to check in
+    char c;
+    long ready = 0;
+    while (ready < children && read(ready_pipe[0], &c, 1) == 1)
+        ready++;
+
+    printf("%ld\n", children + 1);
+    fflush(stdout);
+
+    for (;;)
+        pause();
+}
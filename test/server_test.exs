@@ -0,0 +1,198 @@
+defmodule MuonTrap.ServerTest do
+  use MuonTrapTest.Case
+
+  alias MuonTrap.Server
+
+  setup do
+    server = start_supervised!(Server)
+    {:ok, server: server}
+  end
+
+  test "cmd runs through the server", %{server: server} do
+    assert {"hello\n", 0} = MuonTrap.cmd("echo", ["hello"], server: server)
+  end
+
+  test "cmd with options runs through the server", %{server: server} do
+    opts = [
+      into: [],
+      cd: File.cwd!(),
+      env: %{"MUONTRAP_TEST_VAR" => "HELLO_THERE"},
+      stderr_to_stdout: true,
+      server: server
+    ]
+
+    assert {output, 0} = MuonTrap.cmd("sh", ["-c", "echo $MUONTRAP_TEST_VAR >&2; pwd"], opts)
+    assert IO.iodata_to_binary(output) == "HELLO_THERE\n#{File.cwd!()}\n"
+  end
+
+  test "runs many commands concurrently", %{server: server} do
+    results =
+      1..50
+      |> Enum.map(fn i ->
+        Task.async(fn -> MuonTrap.cmd("echo", ["#{i}"], server: server) end)
+      end)
+      |> Enum.map(&Task.await/1)
+
+    assert results == Enum.map(1..50, fn i -> {"#{i}\n", 0} end)
+  end
+
+  test "signals return an exit code of 128 + signal", %{server: server} do
+    assert {"", 128 + 15} ==
+             MuonTrap.cmd(test_path("kill_self_with_signal.test"), [], server: server)
+  end
+
+  test "stats are returned through the server", %{server: server} do
+    assert {"hello\n", 0, %{maxrss_kb: _}} =
+             MuonTrap.cmd("echo", ["hello"], server: server, stats: true)
+  end
+
+  test "telemetry reports muontrap's phases", %{server: server} do
+    test_pid = self()
+    handler = fn event, _measurements, _metadata, _config -> send(test_pid, event) end
+    :ok = :telemetry.attach(:server_exec_phase, [:muontrap, :cmd, :exec, :stop], handler, nil)
+    on_exit(fn -> :telemetry.detach(:server_exec_phase) end)
+
+    assert {"hello\n", 0} == MuonTrap.cmd("echo", ["hello"], server: server)
+    assert_receive [:muontrap, :cmd, :exec, :stop]
+  end
+
+  test "timeout kills the command", %{server: server} do
+    assert {"", 124} == MuonTrap.cmd("sleep", ["10"], server: server, timeout: 100)
+  end
+
+  test "bad options fail the command", %{server: server} do
+    assert {"", 1} == MuonTrap.cmd("echo", ["hello"], server: server, uid: "__not_a_user")
+  end
+
+  test "status and kill", %{server: server} do
+    options = MuonTrap.Options.validate(:cmd, test_path("do_nothing.test"), [], [])
+    ref = Server.spawn_command(server, options)
+
+    assert {:running, os_pid} = Server.status(server, ref)
+    assert_os_pid_running(os_pid)
+
+    :ok = Server.kill(server, ref)
+    assert_receive {^ref, {:exit_status, 143}}
+    assert_os_pid_exited(os_pid)
+    assert :not_found == Server.status(server, ref)
+  end
+
+  test "command ids wrap around without reusing running ones", %{server: server} do
+    options = MuonTrap.Options.validate(:cmd, test_path("do_nothing.test"), [], [])
+    :sys.replace_state(server, &%{&1 | next_id: 0xFFFFFFFF})
+    last = Server.spawn_command(server, options)
+    first = Server.spawn_command(server, options)
+
+    # Come back around to ids that are still running
+    :sys.replace_state(server, &%{&1 | next_id: 0xFFFFFFFF})
+    next = Server.spawn_command(server, options)
+
+    %{refs: refs} = :sys.get_state(server)
+    assert %{^last => 0xFFFFFFFF, ^first => 1, ^next => 2} = refs
+
+    for ref <- [last, first, next] do
+      assert {:running, _os_pid} = Server.status(server, ref)
+      :ok = Server.kill(server, ref)
+      assert_receive {^ref, {:exit_status, 143}}
+    end
+  end
+
+  test "exiting caller kills its command", %{server: server} do
+    test_pid = self()
+
+    caller =
+      spawn(fn ->
+        options = MuonTrap.Options.validate(:cmd, test_path("do_nothing.test"), [], [])
+        ref = Server.spawn_command(server, options)
+        send(test_pid, {:started, ref})
+        Process.sleep(:infinity)
+      end)
+
+    assert_receive {:started, ref}
+    {:running, os_pid} = Server.status(server, ref)
+
+    Process.exit(caller, :kill)
+
+    wait_for_close_check(100)
+    assert_os_pid_exited(os_pid)
+  end
+
+  test "stopping the server kills its commands", %{server: server} do
+    options = MuonTrap.Options.validate(:cmd, test_path("do_nothing.test"), [], [])
+    ref = Server.spawn_command(server, options)
+    {:running, os_pid} = Server.status(server, ref)
+
+    :ok = stop_supervised(Server)
+
+    wait_for_close_check(100)
+    assert_os_pid_exited(os_pid)
+  end
+
+  @tag :cgroup
+  test "commands can use cgroups", %{server: server} do
+    cgroup_path = random_cgroup_path()
+    options =
+      MuonTrap.Options.validate(:cmd, test_path("fork_a_lot.test"), [],
+        cgroup_controllers: ["cpu"],
+        cgroup_path: cgroup_path
+      )
+
+    ref = Server.spawn_command(server, options)
+    {:running, os_pid} = Server.status(server, ref)
+    assert cpu_cgroup_exists(cgroup_path)
+
+    :ok = Server.kill(server, ref)
+    assert_receive {^ref, {:exit_status, _}}, 1000
+    assert_os_pid_exited(os_pid)
+    assert !cpu_cgroup_exists(cgroup_path)
+  end
+
+  @tag :fake_cgroupfs
+  test "tearing down one command doesn't hold up the others", %{server: server} do
+    {root, fake} = start_fake_cgroupfs(["-2"])
+    Application.put_env(:muontrap, :cgroup_root, root)
+    on_exit(fn -> Application.delete_env(:muontrap, :cgroup_root) end)
+
+    cgroup_path = random_cgroup_path()
+
+    options =
+      MuonTrap.Options.validate(:cmd, test_path("ignore_sigterm.test"), [],
+        cgroup_controllers: ["memory"],
+        cgroup_path: cgroup_path,
+        delay_to_sigkill: 1_000_000
+      )
+
+    ref = Server.spawn_command(server, options)
+    wait_for_populated(Path.join(root, cgroup_path))
+
+    # A stopped fake cgroupfs never sees the processes exit, so the teardown
+    # after the SIGKILL waits out the whole delay_to_sigkill.
+    fake_os_pid = os_pid(fake)
+    {_, 0} = System.cmd("kill", ["-STOP", "#{fake_os_pid}"])
+    on_exit(fn -> System.cmd("kill", ["-CONT", "#{fake_os_pid}"]) end)
+
+    :ok = Server.kill(server, ref)
+    Process.sleep(1300)
+
+    {time, result} = :timer.tc(MuonTrap, :cmd, ["echo", ["hello"], [server: server]])
+    assert result == {"hello\n", 0}
+    assert time < 500_000
+    refute_received {^ref, _}
+
+    assert_receive {^ref, {:exit_status, 137}}, 2000
+  end
+
+  defp wait_for_populated(group, retries \\ 100) do
+    cond do
+      File.read(Path.join(group, "cgroup.events")) == {:ok, "populated 1\n"} ->
+        :ok
+
+      retries == 0 ->
+        flunk("Expected #{group} to have processes")
+
+      true ->
+        Process.sleep(10)
+        wait_for_populated(group, retries - 1)
+    end
+  end
+end
@@ -17,14 +17,14 @@ defmodule MuonTrapTest.Case do
 
   @spec cpu_cgroup_exists(String.t()) :: boolean
   def cpu_cgroup_exists(path) do
-    {rc, 0} = System.cmd("cgget", ["-g", "cpu", path], stderr_to_stdout: true)
-    String.match?(rc, ~r/cpu.shares/)
+    {_version, dir} = MuonTrap.Cgroups.group_dir("cpu", path)
+    File.dir?(dir)
   end
 
   @spec memory_cgroup_exists(String.t()) :: boolean
   def memory_cgroup_exists(path) do
-    {rc, 0} = System.cmd("cgget", ["-g", "memory", path], stderr_to_stdout: true)
-    String.match?(rc, ~r/memory.stat/)
+    {_version, dir} = MuonTrap.Cgroups.group_dir("memory", path)
+    File.dir?(dir)
   end
 
   @spec random_cgroup_path :: String.t()
@@ -32,6 +32,19 @@ defmodule MuonTrapTest.Case do
     "muontrap_test/test#{:rand.uniform(10000)}"
   end
 
+  # The fake cgroupfs exits when the test process does
+  @spec start_fake_cgroupfs([String.t()]) :: {Path.t(), port()}
+  def start_fake_cgroupfs(args) do
+    root = Path.join(System.tmp_dir!(), "muontrap_cgroupfs#{:rand.uniform(10000)}")
+    File.rm_rf!(root)
+    on_exit(fn -> File.rm_rf!(root) end)
+
+    port = Port.open({:spawn_executable, test_path("fake_cgroupfs.test")}, args: args ++ [root])
+
+    assert_receive {^port, {:data, 'ready\n'}}
+    {root, port}
+  end
+
   @spec is_os_pid_around?(non_neg_integer()) :: boolean
   def is_os_pid_around?(os_pid) do
     {_, rc} = System.cmd("ps", ["-p", "#{os_pid}"])
@@ -21,6 +21,6 @@ case :os.type() do
     MuonTrapTestHelpers.check_cgroup_support()
 
   _ ->
-    IO.puts(:stderr, "Not on Linux so skipping tests that use cgroups...")
-    ExUnit.configure(exclude: :cgroup)
+    IO.puts(:stderr, "Not on Linux so skipping tests that use cgroups or namespaces...")
+    ExUnit.configure(exclude: [:cgroup, :subreaper, :pid_namespace, :fake_cgroupfs])
 end